@@ -0,0 +1,166 @@
+/*---------------------------------------------------------------------------
+dbcmd
+bench/timestamp.c
+GPL v3.0
+
+Checks and times dropbox_parse_timestamp(), which is called twice for
+every file in a listing. Run with 'make bench'.
+
+The check formats a time for every day from 1900 to 2100, at a
+different time of day each, with dropbox_format_timestamp(), which uses
+gmtime_r(), and parses it back; any time that doesn't come back the
+same is reported. A few malformed timestamps must parse to 0.
+
+The benchmark parses a set of realistic timestamps over and over, and
+reports the cost of one parse. For comparison, it times the method
+that dbcmd used before, of setting TZ to UTC and calling mktime(),
+with TZ unset, and with it set to a real zone.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "dropbox.h"
+
+#define BENCH_FIRST_DAY   (-25567)  // 1900-01-01
+#define BENCH_LAST_DAY    47482     // 2100-01-01
+#define BENCH_SAMPLES     1024
+#define BENCH_PARSES      4000000
+#define BENCH_OLD_PARSES  100000
+
+
+/*---------------------------------------------------------------------------
+bench_now_ns
+---------------------------------------------------------------------------*/
+static int64_t bench_now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+
+/*---------------------------------------------------------------------------
+bench_parse_mktime
+How timestamps used to be parsed, for comparison
+---------------------------------------------------------------------------*/
+static time_t bench_parse_mktime (const char *s)
+  {
+  char *old_tz = getenv ("TZ");
+  if (old_tz) old_tz = strdup (old_tz);
+  setenv ("TZ", "UTC0", 1);
+  tzset ();
+
+  struct tm tm;
+  memset (&tm, 0, sizeof (struct tm));
+  strptime (s, "%FT%TZ", &tm);
+  time_t t = mktime (&tm);
+
+  if (old_tz)
+    setenv ("TZ", old_tz, 1);
+  else
+    unsetenv ("TZ");
+  tzset ();
+  free (old_tz);
+  return t;
+  }
+
+
+/*---------------------------------------------------------------------------
+bench_check
+Returns the number of failures
+---------------------------------------------------------------------------*/
+static int bench_check (void)
+  {
+  int failures = 0;
+  int checked = 0;
+  int64_t day;
+  for (day = BENCH_FIRST_DAY; day <= BENCH_LAST_DAY; day++)
+    {
+    // Vary the time of day, to cover every hour, minute and second
+    int64_t second = (day * 7919 % 86400 + 86400) % 86400;
+    time_t t = (time_t)(day * 86400 + second);
+    char s[21];
+    dropbox_format_timestamp (t, s);
+    time_t parsed = dropbox_parse_timestamp (s);
+    checked++;
+    if (parsed != t)
+      {
+      if (failures < 10)
+        printf ("Mismatch: %s parsed as %ld, not %ld\n", s,
+          (long)parsed, (long)t);
+      failures++;
+      }
+    }
+
+  static const char *malformed[] =
+    {
+    "", "2017-03-01", "2017-03-01 14:23:05Z", "2017-13-01T14:23:05Z",
+    "2017-03-00T14:23:05Z", "2017-03-01T24:23:05Z", "2017-03-01T14:60:05Z",
+    "20x7-03-01T14:23:05Z", "2017/03/01T14:23:05Z", NULL
+    };
+  int i;
+  for (i = 0; malformed[i]; i++)
+    {
+    checked++;
+    if (dropbox_parse_timestamp (malformed[i]) != 0)
+      {
+      printf ("Malformed '%s' was not rejected\n", malformed[i]);
+      failures++;
+      }
+    }
+
+  printf ("Round trip: %d timestamp(s) checked, %d failure(s)\n",
+    checked, failures);
+  return failures;
+  }
+
+
+/*---------------------------------------------------------------------------
+bench_time
+Nanoseconds per call of parse, over n calls
+---------------------------------------------------------------------------*/
+static double bench_time (time_t (*parse)(const char *),
+    char samples[][21], int n)
+  {
+  volatile time_t sink = 0;
+  int64_t start = bench_now_ns ();
+  int i;
+  for (i = 0; i < n; i++)
+    sink += parse (samples[i % BENCH_SAMPLES]);
+  (void)sink;
+  return (double)(bench_now_ns () - start) / n;
+  }
+
+
+/*---------------------------------------------------------------------------
+main
+---------------------------------------------------------------------------*/
+int main (void)
+  {
+  int failures = bench_check ();
+
+  // Times spread over recent years, as a listing would have
+  static char samples[BENCH_SAMPLES][21];
+  srand (1);
+  int i;
+  for (i = 0; i < BENCH_SAMPLES; i++)
+    dropbox_format_timestamp (1262304000 + (time_t)rand () % 500000000,
+      samples[i]);
+
+  printf ("dropbox_parse_timestamp: %.1f ns per timestamp\n",
+    bench_time (dropbox_parse_timestamp, samples, BENCH_PARSES));
+
+  unsetenv ("TZ");
+  printf ("Old method, TZ unset: %.1f ns per timestamp\n",
+    bench_time (bench_parse_mktime, samples, BENCH_OLD_PARSES));
+  setenv ("TZ", "Europe/London", 1);
+  printf ("Old method, TZ=Europe/London: %.1f ns per timestamp\n",
+    bench_time (bench_parse_mktime, samples, BENCH_OLD_PARSES));
+
+  return failures == 0 ? 0 : 1;
+  }
+
@@ -0,0 +1,159 @@
+/*---------------------------------------------------------------------------
+dbcmd
+arena.c
+GPL v3.0
+
+A simple bump allocator. Memory is taken from large blocks, and can only
+be released all at once, by destroying the arena. Pointers returned by
+arena_alloc() remain valid until then -- blocks are never moved.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+// All allocations are aligned to this boundary, which is enough for
+//  any of the structures we store
+#define ARENA_ALIGN 16
+
+typedef struct _ArenaBlock
+  {
+  struct _ArenaBlock *next;
+  size_t size;
+  size_t used;
+  // Block data follows, aligned
+  } ArenaBlock;
+
+#define ARENA_HEADER_SIZE \
+  ((sizeof (ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct _Arena
+  {
+  ArenaBlock *head;
+  size_t block_size;
+  size_t allocated;
+  };
+
+
+/*---------------------------------------------------------------------------
+arena_new_block
+---------------------------------------------------------------------------*/
+static ArenaBlock *arena_new_block (size_t size)
+  {
+  ArenaBlock *b = malloc (ARENA_HEADER_SIZE + size);
+  if (!b) return NULL;
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+  }
+
+
+/*---------------------------------------------------------------------------
+arena_create
+---------------------------------------------------------------------------*/
+Arena *arena_create (size_t block_size)
+  {
+  Arena *self = malloc (sizeof (Arena));
+  memset (self, 0, sizeof (Arena));
+  if (block_size < 1024) block_size = 1024;
+  self->block_size = block_size;
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+arena_destroy
+---------------------------------------------------------------------------*/
+void arena_destroy (Arena *self)
+  {
+  if (!self) return;
+  ArenaBlock *b = self->head;
+  while (b)
+    {
+    ArenaBlock *next = b->next;
+    free (b);
+    b = next;
+    }
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+arena_alloc
+Returns uninitialized memory, or NULL if the system is out of memory
+---------------------------------------------------------------------------*/
+void *arena_alloc (Arena *self, size_t size)
+  {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (size == 0) size = ARENA_ALIGN;
+
+  ArenaBlock *b = self->head;
+  if (b == NULL || b->size - b->used < size)
+    {
+    if (size > self->block_size / 4)
+      {
+      // A large allocation gets a block of its own. It goes behind the
+      //   current block, so the space left in that block is not wasted
+      ArenaBlock *big = arena_new_block (size);
+      if (!big) return NULL;
+      big->used = size;
+      if (b)
+        {
+        big->next = b->next;
+        b->next = big;
+        }
+      else
+        self->head = big;
+      self->allocated += size;
+      return (char *)big + ARENA_HEADER_SIZE;
+      }
+    b = arena_new_block (self->block_size);
+    if (!b) return NULL;
+    b->next = self->head;
+    self->head = b;
+    }
+
+  void *ret = (char *)b + ARENA_HEADER_SIZE + b->used;
+  b->used += size;
+  self->allocated += size;
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+arena_strndup
+---------------------------------------------------------------------------*/
+char *arena_strndup (Arena *self, const char *s, size_t n)
+  {
+  char *ret = arena_alloc (self, n + 1);
+  if (ret)
+    {
+    memcpy (ret, s, n);
+    ret[n] = 0;
+    }
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+arena_strdup
+---------------------------------------------------------------------------*/
+char *arena_strdup (Arena *self, const char *s)
+  {
+  return arena_strndup (self, s, strlen (s));
+  }
+
+
+/*---------------------------------------------------------------------------
+arena_get_allocated
+Returns the number of bytes handed out so far (including alignment)
+---------------------------------------------------------------------------*/
+size_t arena_get_allocated (const Arena *self)
+  {
+  return self->allocated;
+  }
+
@@ -0,0 +1,24 @@
+/*---------------------------------------------------------------------------
+dbcmd
+arena.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stddef.h>
+
+// Default block size for an arena. Most Dropbox API responses, parsed,
+//  fit in a single block of this size
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct _Arena;
+typedef struct _Arena Arena;
+
+Arena  *arena_create (size_t block_size);
+void    arena_destroy (Arena *self);
+void   *arena_alloc (Arena *self, size_t size);
+char   *arena_strdup (Arena *self, const char *s);
+char   *arena_strndup (Arena *self, const char *s, size_t n);
+size_t  arena_get_allocated (const Arena *self);
+
@@ -16,13 +16,15 @@ GPL v3.0
 #include <dirent.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <fnmatch.h>
 #include "cJSON.h"
 #include "dropbox.h"
 #include "token.h"
 #include "commands.h"
 #include "log.h"
 #include "errmsg.h"
+#include "matcher.h"
+#include "records.h"
+#include "hashindex.h"
 
 
 /*==========================================================================
@@ -142,8 +144,12 @@ int cmd_delete_prompt_delete_list (const CmdContext *context,
   log_debug ("dir=%s, spec=%s", dir, spec);
 
   char *error = NULL;
-  List *list = dropbox_stat_create_list();
-  dropbox_list_files (token, dir, list, FALSE, recursive, &error);
+  // Only the entries that match are kept, as they are listed
+  Matcher *matcher = matcher_create (spec);
+  DBStatStore *store = dropbox_stat_store_create();
+  dropbox_stat_store_set_filter (store, finder_matches, matcher);
+  finder_find (token, dir, spec, store, FALSE, recursive, 
+    context->list_jobs, context->search, NULL, NULL, &error);
 
   if (error)
     {
@@ -155,19 +161,10 @@ int cmd_delete_prompt_delete_list (const CmdContext *context,
     {
     List *globbed_list = list_create (free);
        
-    int i, l = list_length (list);
+    int i, l = dropbox_stat_store_length (store);
     for (i = 0; i < l; i++)
-      {
-      const DBStat *stat = list_get (list, i);
-      const char *path = dropbox_stat_get_path (stat); 
-      char *pathcopy = strdup (path);
-      char *filename = basename (pathcopy);
-        // Not sure about this logic
-      if ((fnmatch (spec, path, 0) == 0)
-          || (fnmatch (spec, filename, 0) == 0))
-        list_append (globbed_list, strdup (path)); 
-      free (pathcopy);
-      } 
+      list_append (globbed_list, 
+        strdup (dropbox_stat_get_path (dropbox_stat_store_get (store, i)))); 
       
     l = list_length (globbed_list);
     if (l == 0)
@@ -202,6 +199,8 @@ int cmd_delete_prompt_delete_list (const CmdContext *context,
     list_destroy (globbed_list);
     }
 
+  dropbox_stat_store_destroy (store);
+  matcher_destroy (matcher);
   free (dir);
   free (spec);
   free (path);
@@ -211,6 +210,96 @@ int cmd_delete_prompt_delete_list (const CmdContext *context,
   }
 
 
+/*==========================================================================
+cmd_delete_lower
+The lower-case form of a path, as a key. Only ASCII letters are changed,
+which is enough to recognize paths that came from the same listing
+*==========================================================================*/
+static char *cmd_delete_lower (const char *path)
+  {
+  char *ret = strdup (path);
+  char *p;
+  for (p = ret; *p; p++)
+    if (*p >= 'A' && *p <= 'Z') *p += 'a' - 'A';
+  return ret;
+  }
+
+
+/*==========================================================================
+cmd_delete_stdin
+Delete the paths read from standard input, one to a line, or in the 
+form that find --long writes them, without listing the server. Since
+standard input can't also answer a prompt, --yes or --dry-run is
+needed. Anything inside a folder that has already been deleted is 
+skipped, as it is gone already
+*==========================================================================*/
+static int cmd_delete_stdin (const CmdContext *context, const char *token,
+     const char *argv0)
+  {
+  IN
+  int ret = 0;
+  if (!context->yes && !context->dry_run)
+    {
+    log_error ("%s: %s: %s", argv0, ERROR_USAGE, 
+      "Reading paths from standard input needs --yes or --dry-run");
+    OUT
+    return EINVAL;
+    }
+
+  HashIndex *deleted = hashindex_create ();
+  List *keys = list_create (free);
+  char *line = NULL;
+  size_t n = 0;
+  int count = 0;
+  while (getline (&line, &n, stdin) >= 0)
+    {
+    DBStat stat;
+    records_parse (line, &stat);
+    const char *path = stat.path;
+    if (path[0] == 0) continue;
+    if (path[0] != '/')
+      {
+      log_error ("%s: %s: %s", argv0, ERROR_STARTSLASH, path);
+      ret = EINVAL;
+      continue;
+      }
+
+    char *key = cmd_delete_lower (path);
+    BOOL gone = FALSE;
+    const char *p;
+    for (p = strchr (key + 1, '/'); p && !gone; p = strchr (p + 1, '/'))
+      gone = hashindex_get (deleted, key, p - key) != NULL;
+    if (gone || hashindex_get (deleted, key, strlen (key)))
+      {
+      log_debug ("'%s' is already deleted", path);
+      free (key);
+      continue;
+      }
+
+    int r = cmd_delete_item (context, token, path);
+    count++;
+    if (r)
+      {
+      // Whatever is inside it is still on the server
+      ret = r;
+      free (key);
+      continue;
+      }
+    hashindex_put (deleted, key, strlen (key), key, FALSE);
+    list_append (keys, key);
+    }
+  free (line);
+
+  if (count == 0)
+    log_warning ("%s: %s", argv0, ERROR_NOMATCHING);
+
+  hashindex_destroy (deleted);
+  list_destroy (keys);
+  OUT
+  return ret;
+  }
+
+
 /*==========================================================================
 cmd_get
 *==========================================================================*/
@@ -229,6 +318,26 @@ int cmd_delete (const CmdContext *context, int argc, char **argv)
     return EINVAL;
     }
 
+  if (strcmp (argv[1], "-") == 0)
+    {
+    char *error = NULL;
+    char *token = token_init (&error);
+    if (token)
+      {
+      ret = cmd_delete_stdin (context, token, argv[0]);
+      free (token);
+      }
+    else
+      {
+      log_error ("%s: %s: %s", 
+         argv[0], ERROR_INITTOKEN, error);
+      free (error);
+      ret = EBADRQC;
+      }
+    OUT
+    return ret;
+    }
+
   char *remote_spec = strdup (argv [1]);
   log_debug ("remote_spec is %s", remote_spec);
 
@@ -274,6 +383,9 @@ int cmd_delete (const CmdContext *context, int argc, char **argv)
 	  ret = cmd_delete_prompt_delete_list 
 	    (context, token, remote_spec);
 	  break;
+	case DBSTAT_DELETED:
+	  // Only appears in lists of changes
+	  break;
 	}
       } 
 
@@ -0,0 +1,259 @@
+/*---------------------------------------------------------------------------
+dbcmd
+cmd_du.c
+GPL v3.0
+
+Adds up the sizes of the files in each folder on the server, as they
+are listed. Nothing is kept of the files themselves: the listing's store
+has a filter that adds each file to the folder that holds it, down to
+--max-depth, and then turns it away. So memory use depends on the
+number of folders shown, not the number of files. Each file is counted
+only in its own folder, or the deepest one shown above it, and the
+totals are carried up to the folders above at the end.
+---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "dropbox.h"
+#include "token.h"
+#include "commands.h"
+#include "log.h"
+#include "errmsg.h"
+#include "misc.h"
+#include "hashindex.h"
+
+// A folder that is shown. Its total size and most recent modification
+//   time are kept in its DBStat
+typedef struct _DuFolder
+  {
+  DBStat *stat;             // In DuRun's store
+  struct _DuFolder *parent; // NULL for the top folder
+  int64_t files;
+  } DuFolder;
+
+typedef struct _DuRun
+  {
+  size_t root_len;      // Length of the path of the top folder
+  int max_depth;        // -1 for no limit
+  DBStatStore *store;   // One entry for each folder, in the same order...
+  DuFolder **folders;   // ...as these; parents come before children
+  uint32_t nfolders;
+  uint32_t max_folders;
+  HashIndex *index;     // By the lower-case path
+  } DuRun;
+
+
+/*==========================================================================
+cmd_du_folder
+The folder whose path is the first len characters of path, which is
+added, with the folders above it, if it is new
+*==========================================================================*/
+static DuFolder *cmd_du_folder (DuRun *run, const char *path,
+    const char *path_lower, size_t len)
+  {
+  // The top folder is looked up by length, in case it was given in a
+  //   different case from the server's
+  if (len == run->root_len && run->nfolders > 0) return run->folders[0];
+  DuFolder *folder = hashindex_get (run->index, path_lower, len);
+  if (folder) return folder;
+
+  DuFolder *parent = NULL;
+  if (len > run->root_len)
+    {
+    size_t l = len;
+    while (l > run->root_len && path[l - 1] != '/') l--;
+    parent = cmd_du_folder (run, path, path_lower,
+      l > run->root_len ? l - 1 : run->root_len);
+    }
+
+  char *p = strndup (path, len);
+  char *pl = strndup (path_lower, len);
+  folder = malloc (sizeof (DuFolder));
+  folder->stat = dropbox_stat_store_add (run->store, p, pl, DBSTAT_FOLDER);
+  folder->parent = parent;
+  folder->files = 0;
+  free (pl);
+  free (p);
+
+  if (run->nfolders == run->max_folders)
+    {
+    run->max_folders = run->max_folders ? run->max_folders * 2 : 64;
+    run->folders = realloc (run->folders,
+      run->max_folders * sizeof (DuFolder *));
+    }
+  run->folders[run->nfolders++] = folder;
+  hashindex_put (run->index, folder->stat->path_lower, len, folder, FALSE);
+  return folder;
+  }
+
+
+/*==========================================================================
+cmd_du_filter
+Add a file to the folder that it is counted in, and make sure that a
+folder that is shown is there, even if it is empty. Returns FALSE, so
+the listing keeps nothing
+*==========================================================================*/
+static BOOL cmd_du_filter (const DBStat *stat, void *user)
+  {
+  DuRun *run = user;
+  const char *path = stat->path;
+  const char *path_lower = stat->path_lower ? stat->path_lower : path;
+  size_t l = strlen (path);
+  if (l < run->root_len) return FALSE;
+  // Folders are matched by the lower-case path, which only works if it
+  //   lines up with the path itself
+  if (strlen (path_lower) != l) path_lower = path;
+
+  // Find the end of the deepest folder shown that contains the entry,
+  //   or, for a folder, is the entry
+  size_t end = run->root_len;
+  int depth = 0;
+  const char *p = path + run->root_len;
+  while (*p == '/' && (run->max_depth < 0 || depth < run->max_depth))
+    {
+    const char *next = strchr (p + 1, '/');
+    if (!next)
+      {
+      if (stat->type == DBSTAT_FOLDER) end = l;
+      break;
+      }
+    end = next - path;
+    depth++;
+    p = next;
+    }
+
+  DuFolder *folder = cmd_du_folder (run, path, path_lower, end);
+  if (stat->type == DBSTAT_FILE)
+    {
+    folder->files++;
+    folder->stat->length += stat->length;
+    if (stat->server_modified > folder->stat->server_modified)
+      folder->stat->server_modified = stat->server_modified;
+    }
+  return FALSE;
+  }
+
+
+/*==========================================================================
+cmd_du_show
+*==========================================================================*/
+static void cmd_du_show (const CmdContext *context, const DuRun *run)
+  {
+  // Folders are added before anything in them, so each folder's totals
+  //   are complete by the time they are added to its parent's
+  uint32_t i;
+  for (i = run->nfolders; i-- > 1; )
+    {
+    const DuFolder *folder = run->folders[i];
+    DuFolder *parent = folder->parent;
+    parent->files += folder->files;
+    parent->stat->length += folder->stat->length;
+    if (folder->stat->server_modified > parent->stat->server_modified)
+      parent->stat->server_modified = folder->stat->server_modified;
+    }
+
+  RankBy by = context->sort == RANK_NONE ? RANK_NAME : context->sort;
+  uint32_t *order = ranking_sort_store (run->store, by);
+  uint32_t l = run->nfolders;
+  if (context->top > 0 && (uint32_t)context->top < l) l = context->top;
+  for (i = 0; i < l; i++)
+    {
+    const DuFolder *folder = run->folders[order[i]];
+    const char *path = dropbox_stat_get_path (folder->stat);
+    char *size;
+    if (context->long_)
+      asprintf (&size, "%ld", folder->stat->length);
+    else
+      misc_format_size (folder->stat->length, &size);
+    printf ("%12s %9ld  %s\n", size, folder->files,
+      path[0] ? path : "/");
+    free (size);
+    }
+  free (order);
+  }
+
+
+/*==========================================================================
+cmd_du
+*==========================================================================*/
+int cmd_du (const CmdContext *context, int argc, char **argv)
+  {
+  int ret = 0;
+  char *error = NULL;
+  char *path = NULL;
+
+  log_debug ("Starting du command");
+
+  if (argc > 2)
+    {
+    log_error ("%s: %s: %s", argv[0], ERROR_USAGE,
+       "This command takes at most one argument");
+    return EINVAL;
+    }
+
+  if (argc < 2 || strcmp (argv[1], "/") == 0)
+    path = strdup (""); // Root
+  else
+    path = strdup (argv[1]);
+
+  if (path[0] == 0 || path[0] == '/')
+    {
+    if (strlen (path) > 1 && path[strlen(path) - 1] == '/')
+      path[strlen(path) - 1] = 0;
+
+    char *token = token_init (&error);
+    if (token)
+      {
+      DuRun run;
+      memset (&run, 0, sizeof (run));
+      run.root_len = strlen (path);
+      run.max_depth = context->max_depth;
+      run.store = dropbox_stat_store_create ();
+      run.index = hashindex_create ();
+      cmd_du_folder (&run, path, path, run.root_len);
+
+      DBStatStore *listing = dropbox_stat_store_create ();
+      dropbox_stat_store_set_filter (listing, cmd_du_filter, &run);
+      dropbox_list_parallel (token, path, listing, TRUE, TRUE,
+        context->list_jobs, NULL, NULL, &error);
+      dropbox_stat_store_destroy (listing);
+
+      if (error)
+        {
+        log_error ("%s: %s: %s", argv[0], ERROR_CANTLISTSERVER, error);
+        free (error);
+        ret = -1;
+        }
+      else
+        cmd_du_show (context, &run);
+
+      uint32_t i;
+      for (i = 0; i < run.nfolders; i++)
+        free (run.folders[i]);
+      free (run.folders);
+      hashindex_destroy (run.index);
+      dropbox_stat_store_destroy (run.store);
+      free (token);
+      }
+    else
+      {
+      log_error ("%s: %s: %s",
+	argv[0], ERROR_INITTOKEN, error);
+      free (error);
+      ret = EBADRQC;
+      }
+    }
+  else
+    {
+    log_error ("%s: %s",
+      argv[0], ERROR_STARTSLASH);
+    ret = EINVAL;
+    }
+
+  free (path);
+  return ret;
+  }
+
+
@@ -0,0 +1,135 @@
+/*---------------------------------------------------------------------------
+dbcmd
+cmd_find.c
+GPL v3.0
+
+Lists the files and folders in a tree on the server that pass the tests
+given by --name, --size, --mtime, --client-mtime and --type (see
+predicates.c). The tests are applied by the listing's filter, as each
+page is decoded, and an entry that passes is written out straight away;
+nothing is kept, so a find over a huge tree uses no more memory than
+one over a small folder. With --long, entries are written in the form
+that get and delete read from standard input (see records.c).
+---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "dropbox.h"
+#include "token.h"
+#include "commands.h"
+#include "log.h"
+#include "errmsg.h"
+#include "records.h"
+
+typedef struct _FindRun
+  {
+  const CmdContext *context;
+  time_t now;
+  int found;
+  } FindRun;
+
+
+/*==========================================================================
+cmd_find_filter
+Write out an entry that passes the tests. Returns FALSE, so the listing
+keeps nothing
+*==========================================================================*/
+static BOOL cmd_find_filter (const DBStat *stat, void *user)
+  {
+  FindRun *run = user;
+  if (!predicates_match (run->context->predicates, stat, run->now))
+    return FALSE;
+  run->found++;
+  if (run->context->long_)
+    records_write (stdout, stat);
+  else
+    printf ("%s\n", stat->path);
+  return FALSE;
+  }
+
+
+/*==========================================================================
+cmd_find
+*==========================================================================*/
+int cmd_find (const CmdContext *context, int argc, char **argv)
+  {
+  int ret = 0;
+  char *error = NULL;
+  char *path = NULL;
+
+  log_debug ("Starting find command");
+
+  if (argc > 2)
+    {
+    log_error ("%s: %s: %s", argv[0], ERROR_USAGE,
+       "This command takes at most one argument");
+    return EINVAL;
+    }
+
+  if (argc < 2 || strcmp (argv[1], "/") == 0)
+    path = strdup (""); // Root
+  else
+    path = strdup (argv[1]);
+
+  if (path[0] == 0 || path[0] == '/')
+    {
+    if (strlen (path) > 1 && path[strlen(path) - 1] == '/')
+      path[strlen(path) - 1] = 0;
+
+    char *token = token_init (&error);
+    if (token)
+      {
+      // Whatever reads the output should get each entry as soon as it
+      //   is found, not when a buffer fills
+      setvbuf (stdout, NULL, _IOLBF, 0);
+
+      FindRun run;
+      run.context = context;
+      run.now = time (NULL);
+      run.found = 0;
+
+      // A name pattern can let the server's search find the candidates,
+      //   rather than listing the whole tree; a path pattern can't
+      const char *spec = predicates_get_name (context->predicates);
+      if (!spec || strchr (spec, '/')) spec = "*";
+
+      DBStatStore *store = dropbox_stat_store_create ();
+      dropbox_stat_store_set_filter (store, cmd_find_filter, &run);
+      finder_find (token, path, spec, store, TRUE, TRUE,
+        context->list_jobs, context->search, NULL, NULL, &error);
+      dropbox_stat_store_destroy (store);
+
+      if (error)
+        {
+        log_error ("%s: %s: %s", argv[0], ERROR_CANTLISTSERVER, error);
+        free (error);
+        ret = -1;
+        }
+      else
+        log_debug ("Found %d item(s)", run.found);
+
+      free (token);
+      }
+    else
+      {
+      log_error ("%s: %s: %s",
+	argv[0], ERROR_INITTOKEN, error);
+      free (error);
+      ret = EBADRQC;
+      }
+    }
+  else
+    {
+    log_error ("%s: %s",
+      argv[0], ERROR_STARTSLASH);
+    ret = EINVAL;
+    }
+
+  free (path);
+  return ret;
+  }
+
+
@@ -16,14 +16,39 @@ GPL v3.0
 #include <dirent.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <fnmatch.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <ctype.h>
 #include "cJSON.h"
 #include "dropbox.h"
+#include "cursors.h"
 #include "token.h"
 #include "commands.h"
 #include "log.h"
 #include "errmsg.h"
 #include "misc.h"
+#include "pipeline.h"
+#include "planner.h"
+#include "journal.h"
+#include "hashindex.h"
+#include "arena.h"
+#include "zipstream.h"
+#include "matcher.h"
+#include "records.h"
+
+// Each stage of the pipeline can have this many files per thread 
+//   queued in front of it
+#define GET_QUEUED_PER_THREAD 4
+
+// Counters may be updated by several stages at once
+#define COUNT(field) __atomic_add_fetch (&counters->field, 1, __ATOMIC_RELAXED)
+
+// The largest folder the server will send as a zip, the largest file
+//   that may be in it, and the most entries it may have
+#define GET_ZIP_MAX_BYTES (20LL * 1024 * 1024 * 1024)
+#define GET_ZIP_MAX_FILE_BYTES (4LL * 1024 * 1024 * 1024)
+#define GET_ZIP_MAX_ENTRIES 10000
 
 
 /*==========================================================================
@@ -37,8 +62,103 @@ typedef struct _Counters
   int download_failed;
   int downloaded;
   int skip_too_old;
+  int deleted_local;
+  int skip_done;
+  int copied_local;
   } Counters;
 
+// Each file selected from the listing is first checked against any
+//   local copy, and then, if necessary, downloaded
+enum {GET_STAGE_VERIFY, GET_STAGE_DOWNLOAD};
+
+// A local file whose content is known to match a content hash, as long
+//   as it still has the same size and modification time
+typedef struct _GetLocalCopy
+  {
+  const char *path;
+  int64_t size;
+  time_t mtime;
+  } GetLocalCopy;
+
+// The local files that are up to date, by content hash, so that a
+//   download can be replaced by a local copy
+typedef struct _GetCopies
+  {
+  pthread_mutex_t mutex;
+  HashIndex *by_hash;
+  Arena *arena; // Of GetLocalCopy and their paths
+  } GetCopies;
+
+// Everything the stages share
+typedef struct _GetRun
+  {
+  const char *token;
+  const CmdContext *context;
+  Counters *counters;
+  const char *argv0;
+  List *planned; // With --plan, files waiting to be scheduled
+  Journal *journal; // Files already done, for --resume, or NULL
+  GetCopies *copies; // Local files that downloads could be copied from
+  int left_out;     // Entries left out of the listing by the pattern,
+  int64_t left_out_bytes; //   the rules, or --days-old, which a zip
+  int64_t left_out_largest; //   of the folder still contains
+  } GetRun;
+
+// A get that is repeated, by cmd_watch, with the same pipeline each
+//   time, so that its threads, and their connections to the server, 
+//   are not set up again for every round
+struct _GetSync
+  {
+  GetRun run;
+  Counters counters;
+  Pipeline *pipeline;
+  };
+
+// A file, on its way through the pipeline. The DBStat belongs to the
+//   listing, which outlives the pipeline. A batch of files goes to the
+//   download stage as a chain
+typedef struct _GetItem
+  {
+  const DBStat *stat;
+  char *target;
+  struct _GetItem *next;
+  } GetItem;
+
+// A folder being downloaded as a zip, and unpacked as it arrives
+typedef struct _GetZip
+  {
+  GetRun *run;
+  const char *parent; // Of the folder, which is the zip's top level
+  HashIndex *items;   // Lower-case remote path to GetItem, until done
+  ZipStream *stream;
+  char *error;        // Why the zip couldn't be read
+  char *last_dir;     // The directory that was made last
+  int extracted;
+  } GetZip;
+
+// An entry of a zip that is being written to a local file
+typedef struct _GetZipEntry
+  {
+  GetItem *item;
+  char *key;
+  int fd;
+  int write_errno;
+  } GetZipEntry;
+
+// What to pick out of a listing as it arrives, and where it goes
+typedef struct _GetSelect
+  {
+  GetRun *run;
+  Pipeline *pipeline; // NULL while selected entries are being held back
+  Matcher *remote;
+  Matcher *spec;
+  const char *local;
+  int prefix_len;
+  BOOL local_is_dir;
+  List *held;         // Entries held back, of the listing's DBStats
+  int selected;
+  } GetSelect;
+
 
 /*==========================================================================
 Forward
@@ -51,177 +171,945 @@ cmd_get_progress_func
 *==========================================================================*/
 static void cmd_get_progress_func (int64_t transferred, int64_t total)
   {
-  if (isatty (STDIN_FILENO))
+  misc_show_progress ("Downloaded", transferred, total);
+  }
+
+
+/*==========================================================================
+cmd_get_item_free
+Frees the whole chain, if the item is the head of one
+*==========================================================================*/
+static void cmd_get_item_free (void *p)
+  {
+  GetItem *item = p;
+  while (item)
     {
-    if (transferred < 0)
-      {
-      printf ("\n"); // Clear progress line when done
-      }
-    else
-      {
-      char *s_transferred, *s_total;
-      misc_format_size (transferred, &s_transferred);
-      misc_format_size (total, &s_total);
-      char *line;
-      asprintf (&line, "Downloaded %s of %s", s_transferred, s_total);
-      printf (line);
-      int i, l = strlen (line);
-      for (i = l; i < 40; i++) fputs (" ", stdout);
-      printf ("\r"); 
-      fflush (stdout);
-      free (line);
-      free (s_transferred);
-      free (s_total);
-      }
+    GetItem *next = item->next;
+    free (item->target);
+    free (item);
+    item = next;
     }
   }
 
 
 /*==========================================================================
-cmd_get_consider_and_download
+cmd_get_journal_find
+Whether a file was downloaded by an interrupted run: the journal must
+have the same content hash as the server has now, and the local file
+must not have been touched since
+*==========================================================================*/
+static BOOL cmd_get_journal_find (const GetRun *run, const DBStat *dbstat, 
+    const char *target)
+  {
+  JournalEntry done;
+  struct stat sb;
+  return run->context->resume 
+    && journal_find (run->journal, target, &done) && done.has_hash 
+    && dropbox_stat_hash_equals (dbstat, done.hash)
+    && stat (target, &sb) == 0 && sb.st_size == done.size 
+    && sb.st_mtime == done.mtime;
+  }
+
+
+/*==========================================================================
+cmd_get_quick_check
+Whether the local copy has the same size as the remote file, and the 
+same modification time as the remote file's client_modified time
 *==========================================================================*/
-static void cmd_get_consider_and_download (const char *token, 
-    const CmdContext *context, 
-    const char *source, const char *target, 
-    Counters *counters, const char *argv0)
+static BOOL cmd_get_quick_check (const DBStat *dbstat, const char *target)
   {
-  BOOL dry_run = context->dry_run;
+  struct stat sb;
+  return stat (target, &sb) == 0 && S_ISREG (sb.st_mode)
+    && sb.st_size == dropbox_stat_get_length (dbstat)
+    && sb.st_mtime == dropbox_stat_get_client_modified (dbstat);
+  }
 
-  counters->total_items++;
+
+/*==========================================================================
+cmd_get_copies_create
+*==========================================================================*/
+static GetCopies *cmd_get_copies_create (void)
+  {
+  GetCopies *self = malloc (sizeof (GetCopies));
+  pthread_mutex_init (&self->mutex, NULL);
+  self->by_hash = hashindex_create ();
+  self->arena = arena_create (ARENA_BLOCK_SIZE);
+  return self;
+  }
+
+
+/*==========================================================================
+cmd_get_copies_destroy
+*==========================================================================*/
+static void cmd_get_copies_destroy (GetCopies *self)
+  {
+  if (!self) return;
+  hashindex_destroy (self->by_hash);
+  arena_destroy (self->arena);
+  pthread_mutex_destroy (&self->mutex);
+  free (self);
+  }
+
+
+/*==========================================================================
+cmd_get_copies_add
+Note that a local file has the content of a remote file
+*==========================================================================*/
+static void cmd_get_copies_add (GetCopies *self, const DBStat *dbstat, 
+    const char *path)
+  {
+  const unsigned char *hash = dropbox_stat_get_hash_raw (dbstat);
+  struct stat sb;
+  if (!self || !hash || stat (path, &sb) != 0) return;
+  pthread_mutex_lock (&self->mutex);
+  GetLocalCopy *c = hashindex_get (self->by_hash, hash, DBHASH_RAW_LENGTH);
+  if (!c)
+    {
+    c = arena_alloc (self->arena, sizeof (GetLocalCopy));
+    hashindex_put (self->by_hash, hash, DBHASH_RAW_LENGTH, c, TRUE);
+    }
+  c->path = arena_strdup (self->arena, path);
+  c->size = sb.st_size;
+  c->mtime = sb.st_mtime;
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*==========================================================================
+cmd_get_copies_find
+Returns the path of a local file with the content of a remote file, 
+which the caller must free, or NULL. A file that has changed size or
+time since it was noted is not used
+*==========================================================================*/
+static char *cmd_get_copies_find (GetCopies *self, const DBStat *dbstat)
+  {
+  const unsigned char *hash = dropbox_stat_get_hash_raw (dbstat);
+  if (!self || !hash) return NULL;
+  char *ret = NULL;
+  pthread_mutex_lock (&self->mutex);
+  const GetLocalCopy *c = hashindex_get (self->by_hash, hash, 
+    DBHASH_RAW_LENGTH);
+  if (c) ret = strdup (c->path);
+  int64_t size = c ? c->size : 0;
+  time_t mtime = c ? c->mtime : 0;
+  pthread_mutex_unlock (&self->mutex);
+
+  struct stat sb;
+  if (ret && (stat (ret, &sb) != 0 || sb.st_size != size 
+       || sb.st_mtime != mtime))
+    {
+    free (ret);
+    ret = NULL;
+    }
+  return ret;
+  }
+
+
+/*==========================================================================
+cmd_get_local_done
+Note that the local copy of a file is up to date: in the journal, and as
+a source for copies of the same content
+*==========================================================================*/
+static void cmd_get_local_done (const GetRun *run, const GetItem *item)
+  {
+  struct stat sb;
+  if (run->journal && stat (item->target, &sb) == 0)
+    journal_record (run->journal, item->target, sb.st_size, sb.st_mtime,
+      dropbox_stat_get_hash_raw (item->stat));
+  cmd_get_copies_add (run->copies, item->stat, item->target);
+  }
+
+
+/*==========================================================================
+cmd_get_set_mtime
+Give the local copy the modification time that the file had on the
+client that uploaded it, so that the next quick check can match it
+*==========================================================================*/
+static void cmd_get_set_mtime (const char *target, const DBStat *dbstat)
+  {
+  time_t cmod = dropbox_stat_get_client_modified (dbstat);
+  if (cmod == 0) return;
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = cmod;
+  times[1].tv_nsec = 0;
+  if (utimensat (AT_FDCWD, target, times, 0) != 0)
+    log_debug ("Can't set time of %s: %s", target, strerror (errno));
+  }
+
+
+/*==========================================================================
+cmd_get_stage_verify
+Decide whether a remote file needs to be downloaded: it does unless it
+is too old, or there's an identical local copy already. Unless 
+--checksum was given, a local copy with the same size as the remote 
+file, and a modification time the same as its client_modified time, is
+taken to be identical, as rsync does, without hashing
+*==========================================================================*/
+static void cmd_get_stage_verify (Pipeline *pipeline, void *p, void *user)
+  {
+  GetItem *item = p;
+  const GetRun *run = user;
+  Counters *counters = run->counters;
+  const DBStat *stat = item->stat;
+  const char *source = dropbox_stat_get_path (stat);
+  const char *target = item->target;
+
+  COUNT (total_items);
 
   log_debug ("Considering downloading %s to %s", source, target);
 
   BOOL doit = FALSE;
 
-  // The local file need not exist, so we must create it. If it does
-  //  exist, we need to check its hash against that of the server file
-
-  if (access (target, R_OK) == 0)
+  // Files that are too old never get this far (see cmd_get_filter)
+  if (cmd_get_journal_find (run, stat, target))
+    {
+    log_info ("Skipping '%s', which was downloaded by an earlier run", 
+      source);
+    COUNT (skip_done);
+    cmd_get_copies_add (run->copies, stat, target);
+    }
+  else if (!run->context->checksum && cmd_get_quick_check (stat, target))
+    {
+    log_info ("Not downloading file '%s' with the same size and time", 
+      source);
+    COUNT (skip_unchanged);
+    cmd_get_local_done (run, item);
+    }
+  else if (access (target, R_OK) == 0)
     {
     // Local exists -- check hashes
     char *error = NULL;
-    DBStat *stat = dropbox_stat_create();
-    dropbox_get_file_info (token, source, stat, &error);
+    unsigned char local_hash [DBHASH_RAW_LENGTH];
+    dropbox_hash_raw (target, local_hash, &error);
     if (error)
       {
-      // Should never happen, unless someone pulls the plug mid-operation
-      log_error ("%s: %s: %s", argv0, ERROR_CANTINFOSERVER, error);
-      counters->get_info_failed++;
+      // We ignore the error here -- it just means we download
       free (error);
+      doit = TRUE;
+      }
+    else if (dropbox_stat_hash_equals (stat, local_hash))
+      {
+      log_info ("Not downloading unchanged file '%s'", source);
+      COUNT (skip_unchanged);
+      // The times may differ, if the file was not put there by us; make
+      //   them the same, so the next quick check doesn't need to hash
+      if (!run->context->dry_run)
+        cmd_get_set_mtime (target, stat);
+      cmd_get_local_done (run, item);
+      doit = FALSE;
       }
     else
       {
-      // Even if the local file exists, we need to check the date
-      //  on the server, if --days-ago was specified. We must do 
-      //  this before checking hashes, because checking hashes is
-      //  slow
-      time_t smod = dropbox_stat_get_server_modified (stat);
-      time_t now = time (NULL);
-      int elapsed_days = (int)((now - smod) / 24 / 3600);
-
-      int days_old = context->days_old;
-      if (days_old != 0 && elapsed_days >= days_old)
-        {
-	log_info ("Skipping '%s' because file on server "
-	  "is more than %d day(s) old", 
-	  source, days_old);
-        counters->skip_too_old++;
-	}
-     else
-        {
-        const char *remote_hash = dropbox_stat_get_hash (stat);
-        char local_hash [DBHASH_LENGTH];
-        dropbox_hash (target, local_hash, &error); // We ignore error here
-        if (strcmp (local_hash, remote_hash) == 0)
-          {
-          log_info ("Not downloading unchanged file '%s'", source);
-          counters->skip_unchanged++;
-          doit = FALSE;
-          }
-        else
-          {
-          log_info ("Downloading updated file '%s'", source);
-          doit = TRUE;
-          }
-	}
+      log_info ("Downloading updated file '%s'", source);
+      doit = TRUE;
       }
-     dropbox_stat_destroy (stat);
-     }
+    }
+  else
+    {
+    doit = TRUE;
+    log_info ("Downloading '%s' because local file does not exist", source);
+    }
+
+  if (doit && run->planned)
+    list_append (run->planned, item);
+  else if (doit)
+    pipeline_push (pipeline, GET_STAGE_DOWNLOAD, item);
   else
+    cmd_get_item_free (item);
+  }
+
+
+/*==========================================================================
+cmd_get_copy_local
+Make the local copy of a remote file by copying a local file that has
+the same content, rather than downloading it. Returns FALSE if that 
+can't be done, and the file should be downloaded
+*==========================================================================*/
+static BOOL cmd_get_copy_local (const GetRun *run, const GetItem *item,
+    const char *local)
+  {
+  Counters *counters = run->counters;
+  char *error = NULL;
+  cmd_get_make_directory (item->target);
+  misc_copy_file (local, item->target, &error);
+  struct stat sb;
+  if (!error && (stat (item->target, &sb) != 0 
+       || sb.st_size != dropbox_stat_get_length (item->stat)))
+    asprintf (&error, "%s changed while it was copied", local);
+  if (error)
+    {
+    log_info ("Can't copy '%s', so downloading '%s': %s", local, 
+      dropbox_stat_get_path (item->stat), error);
+    free (error);
+    return FALSE;
+    }
+  log_info ("Copied '%s' from local file '%s', which has the same content",
+    dropbox_stat_get_path (item->stat), local);
+  COUNT (copied_local);
+  cmd_get_set_mtime (item->target, item->stat);
+  cmd_get_local_done (run, item);
+  return TRUE;
+  }
+
+
+/*==========================================================================
+cmd_get_download_one
+If there is already a local file with the same content, it is copied
+instead
+*==========================================================================*/
+static void cmd_get_download_one (const GetRun *run, const GetItem *item)
+  {
+  Counters *counters = run->counters;
+  const char *source = dropbox_stat_get_path (item->stat);
+  char *local = cmd_get_copies_find (run->copies, item->stat);
+
+  if (run->context->dry_run)
+    {
+    log_lock ();
+    if (local)
+      printf ("Local copy: %s\n", local);
+    else
+      printf ("Source: %s\n", source);
+    printf ("Destination: %s\n\n", item->target);
+    log_unlock ();
+    }
+  else if (!local || !cmd_get_copy_local (run, item, local))
     {
-    doit = FALSE;
-    // Local does not exist
     char *error = NULL;
-    DBStat *stat = dropbox_stat_create();
-    dropbox_get_file_info (token, source, stat, &error);
+    cmd_get_make_directory (item->target);
+    dropbox_download (run->token, source, item->target,
+       cmd_get_progress_func, &error);
     if (error)
       {
-      // Should never happen, unless someone pulls the plug mid-operation
-      log_error ("%s: %s: %s", argv0, ERROR_CANTINFOSERVER, error);
-      counters->get_info_failed++;
+      log_error ("%s: %s: %s", run->argv0, ERROR_DOWNLOAD, error);
       free (error);
+      COUNT (download_failed);
       }
     else
       {
-      time_t smod = dropbox_stat_get_server_modified (stat);
-      time_t now = time (NULL);
-      int elapsed_days = (int)((now - smod) / 24 / 3600);
-
-      int days_old = context->days_old;
-      if (days_old != 0 && elapsed_days >= days_old)
-        {
-        log_info 
-	   ("Skipping '%s' because file on server is more than %d day(s) old", 
-	      source, days_old);
-        counters->skip_too_old++;
-	}
-      else
-        {
-	doit = TRUE;
-        log_info ("Downloading '%s' because local file does not exist", source);
-	}
+      COUNT (downloaded);
+      cmd_get_set_mtime (item->target, item->stat);
+      cmd_get_local_done (run, item);
       }
-    dropbox_stat_destroy (stat);
     }
+  free (local);
+  }
 
-  if (doit)
+
+/*==========================================================================
+cmd_get_stage_download
+*==========================================================================*/
+static void cmd_get_stage_download (Pipeline *pipeline, void *p, void *user)
+  {
+  const GetItem *item;
+  for (item = p; item != NULL; item = item->next)
+    cmd_get_download_one (user, item);
+  cmd_get_item_free (p);
+  }
+
+
+/*==========================================================================
+cmd_get_describe
+*==========================================================================*/
+static char *cmd_get_describe (const void *p)
+  {
+  const GetItem *item = p;
+  char *ret;
+  asprintf (&ret, "%s -> %s", dropbox_stat_get_path (item->stat), 
+    item->target);
+  return ret;
+  }
+
+
+/*==========================================================================
+cmd_get_run_plan
+With --plan, once every file has been checked, schedule the downloads,
+and start them in the planned order -- or, in a dry run, show the plan.
+Each download is a single request
+*==========================================================================*/
+static void cmd_get_run_plan (GetRun *run, Pipeline *pipeline)
+  {
+  pipeline_wait (pipeline);
+
+  Plan *plan = plan_create (run->context->jobs);
+  int i, l = list_length (run->planned);
+  for (i = 0; i < l; i++)
+    {
+    GetItem *item = list_get (run->planned, i);
+    plan_add (plan, item, dropbox_stat_get_length (item->stat), 1);
+    }
+  plan_schedule (plan);
+
+  if (run->context->dry_run)
     {
-    if (dry_run)
+    if (l > 0) plan_print (plan, cmd_get_describe);
+    for (i = 0; i < l; i++)
+      cmd_get_item_free (list_get (run->planned, i));
+    }
+  else
+    {
+    l = plan_length (plan);
+    for (i = 0; i < l; i++)
       {
-      printf ("Source: %s\n", source);
-      printf ("Destination: %s\n\n", target);
+      const PlanUnit *unit = plan_get (plan, i);
+      int j, n = list_length (unit->items);
+      for (j = 0; j < n - 1; j++)
+        ((GetItem *)list_get (unit->items, j))->next = 
+          list_get (unit->items, j + 1);
+      pipeline_push (pipeline, GET_STAGE_DOWNLOAD, 
+        list_get (unit->items, 0));
       }
+    }
+
+  plan_destroy (plan);
+  list_clear (run->planned);
+  }
+
+
+/*==========================================================================
+cmd_get_unplan
+Forget any planned downloads of target, or of anything inside it, as
+it has since been deleted on the server
+*==========================================================================*/
+static void cmd_get_unplan (GetRun *run, const char *target)
+  {
+  size_t tl = strlen (target);
+  List *keep = list_create_locked (NULL);
+  int i, l = list_length (run->planned);
+  for (i = 0; i < l; i++)
+    {
+    GetItem *item = list_get (run->planned, i);
+    if (strncmp (item->target, target, tl) == 0 
+         && (item->target[tl] == 0 || item->target[tl] == '/'))
+      cmd_get_item_free (item);
     else
+      list_append (keep, item);
+    }
+  list_destroy (run->planned);
+  run->planned = keep;
+  }
+
+
+/*==========================================================================
+cmd_get_zip_key
+Entries are matched to files by path, ignoring case, as the server
+does. Caller frees the result
+*==========================================================================*/
+static char *cmd_get_zip_key (const char *parent, const char *name)
+  {
+  char *key;
+  asprintf (&key, "%s/%s", parent, name);
+  char *p;
+  for (p = key; *p; p++)
+    *p = tolower ((unsigned char)*p);
+  return key;
+  }
+
+
+/*==========================================================================
+cmd_get_zip_begin
+Start writing an entry of the zip, if it is one of the files that need
+downloading. Anything else -- folders, and files that are up to date --
+is skipped. Only the targets we worked out from the listing are ever
+written, so an entry with a name like ../x can't go astray
+*==========================================================================*/
+static void *cmd_get_zip_begin (const char *name, void *user)
+  {
+  GetZip *zip = user;
+  char *key = cmd_get_zip_key (zip->parent, name);
+  GetItem *item = hashindex_get (zip->items, key, strlen (key));
+  if (!item)
+    {
+    free (key);
+    return NULL;
+    }
+
+  // There are usually many files to a directory, and making one
+  //   is slow, so don't do it again for the next file
+  char *dir = strdup (item->target);
+  *strrchr (dir, '/') = 0;
+  if (!zip->last_dir || strcmp (dir, zip->last_dir) != 0)
+    {
+    cmd_get_make_directory (item->target);
+    free (zip->last_dir);
+    zip->last_dir = dir;
+    }
+  else
+    free (dir);
+
+  int fd = open (item->target, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (fd < 0)
+    {
+    log_info ("Can't write '%s', so downloading it separately: %s", 
+      item->target, strerror (errno));
+    free (key);
+    return NULL;
+    }
+
+  GetZipEntry *entry = malloc (sizeof (GetZipEntry));
+  entry->item = item;
+  entry->key = key;
+  entry->fd = fd;
+  entry->write_errno = 0;
+  return entry;
+  }
+
+
+/*==========================================================================
+cmd_get_zip_data
+*==========================================================================*/
+static BOOL cmd_get_zip_data (void *sink, const void *data, size_t length)
+  {
+  GetZipEntry *entry = sink;
+  const char *p = data;
+  while (length > 0)
+    {
+    ssize_t n = write (entry->fd, p, length);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0)
       {
-      char *error = NULL;
-      cmd_get_make_directory (target);
-      dropbox_download (token, source, target, cmd_get_progress_func, 
-         &error); 
-      if (error)
-        {
-        log_error ("%s: %s: %s", argv0, ERROR_DOWNLOAD, error);
-        free (error);
-        counters->download_failed++;
-        }
-      else
-        {
-        counters->downloaded++;
-        }
+      entry->write_errno = errno;
+      return FALSE;
+      }
+    p += n;
+    length -= n;
+    }
+  return TRUE;
+  }
+
+
+/*==========================================================================
+cmd_get_zip_end
+Finish a file from the zip. If anything went wrong, it is removed, and
+stays in the index, to be downloaded separately
+*==========================================================================*/
+static void cmd_get_zip_end (void *sink, const char *error, void *user)
+  {
+  GetZipEntry *entry = sink;
+  GetZip *zip = user;
+  GetItem *item = entry->item;
+  Counters *counters = zip->run->counters;
+
+  if (close (entry->fd) != 0 && !entry->write_errno)
+    entry->write_errno = errno;
+  if (entry->write_errno)
+    error = strerror (entry->write_errno);
+
+  if (error)
+    {
+    log_info ("Can't extract '%s' from zip, so downloading it "
+      "separately: %s", dropbox_stat_get_path (item->stat), error);
+    unlink (item->target);
+    }
+  else
+    {
+    log_info ("Extracted '%s' from zip", dropbox_stat_get_path (item->stat));
+    hashindex_remove (zip->items, entry->key, strlen (entry->key));
+    zip->extracted++;
+    COUNT (downloaded);
+    cmd_get_set_mtime (item->target, item->stat);
+    cmd_get_local_done (zip->run, item);
+    }
+  free (entry->key);
+  free (entry);
+  }
+
+
+/*==========================================================================
+cmd_get_zip_feed
+Pass the zip to the reader as it arrives, stopping at the first error
+*==========================================================================*/
+static BOOL cmd_get_zip_feed (const void *data, size_t length, void *user)
+  {
+  GetZip *zip = user;
+  return zipstream_feed (zip->stream, data, length, &zip->error);
+  }
+
+
+/*==========================================================================
+cmd_get_zip_worthwhile
+Decide whether the files in run->planned should be fetched in a zip of
+the whole folder. The server won't send a zip of a folder that is too
+big, and it isn't worth it if most of the folder is up to date already.
+Otherwise, a zip saves a request for every file, which, for small 
+files, takes longer than sending their data
+*==========================================================================*/
+static BOOL cmd_get_zip_worthwhile (const GetRun *run, 
+    const DBStatStore *store, const char *path)
+  {
+  // Entries that weren't selected are still in the zip
+  int64_t folder_bytes = run->left_out_bytes, needed_bytes = 0;
+  BOOL too_big = run->left_out_largest >= GET_ZIP_MAX_FILE_BYTES;
+  uint32_t i, l = dropbox_stat_store_length (store);
+  for (i = 0; i < l; i++)
+    {
+    int64_t length = dropbox_stat_get_length 
+      (dropbox_stat_store_get (store, i));
+    if (length >= GET_ZIP_MAX_FILE_BYTES) too_big = TRUE;
+    folder_bytes += length;
+    }
+  if (l + run->left_out >= GET_ZIP_MAX_ENTRIES 
+       || folder_bytes >= GET_ZIP_MAX_BYTES)
+    too_big = TRUE;
+
+  int needed = list_length (run->planned);
+  int j;
+  for (j = 0; j < needed; j++)
+    needed_bytes += dropbox_stat_get_length 
+      (((GetItem *)list_get (run->planned, j))->stat);
+
+  if (too_big)
+    {
+    log_info ("'%s' is too big to download as a zip, so downloading "
+      "files separately", path);
+    return FALSE;
+    }
+  if (plan_cost (folder_bytes, 1) > plan_cost (needed_bytes, needed))
+    {
+    log_info ("Downloading %d file(s) from '%s' separately, which is "
+      "quicker than a zip of the whole folder", needed, path);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*==========================================================================
+cmd_get_zip
+With --download-zip, once every file in a folder has been checked, 
+fetch the ones that need downloading in a single zip of the whole 
+folder, and unpack them as it arrives, without storing the zip. 
+Anything that wasn't extracted, for whatever reason, is left in 
+run->planned, to be downloaded separately
+*==========================================================================*/
+static void cmd_get_zip (GetRun *run, Pipeline *pipeline, 
+    const DBStatStore *store, const char *path)
+  {
+  pipeline_wait (pipeline);
+  int i, l = list_length (run->planned);
+  if (l == 0 || !cmd_get_zip_worthwhile (run, store, path)) return;
+
+  if (run->context->dry_run)
+    {
+    printf ("Zip source: %s\n", path);
+    for (i = 0; i < l; i++)
+      {
+      GetItem *item = list_get (run->planned, i);
+      printf ("Destination: %s\n", item->target);
+      cmd_get_item_free (item);
       }
+    printf ("\n");
+    list_clear (run->planned);
+    return;
+    }
+
+  // Entries are named relative to the folder's parent
+  char *parent = strdup (path);
+  *strrchr (parent, '/') = 0;
+
+  GetZip zip;
+  memset (&zip, 0, sizeof (GetZip));
+  zip.run = run;
+  zip.parent = parent;
+  zip.items = hashindex_create ();
+  for (i = 0; i < l; i++)
+    {
+    GetItem *item = list_get (run->planned, i);
+    char *key = cmd_get_zip_key ("", dropbox_stat_get_path (item->stat) + 1);
+    hashindex_put (zip.items, key, strlen (key), item, TRUE);
+    free (key);
+    }
+  zip.stream = zipstream_create (cmd_get_zip_begin, cmd_get_zip_data, 
+    cmd_get_zip_end, &zip);
+
+  log_info ("Downloading %d file(s) from '%s' as a zip", l, path);
+  char *error = NULL;
+  dropbox_download_zip (run->token, path, cmd_get_zip_feed, &zip, &error);
+  if (!error && !zip.error)
+    zipstream_finish (zip.stream, &zip.error);
+  // Any file still being written is incomplete, and is removed
+  zipstream_destroy (zip.stream);
+
+  if (zip.error || error)
+    log_warning ("%s: can't download '%s' as a zip, so downloading "
+      "files separately: %s", run->argv0, path, 
+      zip.error ? zip.error : error);
+  log_info ("Extracted %d of %d file(s) from zip", zip.extracted, l);
+
+  List *rest = list_create_locked (NULL);
+  for (i = 0; i < l; i++)
+    {
+    GetItem *item = list_get (run->planned, i);
+    char *key = cmd_get_zip_key ("", dropbox_stat_get_path (item->stat) + 1);
+    if (hashindex_get (zip.items, key, strlen (key)))
+      list_append (rest, item);
+    else
+      cmd_get_item_free (item);
+    free (key);
+    }
+  list_destroy (run->planned);
+  run->planned = rest;
+
+  hashindex_destroy (zip.items);
+  free (zip.last_dir);
+  free (zip.error);
+  free (error);
+  free (parent);
+  }
+
+
+/*==========================================================================
+cmd_get_remove_callback
+*==========================================================================*/
+static int cmd_get_remove_callback (const char *path, const struct stat *sb,
+    int typeflag, struct FTW *ftwbuf)
+  {
+  if (remove (path) != 0)
+    log_warning ("Can't delete '%s': %s", path, strerror (errno));
+  return 0;
+  }
+
+
+/*==========================================================================
+cmd_get_delete_local
+Remove the local counterpart of a file or folder that was deleted on
+the server. This only happens in incremental mode, where the server
+tells us about deletions
+*==========================================================================*/
+static void cmd_get_delete_local (const CmdContext *context, 
+    const char *source, const char *target, Counters *counters)
+  {
+  struct stat sb;
+  if (lstat (target, &sb) != 0) return; // Nothing to delete
+
+  if (context->dry_run)
+    {
+    printf ("Delete: %s\n\n", target);
+    return;
+    }
+
+  log_info ("Deleting '%s' because '%s' was deleted on the server", 
+    target, source);
+  if (S_ISDIR (sb.st_mode))
+    nftw (target, cmd_get_remove_callback, 16, FTW_DEPTH | FTW_PHYS);
+  else if (unlink (target) != 0)
+    log_warning ("Can't delete '%s': %s", target, strerror (errno));
+  COUNT (deleted_local);
+  }
+
+
+/*==========================================================================
+cmd_get_pipeline_create
+Checking local copies waits on the disk, and downloading on the 
+network, so each has its own threads
+*==========================================================================*/
+static Pipeline *cmd_get_pipeline_create (GetRun *run)
+  {
+  const CmdContext *context = run->context;
+  int download_jobs = context->jobs > 0 ? context->jobs : 1;
+  int verify_jobs = context->hash_jobs > 0 ? context->hash_jobs : 1;
+
+  Pipeline *pipeline = pipeline_create ("get", run, cmd_get_item_free);
+  pipeline_add_stage (pipeline, "verify", cmd_get_stage_verify, 
+    verify_jobs, verify_jobs * GET_QUEUED_PER_THREAD);
+  pipeline_add_stage (pipeline, "download", cmd_get_stage_download, 
+    download_jobs, download_jobs * GET_QUEUED_PER_THREAD);
+  pipeline_start (pipeline);
+  return pipeline;
+  }
+
+
+/*==========================================================================
+cmd_get_dispatch
+Start work on a selected entry of the listing. A deletion is carried 
+out at once, but only after everything already in the pipeline is 
+finished, in case that includes something inside what's being deleted
+*==========================================================================*/
+static void cmd_get_dispatch (GetSelect *sel, const DBStat *stat)
+  {
+  const char *remote_path = dropbox_stat_get_path (stat);
+  const char *relative = remote_path + sel->prefix_len;
+  char *full_local;
+  if (sel->local_is_dir)
+    asprintf (&full_local, "%s%s", sel->local, relative); 
+  else
+    full_local = strdup (sel->local);
+
+  if (dropbox_stat_get_type (stat) == DBSTAT_DELETED)
+    {
+    pipeline_wait (sel->pipeline);
+    if (sel->run->planned) cmd_get_unplan (sel->run, full_local);
+    cmd_get_delete_local (sel->run->context, remote_path, full_local, 
+      sel->run->counters);
+    free (full_local);
+    }
+  else
+    {
+    GetItem *item = malloc (sizeof (GetItem));
+    item->stat = stat;
+    item->target = full_local;
+    item->next = NULL;
+    pipeline_push (sel->pipeline, GET_STAGE_VERIFY, item);
+    }
+  }
+
+
+/*==========================================================================
+cmd_get_leave_out
+Note an entry that the filter doesn't select, which would still be in a 
+zip of the folder
+*==========================================================================*/
+static void cmd_get_leave_out (GetRun *run, const DBStat *stat)
+  {
+  int64_t length = dropbox_stat_get_length (stat);
+  run->left_out++;
+  run->left_out_bytes += length;
+  if (length > run->left_out_largest) run->left_out_largest = length;
+  }
+
+
+/*==========================================================================
+cmd_get_filter
+Decide, as the listing is decoded, which entries are selected, so that 
+nothing is stored for the others. Entries are selected by the pattern,
+and by the include and exclude rules, which are matched against the 
+path that the entry will have locally. Files on the server that are too old
+for --days-old are counted as skipped here, so they are never compared
+with their local copies
+*==========================================================================*/
+static BOOL cmd_get_filter (const DBStat *stat, void *user)
+  {
+  GetSelect *sel = user;
+  GetRun *run = sel->run;
+  Counters *counters = run->counters;
+  const char *path = dropbox_stat_get_path (stat); 
+  // Not sure about this logic
+  if (!matcher_match (sel->spec, path)
+      && !matcher_match (sel->spec, dropbox_stat_get_name (stat))
+      && !matcher_match (sel->remote, path))
+    {
+    cmd_get_leave_out (run, stat);
+    return FALSE;
+    }
+  // The listing is not a walk, so the folders above the entry are 
+  //   checked as well
+  if (rules_excluded_tree (run->context->rules, path + sel->prefix_len,
+       dropbox_stat_get_type (stat) == DBSTAT_FOLDER))
+    {
+    log_debug ("Excluding '%s'", path);
+    cmd_get_leave_out (run, stat);
+    return FALSE;
+    }
+
+  int days_old = run->context->days_old;
+  if (days_old == 0 || dropbox_stat_get_type (stat) != DBSTAT_FILE) 
+    return TRUE;
+  time_t smod = dropbox_stat_get_server_modified (stat);
+  time_t now = time (NULL);
+  int elapsed_days = (int)((now - smod) / 24 / 3600);
+  if (elapsed_days < days_old) return TRUE;
+
+  log_info ("Skipping '%s' because file on server "
+    "is more than %d day(s) old", path, days_old);
+  COUNT (total_items);
+  COUNT (skip_too_old);
+  cmd_get_leave_out (run, stat);
+  return FALSE;
+  }
+
+
+/*==========================================================================
+cmd_get_page
+Called with each page of the listing as it arrives, which holds only
+the selected entries. They are started straight away, unless they are 
+being held back until the listing is complete
+*==========================================================================*/
+static void cmd_get_page (const DBStatStore *store, uint32_t first, 
+    uint32_t count, void *user)
+  {
+  GetSelect *sel = user;
+  uint32_t i;
+  for (i = first; i < first + count; i++)
+    {
+    const DBStat *stat = dropbox_stat_store_get (store, i);
+    sel->selected++;
+    if (sel->pipeline)
+      cmd_get_dispatch (sel, stat);
+    else
+      list_append (sel->held, (void *)stat);
+    }
+  }
+
+
+/*==========================================================================
+cmd_get_list_remote
+Get the listing that the download will be based on. In incremental mode,
+if there is a cursor from an earlier run, this is only the changes since
+the cursor was issued. *new_cursor is set to the cursor to keep if the
+download succeeds, or NULL when not in incremental mode. Only the 
+entries that filter wants are kept, and pf is called with each page of
+them as it arrives. Otherwise, a recursive get of a pattern 
+may use the server's search, rather than a listing (see finder.c)
+*==========================================================================*/
+static DBStatStore *cmd_get_list_remote (const char *token,
+    const CmdContext *context, const char *path, const char *spec, 
+    BOOL incremental, const char *old_cursor, char **new_cursor, 
+    DBPageFunc pf, DBStatFilterFn filter, void *user, char **error)
+  {
+  DBStatStore *store = dropbox_stat_store_create ();
+  dropbox_stat_store_set_filter (store, filter, user);
+  *new_cursor = NULL;
+  if (!incremental)
+    {
+    finder_find (token, path, spec, store, FALSE, context->recursive, 
+      context->list_jobs, context->search, pf, user, error);
+    return store;
+    }
+
+  if (old_cursor)
+    {
+    dropbox_list_paged (token, path, store, FALSE, context->recursive, 
+      old_cursor, new_cursor, pf, user, error);
+    if (*error == NULL) return store;
+
+    // If some pages arrived before the failure, work has already
+    //   started on them, so we can't start again from scratch
+    if (dropbox_stat_store_length (store) > 0) return store;
+
+    // Typically the cursor has expired, or the folder was replaced
+    log_info ("Stored cursor not accepted (%s) -- listing '%s' in full", 
+      *error, path);
+    free (*error);
+    *error = NULL;
+    dropbox_stat_store_destroy (store);
+    store = dropbox_stat_store_create ();
+    dropbox_stat_store_set_filter (store, filter, user);
     }
+
+  dropbox_list_paged (token, path, store, FALSE, context->recursive, 
+    NULL, new_cursor, pf, user, error);
+  return store;
   }
 
 
 /*==========================================================================
 cmd_get_one_remote_spec
+If cursor is not NULL, this is an incremental get: *cursor is the cursor
+from the previous run, or NULL if there wasn't one, and it is replaced
+with a new one if everything was downloaded successfully. Files that
+are done are recorded in the journal, if there is one, and in copies,
+if that is not NULL, so that later files with the same content can be
+copied from them. If sync is not NULL, its run and pipeline are used, 
+and the pipeline is left running, but idle, at the end
 *==========================================================================*/
 static void cmd_get_one_remote_spec (const char *token, 
     const CmdContext *context, const char *_remote, 
     const char *_local, Counters *counters, BOOL local_is_dir, 
-    const char *argv0)
+    const char *argv0, char **cursor, Journal *journal, GetCopies *copies,
+    GetSync *sync)
   {
-  BOOL recursive = context->recursive;
-
   char *error = NULL;
   char *remote = strdup (_remote);
   char *path;
@@ -320,9 +1208,55 @@ static void cmd_get_one_remote_spec (const char *token,
 
     log_debug ("path=%s, spec=%s", path, spec);
 
-    List *list = dropbox_stat_create_list();
-    dropbox_list_files (token, path, list, FALSE, recursive, &error);
+    // We only keep a new cursor if everything it covers was 
+    //   downloaded
+    const char *old_cursor = cursor ? *cursor : NULL;
+    char *new_cursor = NULL;
+    int errors_before = counters->get_info_failed 
+      + counters->download_failed;
+
+    GetRun local_run;
+    GetRun *run = sync ? &sync->run : &local_run;
+    Pipeline *kept = sync ? sync->pipeline : NULL;
+    run->token = token;
+    run->context = context;
+    run->counters = counters;
+    run->argv0 = argv0;
+    // A folder can be downloaded as a zip, but only if we know about 
+    //   everything in it -- not just what changed since the last run
+    BOOL zip = context->download_zip && context->recursive 
+      && local_is_dir && !old_cursor
+      && dropbox_stat_get_type (stat) == DBSTAT_FOLDER;
+    run->planned = (context->plan || zip) ? list_create_locked (NULL) 
+      : NULL;
+    run->journal = journal;
+    run->copies = copies;
+    run->left_out = 0;
+    run->left_out_bytes = 0;
+    run->left_out_largest = 0;
+
+    GetSelect sel;
+    memset (&sel, 0, sizeof (GetSelect));
+    sel.run = run;
+    sel.remote = matcher_create (remote);
+    sel.spec = matcher_create (spec);
+    sel.local = local;
+    sel.prefix_len = prefix_len;
+    sel.local_is_dir = local_is_dir;
+    sel.held = list_create (NULL);
+
+    // When downloading into a directory, work starts on each page of
+    //   the listing as soon as it arrives, while the next is fetched.
+    //   Otherwise, we must see the whole listing first, to be sure that
+    //   only one file is selected
+    if (local_is_dir)
+      sel.pipeline = kept ? kept : cmd_get_pipeline_create (run);
 
+    DBStatStore *store = cmd_get_list_remote (token, context, path, spec,
+      cursor != NULL, old_cursor, &new_cursor, cmd_get_page, 
+      cmd_get_filter, &sel, &error);
+
+    BOOL listed = (error == NULL);
     if (error)
       {
       log_error ("%s: %s: %s", "get", ERROR_CANTLISTSERVER, error);
@@ -330,69 +1264,206 @@ static void cmd_get_one_remote_spec (const char *token,
       } 
     else
       {
-      List *globbed_list = list_create (free);
-       
-      int i, l = list_length (list);
-      for (i = 0; i < l; i++)
-	{
-	const DBStat *stat = list_get (list, i);
-	const char *path = dropbox_stat_get_path (stat); 
-        char *pathcopy = strdup (path);
-        char *filename = basename (pathcopy);
-        // Not sure about this logic
-        if ((fnmatch (spec, path, 0) == 0)
-            || (fnmatch (spec, filename, 0) == 0)
-            || (fnmatch (remote, path, 0) == 0))
-          {
-          list_append (globbed_list, strdup (path));
-          } 
-        // TODO include/exclude here
-        free (pathcopy);
-	} 
-      
-      l = list_length (globbed_list);
+      int l = sel.selected;
       if (l > 1 && !local_is_dir)
         {
         // TODO
         log_error ("%s: %s", "get", ERROR_MULTIFILE);
         }
+      else if (l == 0 && old_cursor)
+        {
+        log_info ("No changes on server to '%s'", _remote);
+        }
       else if (l == 0)
         {
         // TODO
         log_warning ("%s: %s", "get", 
           "No files selected for download");
         }
-      else
+      else if (!sel.pipeline)
         {
-	for (i = 0; i < l; i++)
-	  {
-	  const char *remote_path = list_get (globbed_list, i);
-	  const char *relative = remote_path + prefix_len;
-          char *full_local;
-          if (local_is_dir)
-            {
-            asprintf (&full_local, "%s%s", local, relative); 
-            }
-          else
-            full_local = strdup (local);
-          cmd_get_consider_and_download (token, context, remote_path, 
-            full_local, counters, argv0);
-	  } 
+        sel.pipeline = kept ? kept : cmd_get_pipeline_create (run);
+        int i;
+        for (i = 0; i < list_length (sel.held); i++)
+          cmd_get_dispatch (&sel, list_get (sel.held, i));
         }
-      list_destroy (globbed_list);
       }
 
+    if (zip && listed && sel.pipeline)
+      cmd_get_zip (run, sel.pipeline, store, path);
+
+    if (run->planned && sel.pipeline && context->plan)
+      cmd_get_run_plan (run, sel.pipeline);
+    else if (run->planned && sel.pipeline)
+      {
+      int i;
+      for (i = 0; i < list_length (run->planned); i++)
+        pipeline_push (sel.pipeline, GET_STAGE_DOWNLOAD, 
+          list_get (run->planned, i));
+      list_clear (run->planned);
+      }
+
+    // Waits for the last downloads to finish
+    if (kept)
+      pipeline_wait (kept);
+    else
+      pipeline_destroy (sel.pipeline);
+    list_destroy (sel.held);
+    matcher_destroy (sel.spec);
+    matcher_destroy (sel.remote);
+    list_destroy (run->planned);
+    run->planned = NULL;
+
+    if (listed && new_cursor && counters->get_info_failed 
+         + counters->download_failed == errors_before)
+      {
+      free (*cursor);
+      *cursor = new_cursor;
+      new_cursor = NULL;
+      }
+    free (new_cursor);
+
     free (path);
     free (remote);
     free (local);
     free (spec);
-    list_destroy (list);
+    dropbox_stat_store_destroy (store);
     dropbox_stat_destroy (stat);
     } 
   OUT
   }
 
 
+/*==========================================================================
+cmd_get_stdin
+Download the files read from standard input, in the form that find 
+--long writes them, into the local directory, each at its full remote 
+path below it, as rsync's --files-from does. They go through the same
+filter and pipeline as a listing's entries, but the server is not 
+listed: a line that is just a path costs a request for its metadata,
+and one with the attributes of the file costs nothing. Folders are 
+skipped, since what's in them would need a listing
+*==========================================================================*/
+static void cmd_get_stdin (const char *token, const CmdContext *context,
+    const char *local, Counters *counters, const char *argv0, 
+    Journal *journal, GetCopies *copies)
+  {
+  IN
+  GetRun run;
+  memset (&run, 0, sizeof (GetRun));
+  run.token = token;
+  run.context = context;
+  run.counters = counters;
+  run.argv0 = argv0;
+  run.planned = context->plan ? list_create_locked (NULL) : NULL;
+  run.journal = journal;
+  run.copies = copies;
+
+  GetSelect sel;
+  memset (&sel, 0, sizeof (GetSelect));
+  sel.run = &run;
+  sel.spec = matcher_create ("*");
+  sel.remote = sel.spec;
+  sel.local = local;
+  sel.prefix_len = 0;
+  sel.local_is_dir = TRUE;
+  sel.held = list_create (NULL);
+  sel.pipeline = cmd_get_pipeline_create (&run);
+
+  // Keeps the entries that are selected, which the pipeline refers to
+  DBStatStore *store = dropbox_stat_store_create ();
+  dropbox_stat_store_set_filter (store, cmd_get_filter, &sel);
+
+  char *line = NULL;
+  size_t n = 0;
+  while (getline (&line, &n, stdin) >= 0)
+    {
+    DBStat stat;
+    DBStat *info = NULL;
+    const DBStat *entry = &stat;
+    if (!records_parse (line, &stat))
+      {
+      if (stat.path[0] == 0) continue;
+      if (stat.path[0] != '/')
+        {
+        log_error ("%s: %s: %s", argv0, ERROR_STARTSLASH, stat.path);
+        continue;
+        }
+      char *error = NULL;
+      info = dropbox_stat_create ();
+      dropbox_get_file_info (token, stat.path, info, &error);
+      if (error)
+        {
+        log_error ("%s: %s: %s", "get", ERROR_CANTINFOSERVER, error);
+        free (error);
+        COUNT (get_info_failed);
+        dropbox_stat_destroy (info);
+        continue;
+        }
+      entry = info;
+      }
+
+    if (entry->type == DBSTAT_FILE)
+      {
+      if (dropbox_stat_store_wants (store, entry))
+        {
+        uint32_t first = dropbox_stat_store_length (store);
+        dropbox_stat_store_add_copy (store, entry);
+        cmd_get_page (store, first, 1, &sel);
+        }
+      }
+    else if (entry->type == DBSTAT_FOLDER && info)
+      log_warning ("Skipping folder '%s'", entry->path);
+    else if (entry->type == DBSTAT_FOLDER)
+      log_debug ("Skipping folder '%s'", entry->path); // Its files follow
+    else
+      log_warning ("%s: '%s' not found on server", "get", stat.path);
+
+    if (info) dropbox_stat_destroy (info);
+    }
+  free (line);
+
+  if (sel.selected == 0)
+    log_warning ("%s: %s", "get", "No files selected for download");
+
+  if (run.planned && context->plan)
+    cmd_get_run_plan (&run, sel.pipeline);
+
+  // Waits for the last downloads to finish
+  pipeline_destroy (sel.pipeline);
+  list_destroy (sel.held);
+  matcher_destroy (sel.spec);
+  list_destroy (run.planned);
+  dropbox_stat_store_destroy (store);
+  OUT
+  }
+
+
+/*==========================================================================
+cmd_get_journal_key
+Identifies the operation that a journal belongs to: the remote
+arguments, and the destination, made absolute. Caller frees the result
+*==========================================================================*/
+static char *cmd_get_journal_key (int argc, char **argv, const char *local)
+  {
+  char *key = strdup ("get");
+  int i;
+  for (i = 1; i < argc - 1; i++)
+    {
+    char *s = NULL;
+    asprintf (&s, "%s\t%s", key, argv[i]);
+    free (key);
+    key = s;
+    }
+  char *abspath = realpath (local, NULL);
+  char *s = NULL;
+  asprintf (&s, "%s\t%s", key, abspath ? abspath : local);
+  free (abspath);
+  free (key);
+  return s;
+  }
+
+
 /*==========================================================================
 cmd_get
 *==========================================================================*/
@@ -446,14 +1517,43 @@ int cmd_get (const CmdContext *context, int argc, char **argv)
 	Counters *counters = malloc (sizeof (Counters));
 	memset (counters, 0, sizeof (Counters));
 
+        // Only a recursive download is big enough to be worth resuming
+        Journal *journal = NULL;
+        if (context->recursive && !context->dry_run)
+          {
+          char *key = cmd_get_journal_key (argc, argv, dest_spec);
+          journal = journal_open (key, context->resume);
+          free (key);
+          }
+        GetCopies *copies = cmd_get_copies_create ();
+
 	int i;
 	for (i = 1; i < argc - 1; i++)
 	  {
-          if (argv[i][0] == '/')
+          if (strcmp (argv[i], "-") == 0)
+            {
+            if (local_is_dir)
+              cmd_get_stdin (token, context, dest_spec, counters, argv[0], 
+                journal, copies);
+            else
+              log_error ("%s: %s", argv[0], ERROR_MULTIFILE); 
+            }
+          else if (argv[i][0] == '/' && context->incremental)
+            {
+            char *cursor = cursors_get (argv[i], dest_spec, 
+              context->recursive);
+	    cmd_get_one_remote_spec 
+              (token, context, argv[i], dest_spec, counters, 
+                local_is_dir, argv[0], &cursor, journal, copies, NULL);
+            if (cursor && !context->dry_run)
+              cursors_put (argv[i], dest_spec, context->recursive, cursor);
+            free (cursor);
+            }
+          else if (argv[i][0] == '/')
             {
 	    cmd_get_one_remote_spec 
               (token, context, argv[i], dest_spec, counters, 
-                local_is_dir, argv[0]);
+                local_is_dir, argv[0], NULL, journal, copies, NULL);
             }
           else
             {
@@ -464,12 +1564,19 @@ int cmd_get (const CmdContext *context, int argc, char **argv)
    
 	printf ("Files considered: %d\n", counters->total_items);
 	printf ("Downloaded: %d\n", counters->downloaded); 
+	if (counters->copied_local > 0)
+	  printf ("Copied from local files: %d\n", counters->copied_local); 
 	if (counters->skip_unchanged > 0)
 	  printf ("Skipped because unchanged: %d\n", counters->skip_unchanged); 
 	int total_errors = counters->get_info_failed
 	   + counters->download_failed;
 	if (counters->skip_too_old > 0)
 	  printf ("Skipped because too old: %d\n", counters->skip_too_old); 
+	if (counters->skip_done > 0)
+	  printf ("Skipped because done by an earlier run: %d\n", 
+            counters->skip_done); 
+	if (counters->deleted_local > 0)
+	  printf ("Deleted locally: %d\n", counters->deleted_local); 
 	if (total_errors > 0)
 	  {
 	  printf ("Errors: %d\n", total_errors); 
@@ -478,6 +1585,8 @@ int cmd_get (const CmdContext *context, int argc, char **argv)
 	  printf ("  Download failed: %d\n", 
 	   counters->download_failed); 
 	  }
+        journal_close (journal, total_errors == 0);
+        cmd_get_copies_destroy (copies);
 	free (counters);
         free (token);
         }
@@ -495,6 +1604,57 @@ int cmd_get (const CmdContext *context, int argc, char **argv)
   return ret;
   }
 
+/*==========================================================================
+cmd_get_sync_create
+Set up for repeated calls of cmd_get_sync(), which all share one 
+pipeline
+*==========================================================================*/
+GetSync *cmd_get_sync_create (const CmdContext *context)
+  {
+  GetSync *self = malloc (sizeof (GetSync));
+  memset (self, 0, sizeof (GetSync));
+  self->run.context = context;
+  self->run.counters = &self->counters;
+  self->pipeline = cmd_get_pipeline_create (&self->run);
+  return self;
+  }
+
+
+/*==========================================================================
+cmd_get_sync_destroy
+*==========================================================================*/
+void cmd_get_sync_destroy (GetSync *self)
+  {
+  if (!self) return;
+  pipeline_destroy (self->pipeline);
+  free (self);
+  }
+
+
+/*==========================================================================
+cmd_get_sync
+Bring a local directory up to date with a remote path, as 'get' does,
+for use by other commands. If cursor is not NULL, the get is incremental
+(see cmd_get_one_remote_spec). Returns the number of errors
+*==========================================================================*/
+int cmd_get_sync (GetSync *self, const char *token, 
+    const CmdContext *context, const char *remote, const char *local, 
+    char **cursor, const char *argv0)
+  {
+  Counters *counters = &self->counters;
+  // The pipeline is idle between calls, so nothing else is counting
+  memset (counters, 0, sizeof (Counters));
+
+  cmd_get_one_remote_spec (token, context, remote, local, counters, 
+    TRUE, argv0, cursor, NULL, NULL, self);
+
+  if (counters->downloaded > 0 || counters->deleted_local > 0)
+    log_info ("Downloaded %d, deleted %d", counters->downloaded, 
+      counters->deleted_local);
+  return counters->get_info_failed + counters->download_failed;
+  }
+
+
 /*==========================================================================
 cmd_get_make_directory
 Make the directory for the specified file, including parents, if possible
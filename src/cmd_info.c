@@ -56,16 +56,16 @@ int cmd_info (const CmdContext *context, int argc, char **argv)
           if (dropbox_stat_get_type (stat) == DBSTAT_FOLDER)
             {
             printf ("Type: folder\n");
-            List *list = dropbox_stat_create_list(); 
-            dropbox_list_files (token, remote_file, list, 
-              TRUE, recursive, &error);
-            int i, l = list_length (list);
+            DBStatStore *store = dropbox_stat_store_create(); 
+            dropbox_list_parallel (token, remote_file, store, 
+              TRUE, recursive, context->list_jobs, NULL, NULL, &error);
+            uint32_t i, l = dropbox_stat_store_length (store);
             int dirs = 0;
             int files = 0;
             int64_t size = 0;
             for (i = 0; i < l; i++)
               {
-              const DBStat *stat = list_get (list, i);
+              const DBStat *stat = dropbox_stat_store_get (store, i);
               if (stat->type == DBSTAT_FILE) 
                 {
                 files++;
@@ -76,7 +76,7 @@ int cmd_info (const CmdContext *context, int argc, char **argv)
                 dirs++;
                 }
               }
-            list_destroy (list);
+            dropbox_stat_store_destroy (store);
             printf ("Files : %d\n", files);
             printf ("Subfolders : %d\n", dirs);
             printf ("Total size: %ld\n", size);
@@ -11,13 +11,20 @@ GPL v3.0
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
-#include <fnmatch.h>
 #include "cJSON.h"
 #include "dropbox.h"
 #include "token.h"
 #include "commands.h"
 #include "log.h"
 #include "errmsg.h"
+#include "matcher.h"
+
+// What to keep of the listing
+typedef struct _ListSelect
+  {
+  Matcher *spec;
+  RankTop *top; // With --top, or NULL
+  } ListSelect;
 
 /*==========================================================================
 make_display_time
@@ -59,9 +66,9 @@ static char *make_display_name (const DBStat *stat, BOOL recursive)
   else
     {
     if (stat->type == DBSTAT_FOLDER)
-      asprintf (&ret, "%s/", stat->name);
+      asprintf (&ret, "%s/", dropbox_stat_get_name (stat));
     else
-      asprintf (&ret, "%s", stat->name);
+      asprintf (&ret, "%s", dropbox_stat_get_name (stat));
     }
   return ret;
   }
@@ -248,6 +255,22 @@ static void display_list_short (List *list, int screen_width)
   }
 
 
+/*==========================================================================
+cmd_list_filter
+Keep the entries that match the pattern. With --top, they are offered
+to the ranking instead, which keeps its own copy of the few it wants,
+so the store stays empty however long the listing is
+*==========================================================================*/
+static BOOL cmd_list_filter (const DBStat *stat, void *user)
+  {
+  ListSelect *sel = user;
+  if (!finder_matches (stat, sel->spec)) return FALSE;
+  if (!sel->top) return TRUE;
+  ranking_top_offer (sel->top, stat);
+  return FALSE;
+  }
+
+
 /*==========================================================================
 cmd_list
 *==========================================================================*/
@@ -263,6 +286,12 @@ int cmd_list (const CmdContext *context, int argc, char **argv)
   BOOL recursive = context->recursive;
   BOOL long_ = context->long_;
 
+  if (context->top > 0 && context->sort == RANK_NONE)
+    {
+    log_error ("%s: %s: --top needs --sort", argv[0], ERROR_USAGE);
+    return EINVAL;
+    }
+
   if (argc < 2)
     path = strdup (""); // Root
   else
@@ -326,8 +355,15 @@ int cmd_list (const CmdContext *context, int argc, char **argv)
             break;
 	  }
 
-	List *list = dropbox_stat_create_list();
-	dropbox_list_files (token, dir, list, TRUE, recursive, &error);
+	// Only the entries that match are kept, as they are listed
+	ListSelect sel;
+	sel.spec = matcher_create (spec);
+	sel.top = context->top > 0 
+	  ? ranking_top_create (context->sort, context->top) : NULL;
+	DBStatStore *store = dropbox_stat_store_create();
+	dropbox_stat_store_set_filter (store, cmd_list_filter, &sel);
+	finder_find (token, dir, spec, store, TRUE, recursive, 
+          context->list_jobs, context->search, NULL, NULL, &error);
 
 	if (error)
 	  {
@@ -337,24 +373,21 @@ int cmd_list (const CmdContext *context, int argc, char **argv)
 	  } 
 	else
 	  {
-          List *globbed_list = dropbox_stat_create_list ();
-
-          int i, l = list_length (list);
-	  for (i = 0; i < l; i++)
-	    {
-	    const DBStat *stat = list_get (list, i);
-	    const char *path = dropbox_stat_get_path (stat); 
-	    char *pathcopy = strdup (path);
-	    char *filename = basename (pathcopy);
-	    // Not sure about this logic
-	    if ((fnmatch (spec, path, 0) == 0)
-	        || (fnmatch (spec, filename, 0) == 0))
-              {
-              DBStat *statcopy = dropbox_stat_clone (stat);
-	      list_append (globbed_list, statcopy); 
-              }
-	    free (pathcopy);
-	    } 
+          // The matching items stay in the store, or the ranking -- 
+          //   this list does not own them
+          List *globbed_list;
+          if (sel.top)
+            globbed_list = ranking_top_get (sel.top);
+          else
+            {
+            globbed_list = list_create (NULL);
+            uint32_t i, l = dropbox_stat_store_length (store);
+            uint32_t *order = ranking_sort_store (store, context->sort);
+	    for (i = 0; i < l; i++)
+	      list_append (globbed_list, 
+                dropbox_stat_store_get (store, order[i])); 
+            free (order);
+            }
       
           if (list_length (globbed_list) > 0) 
             {
@@ -372,7 +405,9 @@ int cmd_list (const CmdContext *context, int argc, char **argv)
 	  list_destroy (globbed_list);
 	  } 
 
-	list_destroy (list);
+	dropbox_stat_store_destroy (store);
+	ranking_top_destroy (sel.top);
+	matcher_destroy (sel.spec);
         free (spec);
         free (dir);
         }
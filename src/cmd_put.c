@@ -16,6 +16,7 @@ GPL v3.0
 #include <sys/stat.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "cJSON.h"
 #include "dropbox.h"
 #include "token.h"
@@ -23,6 +24,25 @@ GPL v3.0
 #include "log.h"
 #include "errmsg.h"
 #include "misc.h"
+#include "localwatch.h"
+#include "walker.h"
+#include "pipeline.h"
+#include "planner.h"
+#include "journal.h"
+#include "hashindex.h"
+#include "arena.h"
+
+// In watch mode, local changes are collected until there have been none
+//   for this long, or for at most the maximum, before being uploaded
+#define PUT_WATCH_DEBOUNCE_MS 1000
+#define PUT_WATCH_MAX_DELAY_MS 10000
+
+// Each stage of the pipeline can have this many files per thread 
+//   queued in front of it
+#define PUT_QUEUED_PER_THREAD 4
+
+// Counters may be updated by several stages at once
+#define COUNT(field) __atomic_add_fetch (&counters->field, 1, __ATOMIC_RELAXED)
 
 
 /*==========================================================================
@@ -36,335 +56,823 @@ typedef struct _Counters
   int read_local_failed;
   int upload_failed;
   int uploaded;
+  int copied;
   int skip_not_file_or_dir;
   int skip_not_recursive;
   int skip_unchanged;
   int skip_too_big;
   int skip_too_old;
   int skip_not_new;
+  int skip_done;
   int directories_could_not_be_expanded;
   } Counters;
 
+// The stages that each file goes through. The walker, which finds the
+//   files, comes before these, and runs on its own threads. Files skip
+//   the hash and compare stages if there is nothing to compare with
+enum {PUT_STAGE_STAT, PUT_STAGE_HASH, PUT_STAGE_COMPARE, PUT_STAGE_UPLOAD};
+
+// With --server-copy, where content that is already on the server can
+//   be found: a remote path for each content hash
+typedef struct _PutCopies
+  {
+  pthread_mutex_t mutex;
+  HashIndex *by_hash;
+  Arena *paths; // Of paths added during the run
+  } PutCopies;
+
+// Everything the stages share
+typedef struct _PutRun
+  {
+  const char *token;
+  const CmdContext *context;
+  const DBStatStore *store;
+  Counters *counters;
+  int buffsize_mb;
+  const char *argv0;
+  List *planned; // With --plan, files waiting to be scheduled
+  Journal *journal; // Files already done, for --resume, or NULL
+  PutCopies *copies; // With --server-copy, or NULL
+  } PutRun;
+
+// A file, on its way through the pipeline. A batch of files goes to the
+//   upload stage as a chain
+typedef struct _PutItem
+  {
+  char *source;
+  char *target;
+  time_t smod;
+  int64_t size;
+  unsigned char remote_hash [DBHASH_RAW_LENGTH];
+  unsigned char local_hash [DBHASH_RAW_LENGTH];
+  BOOL hashed;
+  BOOL remote_exists;
+  char *copy_from; // A remote file with the same content, or NULL
+  struct _PutItem *next;
+  } PutItem;
 
 /*==========================================================================
 cmd_put_progress_func
 *==========================================================================*/
 static void cmd_put_progress_func (int64_t transferred, int64_t total)
   {
-  if (isatty (STDIN_FILENO))
+  misc_show_progress ("Uploaded", transferred, total);
+  }
+
+
+/*==========================================================================
+cmd_put_item_free
+Frees the whole chain, if the item is the head of one
+*==========================================================================*/
+static void cmd_put_item_free (void *p)
+  {
+  PutItem *item = p;
+  while (item)
+    {
+    PutItem *next = item->next;
+    free (item->source);
+    free (item->target);
+    free (item->copy_from);
+    free (item);
+    item = next;
+    }
+  }
+
+
+/*==========================================================================
+cmd_put_copies_create
+Index the files in the listing of the destination, if there is one, by
+content hash. The listing must outlive the index
+*==========================================================================*/
+static PutCopies *cmd_put_copies_create (const DBStatStore *store)
+  {
+  PutCopies *self = malloc (sizeof (PutCopies));
+  pthread_mutex_init (&self->mutex, NULL);
+  self->by_hash = hashindex_create ();
+  self->paths = arena_create (ARENA_BLOCK_SIZE);
+  uint32_t i, l = store ? dropbox_stat_store_length (store) : 0;
+  for (i = 0; i < l; i++)
+    {
+    const DBStat *stat = dropbox_stat_store_get (store, i);
+    const unsigned char *hash = dropbox_stat_get_hash_raw (stat);
+    if (dropbox_stat_get_type (stat) == DBSTAT_FILE && hash)
+      hashindex_put (self->by_hash, hash, DBHASH_RAW_LENGTH, 
+        (void *)dropbox_stat_get_path (stat), FALSE);
+    }
+  log_debug ("%d remote file(s) indexed by content", 
+    (int)hashindex_length (self->by_hash));
+  return self;
+  }
+
+
+/*==========================================================================
+cmd_put_copies_destroy
+*==========================================================================*/
+static void cmd_put_copies_destroy (PutCopies *self)
+  {
+  if (!self) return;
+  hashindex_destroy (self->by_hash);
+  arena_destroy (self->paths);
+  pthread_mutex_destroy (&self->mutex);
+  free (self);
+  }
+
+
+/*==========================================================================
+cmd_put_copies_find
+Returns a remote path with the given content, which the caller must 
+free, or NULL
+*==========================================================================*/
+static char *cmd_put_copies_find (PutCopies *self, 
+    const unsigned char hash[DBHASH_RAW_LENGTH])
+  {
+  pthread_mutex_lock (&self->mutex);
+  const char *path = hashindex_get (self->by_hash, hash, DBHASH_RAW_LENGTH);
+  char *ret = path ? strdup (path) : NULL;
+  pthread_mutex_unlock (&self->mutex);
+  return ret;
+  }
+
+
+/*==========================================================================
+cmd_put_copies_add
+Note that a remote path now has the given content
+*==========================================================================*/
+static void cmd_put_copies_add (PutCopies *self, 
+    const unsigned char hash[DBHASH_RAW_LENGTH], const char *path)
+  {
+  if (!self) return;
+  pthread_mutex_lock (&self->mutex);
+  if (!hashindex_get (self->by_hash, hash, DBHASH_RAW_LENGTH))
+    hashindex_put (self->by_hash, hash, DBHASH_RAW_LENGTH, 
+      arena_strdup (self->paths, path), TRUE);
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*==========================================================================
+cmd_put_to_upload
+Send a file that needs to be uploaded to the upload stage or, if
+there's a plan to be made, keep it until the plan is ready
+*==========================================================================*/
+static void cmd_put_to_upload (Pipeline *pipeline, const PutRun *run, 
+    PutItem *item)
+  {
+  if (run->planned)
+    list_append (run->planned, item);
+  else
+    pipeline_push (pipeline, PUT_STAGE_UPLOAD, item);
+  }
+
+
+/*==========================================================================
+cmd_put_stage_stat
+Decide whether a file needs to be looked at more closely. If there is
+an indexed listing of the remote destination, the remote file's
+metadata is taken from there; otherwise we have to ask the server for
+it. Unless --checksum was given, a remote file with the same size as
+the local one, and a client_modified time the same as its modification
+time, is taken to be unchanged, as rsync does, without hashing
+*==========================================================================*/
+static void cmd_put_stage_stat (Pipeline *pipeline, void *p, void *user)
+  {
+  PutItem *item = p;
+  const PutRun *run = user;
+  const CmdContext *context = run->context;
+  Counters *counters = run->counters;
+
+  COUNT (total_items);
+  log_debug ("Considering uploading %s to %s", item->source, item->target);
+
+  int elapsed_days = (int)((time (NULL) - item->smod) / 24 / 3600);
+  if (context->days_old != 0 && elapsed_days >= context->days_old)
     {
-    if (transferred < 0)
+    log_info
+       ("Skipping '%s' because local file is more than %d day(s) old",
+	  item->source, context->days_old);
+    COUNT (skip_too_old);
+    cmd_put_item_free (item);
+    return;
+    }
+
+  // A file that was done by an interrupted run, and hasn't been touched
+  //   since, needs no more work
+  JournalEntry done;
+  if (context->resume && journal_find (run->journal, item->source, &done)
+      && done.size == item->size && done.mtime == item->smod)
+    {
+    log_info ("Skipping '%s', which was uploaded by an earlier run",
+      item->source);
+    COUNT (skip_done);
+    cmd_put_item_free (item);
+    return;
+    }
+
+  char *error = NULL;
+  BOOL certain = FALSE;
+  DBStat *fetched = NULL;
+  const DBStat *stat = dropbox_stat_store_find (run->store, item->target,
+    &certain);
+  if (!stat && !certain)
+    {
+    fetched = dropbox_stat_create();
+    dropbox_get_file_info (run->token, item->target, fetched, &error);
+    stat = fetched;
+    }
+
+  PutItem *next = NULL;
+  int next_stage = 0;
+  if (error)
+    {
+    log_error ("%s: %s: %s", run->argv0, ERROR_CANTINFOSERVER, error);
+    COUNT (get_info_failed);
+    free (error);
+    }
+  else if (stat && dropbox_stat_get_type (stat) == DBSTAT_FILE)
+    {
+    if (!context->new_files_only && !context->checksum
+         && dropbox_stat_get_length (stat) == item->size
+         && dropbox_stat_get_client_modified (stat) == item->smod)
       {
-      printf ("\n"); // Clear progress line when done
+      log_info
+         ("Skipping file '%s' with the same size and time on client "
+          "and server", item->source);
+      COUNT (skip_unchanged);
+      journal_record (run->journal, item->source, item->size, item->smod,
+        NULL);
+      }
+    else if (!context->new_files_only)
+      {
+      // If the server didn't supply a hash, the zeros won't match the 
+      //   local one
+      const unsigned char *hash = dropbox_stat_get_hash_raw (stat);
+      if (hash)
+        memcpy (item->remote_hash, hash, DBHASH_RAW_LENGTH);
+      else
+        memset (item->remote_hash, 0, DBHASH_RAW_LENGTH);
+      item->remote_exists = TRUE;
+      next = item;
+      next_stage = PUT_STAGE_HASH;
       }
     else
       {
-      char *s_transferred, *s_total;
-      misc_format_size (transferred, &s_transferred);
-      misc_format_size (total, &s_total);
-      char *line;
-      asprintf (&line, "Uploaded %s of %s", s_transferred, s_total);
-      printf (line);
-      int i, l = strlen (line);
-      for (i = l; i < 40; i++) fputs (" ", stdout);
-      printf ("\r"); 
-      fflush (stdout);
-      free (line);
-      free (s_transferred);
-      free (s_total);
+      log_info ("Skipping '%s' as new-files-only is enabled", item->source);
+      COUNT (skip_not_new);
       }
     }
+  else
+    {
+    log_debug ("Will upload '%s', as it does not exist on the server",
+       item->source);
+    next = item;
+    // To look for a copy on the server, we need the local hash
+    if (run->copies)
+      next_stage = PUT_STAGE_HASH;
+    else
+      {
+      log_info ("Uploading new file '%s' to server", item->source);
+      next_stage = PUT_STAGE_UPLOAD;
+      }
+    }
+  if (fetched) dropbox_stat_destroy (fetched);
+
+  if (next && next_stage == PUT_STAGE_UPLOAD)
+    cmd_put_to_upload (pipeline, run, next);
+  else if (next)
+    pipeline_push (pipeline, next_stage, next);
+  else
+    cmd_put_item_free (item);
   }
 
 
 /*==========================================================================
-cmd_put_consider_and_upload
+cmd_put_stage_hash
 *==========================================================================*/
-static void cmd_put_consider_and_upload (const char *token, 
-    const CmdContext *context, 
-    const char *source, const char *target, 
-    Counters *counters, const char *argv0)
+static void cmd_put_stage_hash (Pipeline *pipeline, void *p, void *user)
   {
-  BOOL dry_run = context->dry_run;
+  PutItem *item = p;
+  const PutRun *run = user;
+  Counters *counters = run->counters;
 
-  counters->total_items++;
-  int buffsize_mb = context->buffsize_mb;
-  if (buffsize_mb <= 0) buffsize_mb = 0;
-  if (buffsize_mb >= 150)
-     {
-     log_warning ("Limiting upload buffer size to 149Mb");
-     buffsize_mb = 149;
-     }
+  char *error = NULL;
+  dropbox_hash_raw (item->source, item->local_hash, &error);
+  if (error)
+    {
+    log_error ("%s: %s: %s", run->argv0, ERROR_LOCALHASH, error);
+    free (error);
+    COUNT (read_local_failed);
+    cmd_put_item_free (item);
+    }
+  else
+    {
+    item->hashed = TRUE;
+    pipeline_push (pipeline, PUT_STAGE_COMPARE, item);
+    }
+  }
 
-  log_debug ("Considering uploading %s to %s", source, target);
 
-  BOOL doit = FALSE;
+/*==========================================================================
+cmd_put_stage_compare
+A file that doesn't exist on the server yet can, with --server-copy, be
+made by copying a remote file with the same content. Copying onto an
+existing file would fail, so a changed file is always uploaded
+*==========================================================================*/
+static void cmd_put_stage_compare (Pipeline *pipeline, void *p, void *user)
+  {
+  PutItem *item = p;
+  const PutRun *run = user;
+  Counters *counters = run->counters;
+
+  if (!item->remote_exists && run->copies && (item->copy_from = 
+        cmd_put_copies_find (run->copies, item->local_hash)) != NULL)
+    {
+    log_info ("Copying '%s' to '%s' on server, as it has the content of "
+      "'%s'", item->source, item->target, item->copy_from);
+    cmd_put_to_upload (pipeline, run, item);
+    }
+  else if (!item->remote_exists)
+    {
+    log_info ("Uploading new file '%s' to server", item->source);
+    cmd_put_to_upload (pipeline, run, item);
+    }
+  else if (memcmp (item->local_hash, item->remote_hash, 
+        DBHASH_RAW_LENGTH) != 0)
+    {
+    log_debug ("Will upload, as hashes are different");
+    log_info ("Uploading updated file '%s' to server", item->source);
+    cmd_put_to_upload (pipeline, run, item);
+    }
+  else
+    {
+    log_info
+       ("Skipping file '%s' that is identical on client and server",
+        item->source);
+    COUNT (skip_unchanged);
+    journal_record (run->journal, item->source, item->size, item->smod,
+      item->local_hash);
+    cmd_put_item_free (item);
+    }
+  }
 
-  struct stat sb;
-  stat (source, &sb);
-  time_t now = time (NULL);
-  time_t smod = sb.st_mtime;
-  int elapsed_days = (int)((now - smod) / 24 / 3600);
 
-  BOOL new_files_only = context->new_files_only;
-  int days_old = context->days_old;
-//printf ("elapsed=%d\n", elapsed_days);
-  if (days_old == 0 || elapsed_days < days_old)
+/*==========================================================================
+cmd_put_copy_one
+Make a file by copying one on the server that had the same content when
+it was listed. If the copy fails, or the source changed in the meantime
+and the copy turns out to have the wrong content, returns FALSE, and the
+file should be uploaded instead
+*==========================================================================*/
+static BOOL cmd_put_copy_one (const PutRun *run, const PutItem *item)
+  {
+  Counters *counters = run->counters;
+  char *error = NULL;
+  unsigned char hash [DBHASH_RAW_LENGTH];
+  dropbox_copy (run->token, item->copy_from, item->target, hash, &error);
+  if (error)
+    {
+    log_info ("Can't copy '%s' on server, so uploading it: %s", 
+      item->copy_from, error);
+    free (error);
+    return FALSE;
+    }
+  if (memcmp (hash, item->local_hash, DBHASH_RAW_LENGTH) != 0)
+    {
+    log_info ("'%s' changed on server before it was copied, so "
+      "uploading '%s'", item->copy_from, item->source);
+    return FALSE;
+    }
+  COUNT (copied);
+  journal_record (run->journal, item->source, item->size, item->smod,
+    item->local_hash);
+  return TRUE;
+  }
+
+
+/*==========================================================================
+cmd_put_upload_one
+*==========================================================================*/
+static void cmd_put_upload_one (const PutRun *run, const PutItem *item)
+  {
+  Counters *counters = run->counters;
+
+  if (run->context->dry_run)
+    {
+    log_lock ();
+    if (item->copy_from)
+      printf ("Copy on server: %s\n", item->copy_from);
+    else
+      printf ("Source: %s\n", item->source);
+    printf ("Destination: %s\n\n", item->target);
+    log_unlock ();
+    }
+  else if (item->copy_from && cmd_put_copy_one (run, item))
+    {
+    cmd_put_copies_add (run->copies, item->local_hash, item->target);
+    }
+  else
     {
-    DBStat *stat = dropbox_stat_create();
     char *error = NULL;
-    dropbox_get_file_info (token, target, stat, &error);
+    dropbox_upload (run->token, item->source, item->target,
+      run->buffsize_mb, cmd_put_progress_func, &error);
     if (error)
       {
-      log_error ("%s: %s: %s", argv0, ERROR_CANTINFOSERVER, error);
-      counters->get_info_failed++;
+      log_error ("%s: %s: %s", run->argv0, ERROR_UPLOAD, error);
       free (error);
+      COUNT (upload_failed);
       }
     else
       {
-      if (dropbox_stat_get_type (stat) == DBSTAT_FILE)
-        {
-	if (!new_files_only)
-	  {
-          const char *remote_hash = dropbox_stat_get_hash (stat);
-          char local_hash [DBHASH_LENGTH];
-          dropbox_hash (source, local_hash, &error); 
-          if (error)
-            {
-            log_error ("%s: %s: %s", argv0, ERROR_LOCALHASH, error);
-            free (error);
-            counters->read_local_failed++;
-            }
-          else
-            {
-            if (strcmp (remote_hash, local_hash) != 0)
-              {
-              log_debug ("Will upload, as hashes are different");
-              log_info ("Uploading updated file '%s' to server", source);
-              doit = TRUE;
-              }
-            else
-              {
-              log_info 
-                 ("Skipping file '%s' that is identical on client and server",
-                  source);
-              counters->skip_unchanged++;
-              }
-            }
-	  }
-	else
-	  {
-          log_info ("Skipping '%s' as new-files-only is enabled", source);
-          counters->skip_not_new++;
-	  }
-        }
-      else 
-        {
-        log_info ("Uploading new file '%s' to server", source);
-        log_debug ("Will upload '%s', as it does not exist on the server", 
-           source);
-        doit = TRUE;
-        }
-      dropbox_stat_destroy (stat); 
+      COUNT (uploaded);
+      journal_record (run->journal, item->source, item->size, item->smod,
+        item->hashed ? item->local_hash : NULL);
+      // Later files with the same content can be copied from this one
+      if (item->hashed)
+        cmd_put_copies_add (run->copies, item->local_hash, item->target);
       }
     }
-  else
+  }
+
+
+/*==========================================================================
+cmd_put_stage_upload
+*==========================================================================*/
+static void cmd_put_stage_upload (Pipeline *pipeline, void *p, void *user)
+  {
+  const PutItem *item;
+  for (item = p; item != NULL; item = item->next)
+    cmd_put_upload_one (user, item);
+  cmd_put_item_free (p);
+  }
+
+
+/*==========================================================================
+cmd_put_requests
+The number of requests it takes to upload a file of a given size: one 
+to start the session, one for each block, and one to finish
+*==========================================================================*/
+static int cmd_put_requests (const PutRun *run, int64_t size)
+  {
+  int64_t block = (int64_t)(run->buffsize_mb > 0 ? run->buffsize_mb : 1) 
+    * 1024 * 1024;
+  return 2 + (int)((size + block - 1) / block);
+  }
+
+
+/*==========================================================================
+cmd_put_describe
+*==========================================================================*/
+static char *cmd_put_describe (const void *p)
+  {
+  const PutItem *item = p;
+  char *ret;
+  asprintf (&ret, "%s -> %s", item->source, item->target);
+  return ret;
+  }
+
+
+/*==========================================================================
+cmd_put_run_plan
+With --plan, once every file has been checked, schedule the uploads, 
+and start them in the planned order -- or, in a dry run, show the plan
+*==========================================================================*/
+static void cmd_put_run_plan (PutRun *run, Pipeline *pipeline)
+  {
+  pipeline_wait (pipeline);
+
+  Plan *plan = plan_create (run->context->jobs);
+  int i, l = list_length (run->planned);
+  for (i = 0; i < l; i++)
     {
-    log_info 
-       ("Skipping '%s' because local file is more than %d day(s) old", 
-	  source, days_old);
-    counters->skip_too_old++;
+    PutItem *item = list_get (run->planned, i);
+    if (item->copy_from)
+      plan_add (plan, item, 0, 1);
+    else
+      plan_add (plan, item, item->size, 
+        cmd_put_requests (run, item->size));
     }
+  plan_schedule (plan);
 
-  if (doit)
+  if (run->context->dry_run)
     {
-    if (dry_run)
-      {
-      printf ("Source: %s\n", source);
-      printf ("Destination: %s\n\n", target);
-      }
-    else
+    if (l > 0) plan_print (plan, cmd_put_describe);
+    for (i = 0; i < l; i++)
+      cmd_put_item_free (list_get (run->planned, i));
+    }
+  else
+    {
+    l = plan_length (plan);
+    for (i = 0; i < l; i++)
       {
-      char *error = NULL;
-      dropbox_upload (token, source, target, buffsize_mb, 
-        cmd_put_progress_func, &error); 
-      if (error)
-        {
-        log_error ("%s: %s: %s", argv0, ERROR_UPLOAD, error);
-        free (error);
-        counters->upload_failed++;
-        }
-      else
-        {
-        counters->uploaded++;
-        }
+      const PlanUnit *unit = plan_get (plan, i);
+      int j, n = list_length (unit->items);
+      for (j = 0; j < n - 1; j++)
+        ((PutItem *)list_get (unit->items, j))->next = 
+          list_get (unit->items, j + 1);
+      pipeline_push (pipeline, PUT_STAGE_UPLOAD, list_get (unit->items, 0));
       }
     }
+
+  plan_destroy (plan);
+  list_clear (run->planned);
   }
 
 
 /*==========================================================================
-put_one_item
+cmd_put_run_init
 *==========================================================================*/
-static void put_one_item (const char *token, const CmdContext *context, 
-    const char *_base, const char *_relative, const char *remote, 
-    Counters *counters, BOOL remote_is_dir, const char *argv0)
+static void cmd_put_run_init (PutRun *run, const char *token, 
+    const CmdContext *context, const DBStatStore *store, 
+    Counters *counters, const char *argv0)
   {
-  IN
+  run->token = token;
+  run->context = context;
+  run->store = store;
+  run->counters = counters;
+  run->argv0 = argv0;
+  run->planned = NULL;
+  run->journal = NULL;
+  run->copies = NULL;
+  run->buffsize_mb = context->buffsize_mb;
+  if (run->buffsize_mb <= 0) run->buffsize_mb = 0;
+  if (run->buffsize_mb >= 150)
+     {
+     log_warning ("Limiting upload buffer size to 149Mb");
+     run->buffsize_mb = 149;
+     }
+  }
 
-  BOOL recursive = context->recursive;
 
-  char *base = strdup (_base);
-  char *relative = strdup (_relative);
-  if (strcmp (relative, ".") == 0)
-    relative[0] = 0;
+/*==========================================================================
+cmd_put_pipeline_create
+Set up the stages that files go through once the walker has found
+them. Checking the remote file (when there's no listing) and uploading
+wait on the network, and hashing on the disk and CPU, so each has its
+own threads
+*==========================================================================*/
+static Pipeline *cmd_put_pipeline_create (PutRun *run)
+  {
+  const CmdContext *context = run->context;
+  int upload_jobs = context->jobs > 0 ? context->jobs : 1;
+  int stat_jobs = context->stat_jobs > 0 ? context->stat_jobs : upload_jobs;
+  int hash_jobs = context->hash_jobs > 0 ? context->hash_jobs : 1;
 
-  char *full_local;
+  Pipeline *pipeline = pipeline_create ("put", run, cmd_put_item_free);
+  pipeline_add_stage (pipeline, "stat", cmd_put_stage_stat, stat_jobs,
+    stat_jobs * PUT_QUEUED_PER_THREAD);
+  pipeline_add_stage (pipeline, "hash", cmd_put_stage_hash, hash_jobs,
+    hash_jobs * PUT_QUEUED_PER_THREAD);
+  // Comparing two hashes takes no time at all
+  pipeline_add_stage (pipeline, "compare", cmd_put_stage_compare, 1,
+    PUT_QUEUED_PER_THREAD);
+  pipeline_add_stage (pipeline, "upload", cmd_put_stage_upload, upload_jobs,
+    upload_jobs * PUT_QUEUED_PER_THREAD);
+  pipeline_start (pipeline);
+  return pipeline;
+  }
 
-  char *exp_base;
-  if (base[strlen(base) - 1] == '/')
-    exp_base = strdup (base);
-  else
-    asprintf (&exp_base, "%s/", base);
 
-  asprintf (&full_local, "%s%s", exp_base, relative);
+/*==========================================================================
+cmd_put_walk
+Upload base/relative, which may be a file or a directory. Directories 
+are expanded, if we are in recursive mode, by a walker running on
+its own threads; the files it finds are fed into the pipeline as they
+arrive
+*==========================================================================*/
+static void cmd_put_walk (const PutRun *run, Pipeline *pipeline,
+    const char *base, const char *relative, const char *remote, 
+    BOOL remote_is_dir)
+  {
+  IN
+  const CmdContext *context = run->context;
+  Counters *counters = run->counters;
 
-  free (exp_base);
+  // File times and sizes are needed for the quick check, the --days-old
+  //   check, planning, and the journal. With --checksum, we can often
+  //   do without them
+  Walker *walker = walker_start (base, relative, context->recursive, 
+    !context->checksum || context->days_old != 0 || run->planned 
+      || run->journal, context->rules, context->walk_threads);
 
-  struct stat sb;
-  if (stat (full_local, &sb) == 0)
+  const char *sep = base[strlen(base) - 1] == '/' ? "" : "/";
+  WalkEntry *e;
+  while ((e = walker_next (walker)) != NULL)
     {
-    if (S_ISREG (sb.st_mode))
-      {
-      // FILE 
-      //if (sb.st_size < 150000000)
-      //  {
-	char *fullremote;
-
-	if (remote_is_dir)
-	  asprintf (&fullremote, "%s/%s", remote, relative);
-	else
-	  asprintf (&fullremote, "%s", remote);
-
-	cmd_put_consider_and_upload (token, context, full_local, fullremote,
-	  counters, argv0);
-
-	free (fullremote);
-      //  }
-      //else
-      //  {
-      //  log_warning ("File too large to upload");
-      //  counters->skip_too_big++;
-      //  }
-      }
-    else if (S_ISDIR (sb.st_mode))
+    char *full_local;
+    asprintf (&full_local, "%s%s%s", base, sep, e->relative);
+    switch (e->type)
       {
-      // DIRECTORY
-      log_debug ("%s is a directory", full_local);
-      if (recursive)
+      case WALK_FILE:
         {
-        DIR *d = opendir (full_local);
-        if (d)
-          {
-          struct dirent *de;
-          while ((de = readdir (d)) != NULL)
-            {
-            const char *name = de->d_name;
-            if (strcmp (name, ".") == 0) continue;
-            if (strcmp (name, "..") == 0) continue;
-            // TODO hidden files
-
-            char *newrel;
-
-            if (strlen (relative) == 0)
-              {
-              asprintf (&newrel, "%s", name);
-              }
-            else
-              {
-              if (relative[strlen(relative) - 1] == '/')
-                relative[strlen(relative) - 1] = 0;
-              asprintf (&newrel, "%s/%s", relative, name);
-              }
-
-            put_one_item (token, context, base, newrel, remote, counters, 
-              remote_is_dir, argv0);
-
-            free (newrel);
-            }
-          closedir (d);
-          }
+        PutItem *item = malloc (sizeof (PutItem));
+        item->source = strdup (full_local);
+        if (remote_is_dir)
+          asprintf (&item->target, "%s/%s", remote, e->relative);
         else
-          {
-	  log_warning 
-	    ("Directory %s cannot be expanded: %s", 
-	      full_local, strerror (errno));
-	  counters->directories_could_not_be_expanded++; 
-          } 
-        } 
-      else
-        {
-	log_warning 
-	  ("skipping directory %s because recursive mode was not specified ", 
-	    full_local);
-	counters->skip_not_recursive++; 
-	}
-      }
-    else
-      {
-      // NOT REGULAR 
-      log_warning ("%s in not a regular file or directory", full_local);
-      counters->skip_not_file_or_dir++; 
+          item->target = strdup (remote);
+        item->smod = e->mtime;
+        item->size = e->size;
+        item->hashed = FALSE;
+        item->remote_exists = FALSE;
+        item->copy_from = NULL;
+        item->next = NULL;
+        pipeline_push (pipeline, PUT_STAGE_STAT, item);
+        }
+        break;
+      case WALK_DIR_SKIPPED:
+        log_warning 
+          ("skipping directory %s because recursive mode was not specified ", 
+            full_local);
+        COUNT (skip_not_recursive); 
+        break;
+      case WALK_OTHER:
+        log_warning ("%s in not a regular file or directory", full_local);
+        COUNT (skip_not_file_or_dir); 
+        break;
+      case WALK_STAT_FAILED:
+        log_warning ("can't get attributes of %s: %s", full_local, 
+          strerror (e->error));
+        COUNT (stat_failed); 
+        break;
+      case WALK_OPEN_FAILED:
+        log_warning ("Directory %s cannot be expanded: %s", 
+          full_local, strerror (e->error));
+        COUNT (directories_could_not_be_expanded); 
+        break;
       }
+    free (full_local);
+    walker_entry_free (e);
     }
-  else
+
+  walker_destroy (walker);
+  OUT
+  }
+
+
+/*==========================================================================
+cmd_put_split_local_spec
+Work out the base directory, and the path relative to it, of a local 
+argument. The relative path is what gets appended to the remote path.
+If the argument ends in a /, its contents go directly into the remote
+path, as with rsync; otherwise its name is kept. The caller must free
+*base and *relative. Returns FALSE if the path can't be resolved
+*==========================================================================*/
+static BOOL cmd_put_split_local_spec (const char *local, char **base,
+    char **relative)
+  {
+  if (local[strlen(local) - 1] == '/')
     {
-    log_warning ("can't get attributes of %s: %s", full_local, 
-      strerror (errno));
-    counters->stat_failed++; 
+    *base = strdup (local);
+    *relative = strdup (".");
+    return TRUE;
     }
 
-  free (full_local);
-  free (base);
-  free (relative);
-  OUT
+  char *abspath = realpath (local, NULL);
+  if (!abspath) return FALSE;
+  char *_local = strdup (abspath);
+  char *__local = strdup (abspath);
+  *relative = strdup (basename (_local));
+  *base = strdup (dirname (__local));
+  free (_local);
+  free (__local);
+  free (abspath);
+  return TRUE;
   }
 
 
 /*==========================================================================
 cmd_put_one_local_spec
 *==========================================================================*/
-static void cmd_put_one_local_spec (const char *token, 
-    const CmdContext *context, 
-    const char *local, const char *remote, Counters *counters, 
-    BOOL remote_is_dir, const char *argv0)
+static void cmd_put_one_local_spec (const PutRun *run, Pipeline *pipeline,
+    const char *local, const char *remote, BOOL remote_is_dir)
   {
-  if (local[strlen(local) - 1] == '/')
+  Counters *counters = run->counters;
+  char *base, *relative;
+  if (cmd_put_split_local_spec (local, &base, &relative))
     {
-    put_one_item (token, context, local, ".", remote, counters, remote_is_dir,
-       argv0);
+    cmd_put_walk (run, pipeline, base, relative, remote, remote_is_dir);
+    free (base);
+    free (relative);
     }
   else
     {
-    char *abspath = realpath (local, NULL);
-    if (abspath)
+    COUNT (read_local_failed);
+    log_error ("Can't get full path for '%s'", local);
+    }
+  }
+
+
+/*==========================================================================
+cmd_put_watch_create
+Start watching the local arguments for changes. This is done before 
+the initial upload, so that anything that changes while it runs is
+picked up afterwards. Returns NULL, and sets *error, if the changes
+can't be monitored
+*==========================================================================*/
+static LocalWatch *cmd_put_watch_create (const CmdContext *context, 
+    int argc, char **argv, char **error)
+  {
+  LocalWatch *watch = localwatch_create (context->rules, error);
+  if (!watch) return NULL;
+
+  int i;
+  for (i = 1; i < argc - 1; i++)
+    {
+    char *base, *relative;
+    if (cmd_put_split_local_spec (argv[i], &base, &relative))
       {
-      char *_local = strdup (abspath);
-      char *__local = strdup (abspath);
-      char *filename = basename (_local);
-      char *dir = dirname (__local);
-      put_one_item (token, context, dir, filename, remote, counters, 
-        remote_is_dir, argv0);
-      free (_local);
-      free (__local);
-      free (abspath);
+      localwatch_add (watch, base, relative, context->recursive);
+      free (base);
+      free (relative);
       }
-    else
+    }
+  return watch;
+  }
+
+
+/*==========================================================================
+cmd_put_watch
+Having done the initial upload, wait for local files to change, and
+upload them. The first batch includes whatever changed during the 
+initial upload. This only returns if the changes can't be monitored.
+The remote listing from the initial upload isn't used, as it goes out
+of date as soon as we upload anything; each changed file is checked on
+the server instead. Changes that the include and exclude rules leave
+out are ignored. Takes ownership of watch
+*==========================================================================*/
+static int cmd_put_watch (const char *token, const CmdContext *context, 
+    LocalWatch *watch, const char *argv0, const char *remote, 
+    BOOL remote_is_dir)
+  {
+  int i;
+  // Log lines should reach a redirected stdout as they happen
+  setvbuf (stdout, NULL, _IOLBF, 0);
+  log_info ("Watching for local changes");
+
+  // One pipeline serves every batch of changes, so its threads, and 
+  //   their connections to the server, stay open between batches
+  Counters counters;
+  memset (&counters, 0, sizeof (Counters));
+  PutRun run;
+  cmd_put_run_init (&run, token, context, NULL, &counters, argv0);
+  Pipeline *pipeline = cmd_put_pipeline_create (&run);
+
+  List *changes;
+  while ((changes = localwatch_wait (watch, PUT_WATCH_DEBOUNCE_MS,
+            PUT_WATCH_MAX_DELAY_MS)) != NULL)
+    {
+    int l = list_length (changes);
+    for (i = 0; i < l; i++)
       {
-      counters->read_local_failed++;
-      log_error ("Can't get full path for '%s'", local);
+      const LocalChange *c = list_get (changes, i);
+      // The walk only checks what is below where it starts
+      if (c->relative[0] && strcmp (c->relative, ".") != 0
+          && rules_excluded_tree (context->rules, c->relative, c->is_dir))
+        {
+        log_debug ("Excluding changed '%s'", c->relative);
+        continue;
+        }
+      cmd_put_walk (&run, pipeline, c->base, c->relative, remote, 
+        remote_is_dir);
       }
+    pipeline_wait (pipeline);
+    log_info ("Uploaded %d of %d changed file(s)", counters.uploaded, 
+      counters.total_items);
+    memset (&counters, 0, sizeof (Counters));
+    list_destroy (changes);
     }
+
+  pipeline_destroy (pipeline);
+  localwatch_destroy (watch);
+  return EIO;
+  }
+
+
+/*==========================================================================
+cmd_put_journal_key
+Identifies the operation that a journal belongs to: the local arguments,
+made absolute, but keeping any trailing /, and the destination. Caller
+frees the result
+*==========================================================================*/
+static char *cmd_put_journal_key (int argc, char **argv, 
+    const char *remote)
+  {
+  char *key = strdup ("put");
+  int i;
+  for (i = 1; i < argc - 1; i++)
+    {
+    const char *local = argv[i];
+    char *abspath = realpath (local, NULL);
+    char *s = NULL;
+    asprintf (&s, "%s\t%s%s", key, abspath ? abspath : local, 
+      abspath && local[strlen(local) - 1] == '/' ? "/" : "");
+    free (abspath);
+    free (key);
+    key = s;
+    }
+  char *s = NULL;
+  asprintf (&s, "%s\t%s", key, remote);
+  free (key);
+  return s;
   }
 
 
@@ -416,6 +924,13 @@ int cmd_put (const CmdContext *context, int argc, char **argv)
       {
       DBStat *stat = dropbox_stat_create();
       dropbox_get_file_info (token, dest_spec, stat, &error);
+      if (error)
+        {
+        // Treat the destination as a file; the upload will report
+        //   the problem, if there is one
+        free (error);
+        error = NULL;
+        }
       if (dropbox_stat_get_type (stat) == DBSTAT_FOLDER)
         remote_is_dir = TRUE;
       else
@@ -426,30 +941,84 @@ int cmd_put (const CmdContext *context, int argc, char **argv)
     // This is not sufficient -- we need to expand the file list, not
     //  just count the number of arguments. If an argument contains 
     //  multiple files, it will still need the target to be a folder
+    LocalWatch *watch = NULL;
     if (argc > 3 && !remote_is_dir)
       {
       log_error ("%s: %s", argv[0], ERROR_MULTIFILE); 
       }
+    else if (context->watch 
+        && !(watch = cmd_put_watch_create (context, argc, argv, &error)))
+      {
+      log_error ("%s: %s", argv[0], error);
+      free (error);
+      ret = EBADRQC;
+      }
     else
       {
-      // TODO process include/exclude 
-
       Counters *counters = malloc (sizeof (Counters));
       memset (counters, 0, sizeof (Counters));
 
+      // When more than one file is likely to be uploaded, a single 
+      //   listing of the destination is much cheaper than asking the
+      //   server about each file in turn. If the listing fails, for
+      //   whatever reason, we fall back to doing that
+      DBStatStore *store = NULL;
+      if (remote_is_dir && (context->recursive || argc > 3))
+        {
+        store = dropbox_stat_store_create_indexed ();
+        dropbox_list_parallel (token, dest_spec, store, FALSE, 
+          context->recursive, context->list_jobs, NULL, NULL, &error);
+        if (error)
+          {
+          log_debug ("Can't list destination: %s", error);
+          free (error);
+          error = NULL;
+          dropbox_stat_store_destroy (store);
+          store = NULL;
+          }
+        }
+
+      PutRun run;
+      cmd_put_run_init (&run, token, context, store, counters, argv[0]);
+      if (context->plan)
+        run.planned = list_create_locked (NULL);
+      // Only a recursive upload is big enough to be worth resuming
+      if (context->recursive && !context->dry_run)
+        {
+        char *key = cmd_put_journal_key (argc, argv, dest_spec);
+        run.journal = journal_open (key, context->resume);
+        free (key);
+        }
+      if (context->server_copy)
+        run.copies = cmd_put_copies_create (store);
+      Pipeline *pipeline = cmd_put_pipeline_create (&run);
+
       int i;
       for (i = 1; i < argc - 1; i++)
 	{
-	cmd_put_one_local_spec (token, context, argv[i], dest_spec, counters, 
-          remote_is_dir, argv[0]);
+	cmd_put_one_local_spec (&run, pipeline, argv[i], dest_spec, 
+          remote_is_dir);
 	}
+
+      if (run.planned)
+        {
+        cmd_put_run_plan (&run, pipeline);
+        list_destroy (run.planned);
+        }
+
+      // Waits for the last files to get through
+      pipeline_destroy (pipeline);
+      cmd_put_copies_destroy (run.copies);
+      dropbox_stat_store_destroy (store);
  
       printf ("Files considered: %d\n", counters->total_items);
       printf ("Uploaded: %d\n", counters->uploaded); 
+      if (counters->copied > 0)
+        printf ("Copied on server: %d\n", counters->copied); 
       int total_skips = counters->skip_not_file_or_dir +  
             counters->skip_not_recursive + counters->skip_unchanged 
             + counters->skip_too_big + counters->skip_too_old 
-	    + counters->skip_not_new;
+	    + counters->skip_not_new + counters->skip_done;
       if (total_skips > 0)
         {
         printf ("Skipped: %d\n", total_skips); 
@@ -459,6 +1028,8 @@ int cmd_put (const CmdContext *context, int argc, char **argv)
            counters->skip_not_file_or_dir);
         printf ("  Too old: %d\n", counters->skip_too_old);
         printf ("  Not new: %d\n", counters->skip_not_new);
+        if (context->resume)
+          printf ("  Done by an earlier run: %d\n", counters->skip_done);
         printf ("  Not expanded without recursive mode: %d\n", 
           counters->skip_not_recursive);
         }
@@ -480,7 +1051,12 @@ int cmd_put (const CmdContext *context, int argc, char **argv)
          counters->upload_failed); 
         }
 
+      journal_close (run.journal, total_errors == 0);
       free (counters);
+
+      if (watch)
+        ret = cmd_put_watch (token, context, watch, argv[0], dest_spec, 
+          remote_is_dir);
       }
     free (token);
     }
@@ -0,0 +1,157 @@
+/*---------------------------------------------------------------------------
+dbcmd
+cmd_watch.c
+GPL v3.0
+---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "dropbox.h"
+#include "token.h"
+#include "commands.h"
+#include "cursors.h"
+#include "log.h"
+#include "errmsg.h"
+
+// How long each longpoll request waits for changes, in seconds. The 
+//  server accepts 30-480; longer means fewer idle requests
+#define WATCH_LONGPOLL_TIMEOUT 300
+
+// Limits for the delay before retrying after a failure, in seconds
+#define WATCH_RETRY_MIN 5
+#define WATCH_RETRY_MAX 300
+
+
+/*==========================================================================
+cmd_watch_retry_delay
+Sleep for the current retry delay, and double it for next time
+*==========================================================================*/
+static void cmd_watch_retry_delay (int *retry)
+  {
+  log_info ("Retrying in %d seconds", *retry);
+  sleep (*retry);
+  *retry *= 2;
+  if (*retry > WATCH_RETRY_MAX) *retry = WATCH_RETRY_MAX;
+  }
+
+
+/*==========================================================================
+cmd_watch_wait_for_changes
+Block until the server reports changes to the listing the cursor came
+from. Returns FALSE if the wait failed, and should be retried after a 
+delay
+*==========================================================================*/
+static BOOL cmd_watch_wait_for_changes (const char *cursor, 
+    const char *argv0)
+  {
+  BOOL changes = FALSE;
+  while (!changes)
+    {
+    char *error = NULL;
+    int backoff = 0;
+    dropbox_longpoll (cursor, WATCH_LONGPOLL_TIMEOUT, &changes, &backoff, 
+      &error);
+    if (error)
+      {
+      log_warning ("%s: %s: %s", argv0, ERROR_LONGPOLL, error);
+      free (error);
+      return FALSE;
+      }
+    if (backoff > 0)
+      {
+      log_debug ("Server asked for a backoff of %d seconds", backoff);
+      sleep (backoff);
+      }
+    }
+  return TRUE;
+  }
+
+
+/*==========================================================================
+cmd_watch
+Mirror a remote path into a local directory, as an incremental 'get'
+would, then wait on the server for changes and apply them as they come.
+The cursor is stored after each successful round, in the same place
+that 'get --incremental' uses, so a restarted watch doesn't need to
+list the remote path in full again
+*==========================================================================*/
+int cmd_watch (const CmdContext *context, int argc, char **argv)
+  {
+  IN
+  int ret = 0;
+
+  if (argc != 3)
+    {
+    log_error ("%s: %s: this command takes two arguments",
+      argv[0], ERROR_USAGE);
+    OUT
+    return EINVAL;
+    }
+
+  const char *remote = argv[1];
+  char *local = strdup (argv[2]);
+  if (strlen (local) > 1 && local[strlen(local) - 1] == '/')
+    local[strlen(local) - 1] = 0;
+
+  struct stat sb;
+  if (remote[0] != '/')
+    {
+    log_error ("%s: %s", argv[0], ERROR_STARTSLASH); 
+    ret = EINVAL;
+    }
+  else if (stat (local, &sb) != 0 || !S_ISDIR (sb.st_mode))
+    {
+    log_error ("%s: %s: %s", argv[0], ERROR_NOTLOCALDIR, local); 
+    ret = ENOTDIR;
+    }
+  else
+    {
+    char *error = NULL;
+    char *token = token_init (&error);
+    if (token)
+      {
+      // Log lines should reach a redirected stdout as they happen
+      setvbuf (stdout, NULL, _IOLBF, 0);
+      char *cursor = cursors_get (remote, local, context->recursive);
+      int retry = WATCH_RETRY_MIN;
+      // Each round uses the same download threads
+      GetSync *sync = cmd_get_sync_create (context);
+      log_info ("Watching '%s' for changes", remote);
+
+      while (TRUE)
+        {
+        // Catch up with the server. Without a cursor, this is a full get
+        int errors = cmd_get_sync (sync, token, context, remote, local, 
+          &cursor, argv[0]);
+        if (errors > 0 || cursor == NULL)
+          {
+          cmd_watch_retry_delay (&retry);
+          continue;
+          }
+        if (!context->dry_run)
+          cursors_put (remote, local, context->recursive, cursor);
+
+        if (cmd_watch_wait_for_changes (cursor, argv[0]))
+          retry = WATCH_RETRY_MIN;
+        else
+          cmd_watch_retry_delay (&retry);
+        }
+      }
+    else
+      {
+      log_error ("%s: %s: %s", argv[0], ERROR_INITTOKEN, error);
+      free (error);
+      ret = EBADRQC;
+      }
+    }
+
+  free (local);
+  OUT
+  return ret;
+  }
+
@@ -7,6 +7,10 @@ GPL v3.0
 #pragma once
 
 #include "bool.h"
+#include "finder.h"
+#include "rules.h"
+#include "ranking.h"
+#include "predicates.h"
 
 typedef struct _CmdContext
   { 
@@ -19,10 +23,30 @@ typedef struct _CmdContext
   int buffsize_mb;
   int days_old;
   BOOL new_files_only;
+  BOOL incremental;
+  BOOL watch;
+  BOOL plan;
+  BOOL resume;
+  BOOL checksum;
+  BOOL server_copy;
+  BOOL download_zip;
+  int walk_threads;
+  int jobs;
+  int stat_jobs;
+  int hash_jobs;
+  int list_jobs;
+  FinderSearch search;
+  Rules *rules; // --include and --exclude, or NULL if there are none
+  RankBy sort;
+  int top;
+  int max_depth; // For du; -1 for no limit
+  Predicates *predicates; // For find, or NULL if there are no tests
   } CmdContext;
 
 
 int cmd_delete (const CmdContext *context, int argc, char **argv);
+int cmd_du (const CmdContext *context, int argc, char **argv);
+int cmd_find (const CmdContext *context, int argc, char **argv);
 int cmd_move (const CmdContext *context, int argc, char **argv);
 int cmd_hash (const CmdContext *context, int argc, char **argv);
 int cmd_info (const CmdContext *context, int argc, char **argv);
@@ -31,4 +55,15 @@ int cmd_put (const CmdContext *context, int argc, char **argv);
 int cmd_get (const CmdContext *context, int argc, char **argv);
 int cmd_newfolder (const CmdContext *context, int argc, char **argv);
 int cmd_usage (const CmdContext *context, int argc, char **argv);
+int cmd_watch (const CmdContext *context, int argc, char **argv);
+
+// Shared between commands
+struct _GetSync;
+typedef struct _GetSync GetSync;
+
+GetSync *cmd_get_sync_create (const CmdContext *context);
+void cmd_get_sync_destroy (GetSync *self);
+int cmd_get_sync (GetSync *self, const char *token, 
+      const CmdContext *context, const char *remote, const char *local, 
+      char **cursor, const char *argv0);
 
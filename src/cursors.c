@@ -0,0 +1,143 @@
+/*---------------------------------------------------------------------------
+dbcmd
+cursors.c
+GPL v3.0
+
+Persistent storage for list_folder cursors, so that a later operation
+can ask the server only for what has changed. Each cursor is keyed on
+the remote path as given on the command line, the local directory, and
+whether the listing was recursive -- a cursor encodes the parameters of
+the listing that produced it. The file has one tab-separated line per
+cursor.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h> 
+#include <stdlib.h> 
+#include <string.h> 
+#include <unistd.h> 
+#include "cursors.h"
+#include "log.h"
+
+#define FILENAME ".dbcmd_cursors"
+
+/*---------------------------------------------------------------------------
+cursors_get_filename
+---------------------------------------------------------------------------*/
+static char *cursors_get_filename (void)
+  {
+  char *ret = NULL;
+  asprintf (&ret, "%s/" FILENAME, getenv("HOME"));
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+cursors_make_key
+The key is the start of the line, up to and including the tab that
+precedes the cursor. The local directory is made absolute, so it
+doesn't matter where we are run from. Returns NULL if the paths can't 
+be stored
+---------------------------------------------------------------------------*/
+static char *cursors_make_key (const char *remote, const char *_local, 
+    BOOL recursive)
+  {
+  char *local = realpath (_local, NULL);
+  if (!local) local = strdup (_local);
+  char *ret = NULL;
+  if (!strpbrk (remote, "\t\n") && !strpbrk (local, "\t\n"))
+    asprintf (&ret, "%d\t%s\t%s\t", recursive ? 1 : 0, remote, local);
+  free (local);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+cursors_get
+Returns the stored cursor, which the caller must free, or NULL if 
+there is none
+---------------------------------------------------------------------------*/
+char *cursors_get (const char *remote, const char *local, BOOL recursive)
+  {
+  char *ret = NULL;
+  char *key = cursors_make_key (remote, local, recursive);
+  if (!key) return NULL;
+  char *filename = cursors_get_filename();
+
+  FILE *f = fopen (filename, "r");
+  if (f)
+    {
+    char *s = NULL;
+    size_t n = 0;
+    size_t keylen = strlen (key);
+    while (ret == NULL && getline (&s, &n, f) > 0)
+      {
+      if (strncmp (s, key, keylen) == 0)
+        {
+        char *cursor = s + keylen;
+        cursor [strcspn (cursor, "\n")] = 0; 
+        if (cursor[0]) ret = strdup (cursor);
+        }
+      }
+    free (s);
+    fclose (f);
+    }
+
+  free (filename);
+  free (key);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+cursors_put
+Stores a cursor, replacing any with the same key. If cursor is NULL, the
+existing entry is just removed. The file is rewritten and renamed into
+place, so a failure part-way through leaves the old contents intact
+---------------------------------------------------------------------------*/
+void cursors_put (const char *remote, const char *local, BOOL recursive,
+        const char *cursor)
+  {
+  char *key = cursors_make_key (remote, local, recursive);
+  if (!key)
+    {
+    log_warning ("Can't store a cursor for a pathname containing a tab "
+      "or newline");
+    return;
+    }
+  char *filename = cursors_get_filename();
+  char *tempname = NULL;
+  asprintf (&tempname, "%s.tmp", filename);
+
+  FILE *out = fopen (tempname, "w");
+  if (out)
+    {
+    FILE *in = fopen (filename, "r");
+    if (in)
+      {
+      char *s = NULL;
+      size_t n = 0;
+      size_t keylen = strlen (key);
+      while (getline (&s, &n, in) > 0)
+        {
+        if (strncmp (s, key, keylen) != 0)
+          fputs (s, out);
+        }
+      free (s);
+      fclose (in);
+      }
+    if (cursor)
+      fprintf (out, "%s%s\n", key, cursor);
+    if (fclose (out) == 0)
+      rename (tempname, filename);
+    else
+      unlink (tempname);
+    }
+  else
+    log_warning ("Can't open file to store cursor: %s", tempname);
+
+  free (tempname);
+  free (filename);
+  free (key);
+  }
+
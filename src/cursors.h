@@ -0,0 +1,14 @@
+/*---------------------------------------------------------------------------
+dbcmd
+cursors.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bool.h"
+
+char *cursors_get (const char *remote, const char *local, BOOL recursive);
+void  cursors_put (const char *remote, const char *local, BOOL recursive,
+        const char *cursor);
+
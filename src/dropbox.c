@@ -16,6 +16,7 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include "token.h"
 #include "cJSON.h"
 #include "dropbox.h"
@@ -24,9 +25,23 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 #include "log.h"
 #include "auth.h"
 #include "sha256.h"
+#include "arena.h"
+#include "workpool.h"
 
 #define EASY_INIT_FAIL "Cannot initialize curl"
 
+// A recursive listing that has run to this many pages is split up, if
+//   there is a connection free to take part of it
+#define SHARD_SPLIT_PAGES 4
+// Until then, and up to this many pages, its pages are held back, since
+//   they would be listed again if it were split. After that, it is not
+//   split, and each page is merged as soon as it arrives
+#define SHARD_HOLD_PAGES 8
+
+// Initial size of the buffer that holds a server response. The buffer 
+//  doubles in size whenever it fills up
+#define RESPONSE_INITIAL_SIZE 4096
+
 // Size of file chuck to do SHA256 on, when compariing hashes.
 // This is not arbitrary -- the DB algorithm depends on using a fixed
 // size hash
@@ -37,13 +52,14 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 Forward
 ---------------------------------------------------------------------------*/
 void _dropbox_list_files (const char *token, const char *path, 
-    List *list, BOOL include_dirs, BOOL recursive, const char *cursor, 
+    DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+    const char *cursor, char **last_cursor, DBPageFunc pf, void *user,
     char **error);
 static size_t dropbox_write_callback (void *contents, size_t size, 
     size_t nmemb, void *userp);
 static size_t dropbox_store_callback (void *contents, size_t size, 
     size_t nmemb, void *userp);
-static time_t dropbox_parse_timestamp (const char *s);
+static cJSON *dropbox_json_parse (Arena *arena, const char *text);
 
 
 /*---------------------------------------------------------------------------
@@ -53,6 +69,7 @@ struct DBWriteStruct
   {
   char *memory;
   size_t size;
+  size_t capacity;
   };
 
 struct DBStoreStruct 
@@ -60,6 +77,48 @@ struct DBStoreStruct
   int f; // A file handle
   };
 
+struct DBStreamStruct
+  {
+  CURL *curl;
+  DBDataFunc df;
+  void *user;
+  BOOL stopped;
+  struct DBWriteStruct response; // The body of an error response
+  };
+
+// A recursive listing, split into parts that are listed on separate
+//   connections
+struct DBShardStruct
+  {
+  const char *token;
+  int jobs;
+  WorkPool *pool;
+  pthread_mutex_t mutex;  // Protects the fields below
+  pthread_cond_t changed; // Signalled when a part is done
+  List *done;             // Of struct DBShardPage, waiting to be merged
+  int outstanding;        // Parts started but not yet done
+  char *error;            // The first error, which stops the listing
+  };
+
+// One part of a sharded listing: a folder, with or without its 
+//   subfolders
+struct DBShardTask
+  {
+  struct DBShardStruct *shard;
+  char *path;
+  BOOL recursive;
+  DBStatStore *store;     // The pages not yet handed over
+  };
+
+// Pages of a part, handed over to be merged. The last one for each part
+//   may be empty, and frees the part once it is merged
+struct DBShardPage
+  {
+  struct DBShardTask *task;
+  DBStatStore *store;
+  BOOL last;
+  };
+
 
 struct DBProgStruct
   {
@@ -72,6 +131,176 @@ struct DBProgStruct
   };
 
 
+/*---------------------------------------------------------------------------
+dropbox_json_arena
+The arena, if any, that cJSON should allocate from in the current thread.
+This is only set for the duration of a call to dropbox_json_parse()
+---------------------------------------------------------------------------*/
+static __thread Arena *dropbox_json_arena = NULL;
+
+
+/*---------------------------------------------------------------------------
+dropbox_json_malloc
+---------------------------------------------------------------------------*/
+static void *dropbox_json_malloc (size_t size)
+  {
+  if (dropbox_json_arena)
+    return arena_alloc (dropbox_json_arena, size);
+  return malloc (size);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_json_free
+Memory allocated from an arena is released when the arena is destroyed,
+so there is nothing to do here in that case
+---------------------------------------------------------------------------*/
+static void dropbox_json_free (void *p)
+  {
+  if (!dropbox_json_arena)
+    free (p);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_json_init_hooks
+---------------------------------------------------------------------------*/
+static void dropbox_json_init_hooks (void)
+  {
+  cJSON_Hooks hooks;
+  hooks.malloc_fn = dropbox_json_malloc;
+  hooks.free_fn = dropbox_json_free;
+  cJSON_InitHooks (&hooks);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_json_parse
+Parse a server response, taking all the memory for the cJSON tree from
+the arena. The caller must NOT call cJSON_Delete() on the result -- the
+tree is released by destroying the arena. Anything that must outlive
+the arena has to be copied out of the tree first
+---------------------------------------------------------------------------*/
+static cJSON *dropbox_json_parse (Arena *arena, const char *text)
+  {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once (&once, dropbox_json_init_hooks);
+
+  dropbox_json_arena = arena;
+  cJSON *root = cJSON_Parse (text);
+  dropbox_json_arena = NULL;
+  return root;
+  }
+
+
+/*---------------------------------------------------------------------------
+DBCurlCache
+Each thread keeps one curl handle between requests, so that connections 
+to the server (and their TLS sessions) are reused, rather than set up
+afresh for every API call
+---------------------------------------------------------------------------*/
+typedef struct _DBCurlCache
+  {
+  CURL *curl;
+  BOOL busy; 
+  } DBCurlCache;
+
+static pthread_key_t dropbox_curl_key;
+static pthread_once_t dropbox_curl_once = PTHREAD_ONCE_INIT;
+
+
+/*---------------------------------------------------------------------------
+dropbox_curl_cache_free
+Called on thread exit, and by dropbox_cleanup()
+---------------------------------------------------------------------------*/
+static void dropbox_curl_cache_free (void *p)
+  {
+  DBCurlCache *cache = p;
+  if (cache->curl) curl_easy_cleanup (cache->curl);
+  free (cache);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_curl_key_init
+---------------------------------------------------------------------------*/
+static void dropbox_curl_key_init (void)
+  {
+  pthread_key_create (&dropbox_curl_key, dropbox_curl_cache_free);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_curl_acquire
+Returns the thread's cached curl handle, with all options at their 
+defaults. If that handle is already in use -- paged listings request 
+the next page before releasing the handle for the current one -- a new
+handle is returned instead. Returns NULL if curl can't be initialized.
+Every handle must be passed to dropbox_curl_release() when done
+---------------------------------------------------------------------------*/
+static CURL *dropbox_curl_acquire (void)
+  {
+  pthread_once (&dropbox_curl_once, dropbox_curl_key_init);
+  DBCurlCache *cache = pthread_getspecific (dropbox_curl_key);
+  if (!cache)
+    {
+    cache = calloc (1, sizeof (DBCurlCache));
+    pthread_setspecific (dropbox_curl_key, cache);
+    }
+  if (cache->busy) return curl_easy_init();
+  if (!cache->curl) cache->curl = curl_easy_init();
+  if (cache->curl) cache->busy = TRUE;
+  return cache->curl;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_curl_release
+Options are reset straight away, as they may point to the caller's
+stack; open connections are kept
+---------------------------------------------------------------------------*/
+static void dropbox_curl_release (CURL *curl)
+  {
+  DBCurlCache *cache = pthread_getspecific (dropbox_curl_key);
+  if (cache && cache->curl == curl)
+    {
+    curl_easy_reset (curl);
+    cache->busy = FALSE;
+    }
+  else
+    curl_easy_cleanup (curl);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_cleanup
+Closes the calling thread's cached connections. Other threads' 
+connections are closed when the threads exit
+---------------------------------------------------------------------------*/
+void dropbox_cleanup (void)
+  {
+  pthread_once (&dropbox_curl_once, dropbox_curl_key_init);
+  DBCurlCache *cache = pthread_getspecific (dropbox_curl_key);
+  if (cache)
+    {
+    dropbox_curl_cache_free (cache);
+    pthread_setspecific (dropbox_curl_key, NULL);
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_response_init
+---------------------------------------------------------------------------*/
+static void dropbox_response_init (struct DBWriteStruct *response)
+  {
+  response->capacity = RESPONSE_INITIAL_SIZE;
+  response->memory = malloc (response->capacity);
+  response->memory[0] = 0;
+  response->size = 0;
+  }
+
+
 /*---------------------------------------------------------------------------
 dropbox_humanize_error
 ---------------------------------------------------------------------------*/
@@ -103,7 +332,8 @@ response.
 void dropbox_check_response_for_error (const char *response, char **error)
   {
   log_debug ("dropbox_check_response_for_error \"%s\"", response);
-  cJSON *root = cJSON_Parse (response); 
+  Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+  cJSON *root = dropbox_json_parse (arena, response); 
   if (root)
     {
     cJSON *j  = cJSON_GetObjectItem (root, "error_summary");
@@ -115,12 +345,12 @@ void dropbox_check_response_for_error (const char *response, char **error)
       {
       // Do nowt -- non-error JSON response
       }
-    cJSON_Delete (root);
     }
   else
     {
     asprintf (error, "%s", response);
     }
+  arena_destroy (arena);
 
   OUT
   }
@@ -160,12 +390,11 @@ void dropbox_get_file_info (const char *token, const char *path,
     }
   else
     {
-    CURL* curl = curl_easy_init();
+    CURL* curl = dropbox_curl_acquire();
     if (curl)
       {
       struct DBWriteStruct response;
-      response.memory = malloc(1);  
-      response.size = 0;    
+      dropbox_response_init (&response);
    
       struct curl_slist *headers = NULL;
 
@@ -198,7 +427,8 @@ void dropbox_get_file_info (const char *token, const char *path,
 	  }
         else 
 	  {
-	  cJSON *root = cJSON_Parse (resp); 
+	  Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+	  cJSON *root = dropbox_json_parse (arena, resp); 
 	  if (root)
 	    {
 	    cJSON *j_tag  = cJSON_GetObjectItem (root, ".tag");
@@ -218,7 +448,7 @@ void dropbox_get_file_info (const char *token, const char *path,
 
 	      cJSON *j_size = cJSON_GetObjectItem (root, "size");
 	      if (j_size)
-		dropbox_stat_set_length (stat, j_size->valueint);      
+		dropbox_stat_set_length (stat, (int64_t) j_size->valuedouble);
 
 	      cJSON *j_server_modified  = cJSON_GetObjectItem 
 		 (root, "server_modified");
@@ -249,12 +479,12 @@ void dropbox_get_file_info (const char *token, const char *path,
 	      {
 	      *error = dropbox_decode_server_error (resp);
 	      }
-	    cJSON_Delete (root);
 	    }
 	  else
 	    {
 	    *error = strdup (resp);
 	    }
+	  arena_destroy (arena);
           }
 	}
       else
@@ -266,7 +496,7 @@ void dropbox_get_file_info (const char *token, const char *path,
       curl_slist_free_all (headers); 
       free (auth_header);
       free (data);
-      curl_easy_cleanup (curl);
+      dropbox_curl_release (curl);
       }
     else
       {
@@ -290,12 +520,11 @@ char *dropbox_get_token (const char *code, char **error)
 
   log_debug ("dropbox_get_token: make token from code \"%s\"", code);
 
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
  
     struct curl_slist *headers = NULL;
 
@@ -327,7 +556,8 @@ char *dropbox_get_token (const char *code, char **error)
     if (curl_code == 0)
       {
       const char *resp = response.memory;
-      cJSON *root = cJSON_Parse (resp); 
+      Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+      cJSON *root = dropbox_json_parse (arena, resp); 
       if (root)
         {
         cJSON *j_token  = cJSON_GetObjectItem (root, "access_token");
@@ -339,12 +569,12 @@ char *dropbox_get_token (const char *code, char **error)
           {
           *error = dropbox_decode_server_error (resp);
           }
-         cJSON_Delete (root);
         }
       else
         {
         *error = dropbox_decode_server_error (resp);
         }
+      arena_destroy (arena);
       }
     else
       {
@@ -355,7 +585,7 @@ char *dropbox_get_token (const char *code, char **error)
     free (curl_creds);
     free (response.memory);
     curl_slist_free_all (headers); 
-    curl_easy_cleanup (curl);
+    dropbox_curl_release (curl);
     }
   else
     {
@@ -372,6 +602,23 @@ dropbox_hash
 ---------------------------------------------------------------------------*/
 BOOL dropbox_hash (const char *filename, char output_hash[65], char **error)
   {
+  unsigned char raw[DBHASH_RAW_LENGTH];
+  BOOL ret = dropbox_hash_raw (filename, raw, error);
+  if (*error == NULL)
+    dropbox_hash_to_hex (raw, output_hash);
+  else
+    output_hash[0] = 0;
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_hash_raw
+Calculate the Dropbox content hash of a local file, as 32 raw bytes
+---------------------------------------------------------------------------*/
+BOOL dropbox_hash_raw (const char *filename, 
+       unsigned char output_hash[DBHASH_RAW_LENGTH], char **error)
+  {
   BOOL ret = FALSE;
   int f = open (filename, O_RDONLY);
   if (f >= 0)
@@ -388,14 +635,8 @@ BOOL dropbox_hash (const char *filename, char output_hash[65], char **error)
       memcpy (bighash + bytes, hash, 32);
       bytes += 32;
       }
-    unsigned char final_hash[32];
-    memset (final_hash, 0, 32);
-    sha256_hash_block ((unsigned char *)bighash, bytes, final_hash);
-    int i;
-    memset (output_hash, 0, 65);
-    for (i = 0; i < 32; i++)
-      sprintf (output_hash + (i*2), "%02x", final_hash[i]);
-    output_hash[64] = 0;
+    memset (output_hash, 0, DBHASH_RAW_LENGTH);
+    sha256_hash_block ((unsigned char *)bighash, bytes, output_hash);
     free (s);
     free (bighash);
     close (f);
@@ -416,12 +657,11 @@ void dropbox_move (const char *token, const char *old_path,
   {
   IN
   log_debug ("dropbox_move old=%s new=%s", old_path, new_path);
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
    
     struct curl_slist *headers = NULL;
 
@@ -461,7 +701,7 @@ void dropbox_move (const char *token, const char *old_path,
     curl_slist_free_all (headers); 
     free (auth_header);
     free (data);
-    curl_easy_cleanup (curl);
+    dropbox_curl_release (curl);
     }
   else
     {
@@ -471,115 +711,246 @@ void dropbox_move (const char *token, const char *old_path,
   }
 
 /*---------------------------------------------------------------------------
-dropbox_parse_timestammp
+dropbox_copy
+Copy a file on the server, without its contents passing through the
+client. If hash is not NULL, it is set to the content hash of the new
+copy, as reported by the server, or to zeros if none was reported
 ---------------------------------------------------------------------------*/
-static time_t dropbox_parse_timestamp (const char *s)
+void dropbox_copy (const char *token, const char *from_path, 
+           const char *to_path, unsigned char hash[DBHASH_RAW_LENGTH],
+           char **error)
   {
   IN
-  log_debug ("Parsing timestamp %s", s);
-  char *old_tz = getenv ("TZ");
+  log_debug ("dropbox_copy from=%s to=%s", from_path, to_path);
+  if (hash) memset (hash, 0, DBHASH_RAW_LENGTH);
+  CURL* curl = dropbox_curl_acquire();
+  if (curl)
+    {
+    struct DBWriteStruct response;
+    dropbox_response_init (&response);
+   
+    struct curl_slist *headers = NULL;
+
+    curl_easy_setopt (curl, CURLOPT_POST, 1);
+
+    char *auth_header, *data;
+    asprintf (&auth_header, "Authorization: Bearer %s", token);
+    headers = curl_slist_append (headers, auth_header);
+    headers = curl_slist_append (headers, 
+	"Content-Type: application/json");
+
+    curl_easy_setopt (curl, CURLOPT_URL, 
+	"https://api.dropboxapi.com/2/files/copy_v2");
+
+    asprintf (&data, 
+	"{\"from_path\":\"%s\",\"to_path\":\"%s\"}", from_path, to_path);
+
+    char curl_error [CURL_ERROR_SIZE];
+    curl_easy_setopt (curl, CURLOPT_ERRORBUFFER, curl_error);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, dropbox_write_callback);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDS, data);
+
+    CURLcode curl_code = curl_easy_perform (curl);
+    if (curl_code == 0)
+      {
+      dropbox_check_response_for_error (response.memory, error);
+      if (!*error && hash)
+        {
+        Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+        cJSON *root = dropbox_json_parse (arena, response.memory); 
+        cJSON *j_metadata = root ? 
+          cJSON_GetObjectItem (root, "metadata") : NULL;
+        cJSON *j_hash = j_metadata ? 
+          cJSON_GetObjectItem (j_metadata, "content_hash") : NULL;
+        if (j_hash && j_hash->valuestring)
+          dropbox_hash_from_hex (j_hash->valuestring, hash);
+        arena_destroy (arena);
+        }
+      }
+    else
+      {
+      *error = strdup (curl_error); 
+      }
+
+    free (response.memory);
+    curl_slist_free_all (headers); 
+    free (auth_header);
+    free (data);
+    dropbox_curl_release (curl);
+    }
+  else
+    {
+    *error = strdup (EASY_INIT_FAIL); 
+    }
+  OUT
+  }
 
-  // Ugh. This sucks. There is no UTC/GMT equivalent of mktime() in
-  //  C :/
-  setenv ("TZ", "UTC0", 1);
-  tzset();
 
+/*---------------------------------------------------------------------------
+dropbox_parse_digits
+Parses exactly n decimal digits, returning -1 if any is missing
+---------------------------------------------------------------------------*/
+static int dropbox_parse_digits (const char *s, int n)
+  {
+  int v = 0;
+  int i;
+  for (i = 0; i < n; i++)
+    {
+    if (s[i] < '0' || s[i] > '9') return -1;
+    v = v * 10 + (s[i] - '0');
+    }
+  return v;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_parse_timestamp
+Converts a Dropbox timestamp, which is always UTC in the form
+2017-03-01T14:23:05Z, to a time_t. The conversion is done arithmetically
+(the days-from-civil algorithm), rather than with mktime(), which would
+need TZ to be changed -- slow, and not safe with more than one thread.
+Returns 0 if the timestamp is malformed.
+---------------------------------------------------------------------------*/
+time_t dropbox_parse_timestamp (const char *s)
+  {
+  if (!s || strlen (s) < 19 || s[4] != '-' || s[7] != '-' 
+        || s[10] != 'T' || s[13] != ':' || s[16] != ':')
+    return 0;
+
+  int year = dropbox_parse_digits (s, 4);
+  int month = dropbox_parse_digits (s + 5, 2);
+  int day = dropbox_parse_digits (s + 8, 2);
+  int hour = dropbox_parse_digits (s + 11, 2);
+  int min = dropbox_parse_digits (s + 14, 2);
+  int sec = dropbox_parse_digits (s + 17, 2);
+  if (year < 0 || month < 1 || month > 12 || day < 1 || day > 31 
+        || hour < 0 || hour > 23 || min < 0 || min > 59 
+        || sec < 0 || sec > 60)
+    return 0;
+
+  // Count years from March, so the leap day falls at the end
+  int y = month <= 2 ? year - 1 : year;
+  int era = y / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int64_t days = (int64_t)era * 146097 + doe - 719468;
+
+  return (time_t)(days * 86400 + hour * 3600 + min * 60 + sec);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_format_timestamp
+The opposite of dropbox_parse_timestamp: the server wants UTC, to the
+second
+---------------------------------------------------------------------------*/
+void dropbox_format_timestamp (time_t t, char buff[21])
+  {
   struct tm tm;
-  memset (&tm, 0, sizeof (struct tm));
-  strptime (s, "%FT%TZ", &tm);  
+  gmtime_r (&t, &tm);
+  strftime (buff, 21, "%Y-%m-%dT%H:%M:%SZ", &tm);
+  }
 
-  time_t t = mktime (&tm);   
 
-  if (old_tz)
+/*---------------------------------------------------------------------------
+dropbox_parse_entry
+Add the metadata of one file or folder, as the server describes it, to
+the store. Folders are only added if include_dirs is TRUE. The entry is
+decoded into a DBStat that still refers to the parsed response, and 
+only copied into the store if the store's filter wants it
+---------------------------------------------------------------------------*/
+static void dropbox_parse_entry (cJSON *item, BOOL include_dirs, 
+    DBStatStore *store)
+  {
+  cJSON *j_tag = cJSON_GetObjectItem (item, ".tag");
+  cJSON *j_path = cJSON_GetObjectItem (item, "path_display");
+  cJSON *j_lower = cJSON_GetObjectItem (item, "path_lower");
+  if (!j_path) j_path = j_lower; 
+  if (!j_tag || !j_path) return;
+  const char *path_lower = j_lower ? j_lower->valuestring : NULL;
+  DBStat stat;
+  if (strcmp (j_tag->valuestring, "file") == 0)
     {
-    setenv ("TZ", old_tz, 1);
-    tzset();
+    dropbox_stat_init (&stat, j_path->valuestring, path_lower, 
+      DBSTAT_FILE);
+    cJSON *j_size = cJSON_GetObjectItem (item, "size");
+    if (j_size)
+      stat.length = (int64_t) j_size->valuedouble;      
+    cJSON *j_server_modified  = cJSON_GetObjectItem 
+       (item, "server_modified");
+    if (j_server_modified)
+      {
+      stat.server_modified = 
+         dropbox_parse_timestamp (j_server_modified->valuestring); 
+      }
+    cJSON *j_client_modified  = cJSON_GetObjectItem 
+       (item, "client_modified");
+    if (j_client_modified)
+      {
+      stat.client_modified = 
+         dropbox_parse_timestamp (j_client_modified->valuestring); 
+      }
+    cJSON *j_hash = cJSON_GetObjectItem (item, "content_hash");
+    if (j_hash)
+      dropbox_stat_set_hash (&stat, j_hash->valuestring);
     }
-  else
+  else if (strcmp (j_tag->valuestring, "folder") == 0 && include_dirs)
     {
-    unsetenv ("TZ");
+    dropbox_stat_init (&stat, j_path->valuestring, path_lower, 
+      DBSTAT_FOLDER);
     }
+  else if (strcmp (j_tag->valuestring, "deleted") == 0)
+    {
+    dropbox_stat_init (&stat, j_path->valuestring, path_lower, 
+      DBSTAT_DELETED);
+    }
+  else
+    return;
 
-  log_debug ("Parsed time_t is %ld", t);
-  OUT
-  return t;
+  if (dropbox_stat_store_wants (store, &stat))
+    dropbox_stat_store_add_copy (store, &stat);
   }
 
 
 /*---------------------------------------------------------------------------
 dropbox_parse_file_list
+Entries for deleted items (which the server only sends when continuing
+from a cursor) are added to the store with type DBSTAT_DELETED. If
+last_cursor is not NULL, it is updated with the cursor from each page.
+If there are more pages to come, *next_cursor is set to the cursor
+that fetches the next one
 ---------------------------------------------------------------------------*/
-static void dropbox_parse_file_list (const char *token, const char *path, 
-    const char *response, BOOL include_dirs, BOOL recursive, List *list, 
-    char **error)
+static void dropbox_parse_file_list (const char *response, 
+    BOOL include_dirs, DBStatStore *store, char **last_cursor, 
+    char **next_cursor, char **error)
   {
   IN
-  cJSON *root = cJSON_Parse (response); 
+  Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+  cJSON *root = dropbox_json_parse (arena, response); 
   if (root)
     {
     cJSON *entries = cJSON_GetObjectItem (root, "entries");
     if (entries) 
       {
-      int i, n = cJSON_GetArraySize (entries);
-      for (i = 0; i < n; i++)
-	{
-	cJSON *item = cJSON_GetArrayItem (entries, i);
-	cJSON *j_tag = cJSON_GetObjectItem (item, ".tag");
-	if (j_tag && strcmp (j_tag->valuestring, "file") == 0)
-	  {
-          DBStat *stat = dropbox_stat_create();
-	  stat->type = DBSTAT_FILE;
-	  cJSON *item = cJSON_GetArrayItem (entries, i);
-	  cJSON *j_path = cJSON_GetObjectItem (item, "path_display");
-	  if (j_path)
-	    stat->path  = strdup (j_path->valuestring); 
-	  cJSON *j_name = cJSON_GetObjectItem (item, "name");
-	  if (j_name)
-	    stat->name  = strdup (j_name->valuestring); 
-	  cJSON *j_size = cJSON_GetObjectItem (item, "size");
-	  if (j_size)
-	    stat->length = j_size->valueint;      
-	  cJSON *j_server_modified  = cJSON_GetObjectItem 
-	     (item, "server_modified");
-	  if (j_server_modified)
-	    {
-	    stat->server_modified = 
-	       dropbox_parse_timestamp (j_server_modified->valuestring); 
-	    }
-	  cJSON *j_client_modified  = cJSON_GetObjectItem 
-	     (item, "client_modified");
-	  if (j_client_modified)
-	    {
-	    stat->client_modified = 
-	       dropbox_parse_timestamp (j_client_modified->valuestring); 
-	    }
-	  list_append (list, stat);
-	  }
-	else if (j_tag && strcmp (j_tag->valuestring, "folder") == 0 && 
-            include_dirs)
-	  {
-          DBStat *stat = dropbox_stat_create();
-	  stat->type = DBSTAT_FOLDER;
-	  cJSON *item = cJSON_GetArrayItem (entries, i);
-	  cJSON *j_path = cJSON_GetObjectItem (item, "path_display");
-	  if (j_path)
-	    stat->path  = strdup (j_path->valuestring); 
-	  cJSON *j_name = cJSON_GetObjectItem (item, "name");
-	  if (j_name)
-	    stat->name  = strdup (j_name->valuestring); 
-	  list_append (list, stat);
-	  }
-	}
+      cJSON *item;
+      // Walk the array directly -- cJSON_GetArrayItem() starts from the
+      //   head of the array each time
+      for (item = entries->child; item != NULL; item = item->next)
+        dropbox_parse_entry (item, include_dirs, store);
+      cJSON *j_cursor = cJSON_GetObjectItem (root, "cursor");
+      if (last_cursor && j_cursor)
+        {
+        free (*last_cursor);
+        *last_cursor = strdup (j_cursor->valuestring);
+        }
       cJSON *has_more = cJSON_GetObjectItem (root, "has_more");
       if (has_more) 
 	{
-	if (has_more->valueint)
-	  {
-	  cJSON *j_cursor = cJSON_GetObjectItem (root, "cursor");
-          const char *cursor = j_cursor->valuestring;
-          _dropbox_list_files (token, path, list, include_dirs, 
-             recursive, cursor, error); 
-	  }
+	if (has_more->valueint && j_cursor)
+          *next_cursor = strdup (j_cursor->valuestring);
 	}
       }
     else
@@ -593,27 +964,29 @@ static void dropbox_parse_file_list (const char *token, const char *path,
     if (error) *error = strdup (response); 
     }
 
-  cJSON_Delete (root);
+  arena_destroy (arena);
   OUT
   }
 
 
 /*---------------------------------------------------------------------------
-_dropbox_list_files
+dropbox_list_page
+Fetch and parse one page of a listing -- the first page of the path if
+cursor is NULL, otherwise the page that the cursor refers to
 ---------------------------------------------------------------------------*/
-void _dropbox_list_files (const char *token, const char *path, 
-    List *list, BOOL include_dirs, BOOL recursive, const char *cursor, 
+static void dropbox_list_page (const char *token, const char *path, 
+    DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+    const char *cursor, char **last_cursor, char **next_cursor, 
     char **error)
   {
   IN
   log_debug ("token=%s, path=%s, include_dirs=%d, recursive=%d, cursor=%s",
     token, path, include_dirs, recursive, cursor);
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
  
     struct curl_slist *headers = NULL;
 
@@ -650,8 +1023,8 @@ void _dropbox_list_files (const char *token, const char *path,
     CURLcode curl_code = curl_easy_perform (curl);
     if (curl_code == 0)
       {
-      dropbox_parse_file_list (token, path, response.memory, include_dirs, 
-        recursive, list, error);
+      dropbox_parse_file_list (response.memory, include_dirs, store, 
+        last_cursor, next_cursor, error);
       }
     else
       {
@@ -662,7 +1035,7 @@ void _dropbox_list_files (const char *token, const char *path,
     curl_slist_free_all (headers); 
     free (auth_header);
     free (data);
-    curl_easy_cleanup (curl);
+    dropbox_curl_release (curl);
     }
   else
     {
@@ -674,15 +1047,581 @@ void _dropbox_list_files (const char *token, const char *path,
   }
 
 
+/*---------------------------------------------------------------------------
+_dropbox_list_files
+Each page is fetched, parsed and released before the next is requested,
+so only one page of the response is ever held in memory, and the 
+connection is reused for every page. If pf is not NULL, it is called
+with the entries of each page as soon as they are in the store
+---------------------------------------------------------------------------*/
+void _dropbox_list_files (const char *token, const char *path, 
+    DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+    const char *cursor, char **last_cursor, DBPageFunc pf, void *user,
+    char **error)
+  {
+  IN
+  char *page_cursor = cursor ? strdup (cursor) : NULL;
+  do
+    {
+    char *next_cursor = NULL;
+    uint32_t first = dropbox_stat_store_length (store);
+    dropbox_list_page (token, path, store, include_dirs, recursive,
+      page_cursor, last_cursor, &next_cursor, error);
+    uint32_t added = dropbox_stat_store_length (store) - first;
+    if (pf && *error == NULL && added > 0) pf (store, first, added, user);
+    free (page_cursor);
+    page_cursor = next_cursor;
+    } while (page_cursor && *error == NULL);
+  free (page_cursor);
+  OUT
+  }
+
+
 /*---------------------------------------------------------------------------
 dropbox_list_files
 ---------------------------------------------------------------------------*/
 void dropbox_list_files (const char *token, const char *path, 
-    List *list, BOOL include_dirs, BOOL recursive, char **error)
+    DBStatStore *store, BOOL include_dirs, BOOL recursive, char **error)
+  {
+  IN
+  _dropbox_list_files (token, path, store, include_dirs, recursive, 
+     NULL, NULL, NULL, NULL, error);
+  OUT
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_list_changes
+If cursor is NULL, lists the path in full, as dropbox_list_files() does;
+otherwise fetches only the entries that have changed since the cursor
+was issued, including deletions. Either way, on success *new_cursor is
+set to a cursor that can be passed to a later call. The caller must
+free it
+---------------------------------------------------------------------------*/
+void dropbox_list_changes (const char *token, const char *path, 
+    DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+    const char *cursor, char **new_cursor, char **error)
+  {
+  IN
+  dropbox_list_paged (token, path, store, include_dirs, recursive, 
+     cursor, new_cursor, NULL, NULL, error);
+  OUT
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_list_paged
+As dropbox_list_changes(), but pf is called with the entries of each 
+page, as soon as they have been added to the store, so the caller can
+start work on them while the next page is fetched. pf runs on the 
+calling thread, and the store must not be modified until it returns.
+new_cursor may be NULL, if the cursor is not wanted
+---------------------------------------------------------------------------*/
+void dropbox_list_paged (const char *token, const char *path, 
+    DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+    const char *cursor, char **new_cursor, DBPageFunc pf, void *user,
+    char **error)
+  {
+  IN
+  char *last_cursor = NULL;
+  if (new_cursor) *new_cursor = NULL;
+  _dropbox_list_files (token, path, store, include_dirs, recursive, 
+     cursor, &last_cursor, pf, user, error);
+  if (*error || !new_cursor)
+    free (last_cursor);
+  else
+    *new_cursor = last_cursor;
+  OUT
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_shard_submit
+---------------------------------------------------------------------------*/
+static void dropbox_shard_list (void *arg);
+
+static void dropbox_shard_submit (struct DBShardStruct *sh, 
+    const char *path, BOOL recursive)
+  {
+  struct DBShardTask *task = malloc (sizeof (struct DBShardTask));
+  task->shard = sh;
+  task->path = strdup (path);
+  task->recursive = recursive;
+  task->store = NULL;
+  pthread_mutex_lock (&sh->mutex);
+  sh->outstanding++;
+  pthread_mutex_unlock (&sh->mutex);
+  workpool_submit (sh->pool, dropbox_shard_list, task);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_shard_can_split
+A part is only worth splitting if there is a connection with nothing
+to do; otherwise, pages already fetched would be fetched again for
+nothing
+---------------------------------------------------------------------------*/
+static BOOL dropbox_shard_can_split (struct DBShardStruct *sh)
+  {
+  pthread_mutex_lock (&sh->mutex);
+  BOOL ret = sh->outstanding < sh->jobs && !sh->error;
+  pthread_mutex_unlock (&sh->mutex);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_shard_failed
+---------------------------------------------------------------------------*/
+static BOOL dropbox_shard_failed (struct DBShardStruct *sh)
+  {
+  pthread_mutex_lock (&sh->mutex);
+  BOOL ret = sh->error != NULL;
+  pthread_mutex_unlock (&sh->mutex);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_shard_hand_over
+Pass the pages listed so far to the thread that merges them, and, for a
+part listed without its subfolders, start a part for each subfolder 
+among them. If last is TRUE, the part is finished
+---------------------------------------------------------------------------*/
+static void dropbox_shard_hand_over (struct DBShardTask *task, 
+    BOOL last, char *error)
+  {
+  struct DBShardStruct *sh = task->shard;
+  if (!task->recursive)
+    {
+    uint32_t i, l = dropbox_stat_store_length (task->store);
+    for (i = 0; i < l; i++)
+      {
+      const DBStat *stat = dropbox_stat_store_get (task->store, i);
+      if (stat->type == DBSTAT_FOLDER)
+        dropbox_shard_submit (sh, stat->path_lower, TRUE);
+      }
+    }
+
+  struct DBShardPage *page = malloc (sizeof (struct DBShardPage));
+  page->task = task;
+  page->store = task->store;
+  page->last = last;
+  task->store = last ? NULL : dropbox_stat_store_create ();
+
+  pthread_mutex_lock (&sh->mutex);
+  if (error && !sh->error)
+    sh->error = error;
+  else
+    free (error);
+  list_append (sh->done, page);
+  if (last) sh->outstanding--;
+  pthread_cond_signal (&sh->changed);
+  pthread_mutex_unlock (&sh->mutex);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_shard_list
+List one part, on a thread of the pool. A folder that is listed without 
+its subfolders starts a recursive listing of each of them. A recursive
+listing that turns out to be big, while a connection is idle, starts 
+again in that way, so that the big subtree is shared out. Each page is
+handed over to be merged as it arrives, except for the first few of a 
+recursive listing, which might be split, so a part never holds more 
+than a few pages
+---------------------------------------------------------------------------*/
+static void dropbox_shard_list (void *arg)
+  {
+  struct DBShardTask *task = arg;
+  struct DBShardStruct *sh = task->shard;
+  char *error = NULL;
+  char *cursor = NULL;
+  int pages = 0;
+  BOOL more = TRUE;
+  BOOL holding = task->recursive;
+
+  task->store = dropbox_stat_store_create ();
+  while (more && error == NULL)
+    {
+    char *next_cursor = NULL;
+    dropbox_list_page (sh->token, task->path, task->store, TRUE, 
+      task->recursive, cursor, NULL, &next_cursor, &error);
+    free (cursor);
+    cursor = next_cursor;
+    pages++;
+    if (holding && cursor && pages >= SHARD_SPLIT_PAGES
+         && dropbox_shard_can_split (sh))
+      {
+      log_debug ("Splitting listing of %s", task->path);
+      free (cursor);
+      cursor = NULL;
+      dropbox_stat_store_destroy (task->store);
+      task->store = dropbox_stat_store_create ();
+      task->recursive = FALSE;
+      holding = FALSE;
+      pages = 0;
+      continue;
+      }
+    if (holding && pages >= SHARD_HOLD_PAGES) holding = FALSE;
+    more = (cursor != NULL && error == NULL && !dropbox_shard_failed (sh));
+    if (more && !holding) dropbox_shard_hand_over (task, FALSE, NULL);
+    }
+  free (cursor);
+
+  dropbox_shard_hand_over (task, TRUE, error);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_shard_merge
+Add the entries of a page to the caller's store. A recursive listing 
+may include the folder it started from, which the listing of its parent
+has already supplied. The parts are listed without the store's filter,
+which needs their folders, and because a part that is split is listed 
+again; the filter is applied here instead
+---------------------------------------------------------------------------*/
+static void dropbox_shard_merge (struct DBShardPage *page, 
+    DBStatStore *store, BOOL include_dirs, DBPageFunc pf, void *user)
+  {
+  const struct DBShardTask *task = page->task;
+  uint32_t first = dropbox_stat_store_length (store);
+  uint32_t i, l = dropbox_stat_store_length (page->store);
+  for (i = 0; i < l; i++)
+    {
+    const DBStat *stat = dropbox_stat_store_get (page->store, i);
+    if (stat->type == DBSTAT_FOLDER && (!include_dirs 
+         || (task->recursive && strcmp (stat->path_lower, task->path) == 0)))
+      continue;
+    if (dropbox_stat_store_wants (store, stat))
+      dropbox_stat_store_add_copy (store, stat);
+    }
+  uint32_t added = dropbox_stat_store_length (store) - first;
+  if (pf && added > 0) pf (store, first, added, user);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_shard_page_free
+---------------------------------------------------------------------------*/
+static void dropbox_shard_page_free (void *p)
+  {
+  struct DBShardPage *page = p;
+  dropbox_stat_store_destroy (page->store);
+  if (page->last)
+    {
+    free (page->task->path);
+    free (page->task);
+    }
+  free (page);
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_list_parallel
+As dropbox_list_paged(), without a cursor, but a recursive listing is
+shared out over as many as jobs connections. The top level of path is
+listed first, and then each of its subfolders, recursively, at the same
+time, each with its own chain of cursors; big subfolders are split up 
+in the same way, when a connection falls idle. Each page is added to 
+the store, through its filter, and passed to pf, on the calling thread,
+as it arrives (see dropbox_shard_list()),
+so the order of the entries is not the server's. A listing split up
+this way has no cursor to carry on from
+---------------------------------------------------------------------------*/
+void dropbox_list_parallel (const char *token, const char *path, 
+    DBStatStore *store, BOOL include_dirs, BOOL recursive, int jobs, 
+    DBPageFunc pf, void *user, char **error)
+  {
+  IN
+  if (!recursive || jobs <= 1)
+    {
+    _dropbox_list_files (token, path, store, include_dirs, recursive, 
+       NULL, NULL, pf, user, error);
+    OUT
+    return;
+    }
+
+  struct DBShardStruct sh;
+  memset (&sh, 0, sizeof (struct DBShardStruct));
+  sh.token = token;
+  sh.jobs = jobs;
+  pthread_mutex_init (&sh.mutex, NULL);
+  pthread_cond_init (&sh.changed, NULL);
+  sh.done = list_create (dropbox_shard_page_free);
+  sh.pool = workpool_create (jobs);
+
+  dropbox_shard_submit (&sh, path, FALSE);
+
+  pthread_mutex_lock (&sh.mutex);
+  while (sh.outstanding > 0 || list_length (sh.done) > 0)
+    {
+    if (list_length (sh.done) == 0)
+      {
+      pthread_cond_wait (&sh.changed, &sh.mutex);
+      continue;
+      }
+    List *done = sh.done;
+    sh.done = list_create (dropbox_shard_page_free);
+    BOOL failed = (sh.error != NULL);
+    pthread_mutex_unlock (&sh.mutex);
+
+    int i, l = list_length (done);
+    for (i = 0; i < l && !failed; i++)
+      dropbox_shard_merge (list_get (done, i), store, include_dirs, 
+        pf, user);
+    list_destroy (done);
+
+    pthread_mutex_lock (&sh.mutex);
+    }
+  pthread_mutex_unlock (&sh.mutex);
+
+  workpool_destroy (sh.pool);
+  list_destroy (sh.done);
+  pthread_cond_destroy (&sh.changed);
+  pthread_mutex_destroy (&sh.mutex);
+  *error = sh.error;
+  OUT
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_list_is_long
+List the first page of path into store, without calling anyone back. 
+Returns TRUE if there are more pages to come, in which case the store
+holds only the first of them
+---------------------------------------------------------------------------*/
+BOOL dropbox_list_is_long (const char *token, const char *path, 
+    DBStatStore *store, BOOL include_dirs, BOOL recursive, char **error)
+  {
+  IN
+  char *next_cursor = NULL;
+  dropbox_list_page (token, path, store, include_dirs, recursive,
+    NULL, NULL, &next_cursor, error);
+  BOOL ret = (next_cursor != NULL);
+  free (next_cursor);
+  OUT
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_parse_search_results
+As dropbox_parse_file_list(), for a page of search results, where each
+match wraps the metadata of a file or folder
+---------------------------------------------------------------------------*/
+static void dropbox_parse_search_results (const char *response, 
+    BOOL include_dirs, DBStatStore *store, char **next_cursor, 
+    char **error)
+  {
+  IN
+  Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+  cJSON *root = dropbox_json_parse (arena, response); 
+  cJSON *matches = root ? cJSON_GetObjectItem (root, "matches") : NULL;
+  if (matches)
+    {
+    cJSON *match;
+    for (match = matches->child; match != NULL; match = match->next)
+      {
+      cJSON *outer = cJSON_GetObjectItem (match, "metadata");
+      cJSON *item = outer ? cJSON_GetObjectItem (outer, "metadata") : NULL;
+      if (item) dropbox_parse_entry (item, include_dirs, store);
+      }
+    cJSON *has_more = cJSON_GetObjectItem (root, "has_more");
+    cJSON *j_cursor = cJSON_GetObjectItem (root, "cursor");
+    if (has_more && has_more->valueint && j_cursor)
+      *next_cursor = strdup (j_cursor->valuestring);
+    }
+  else if (root)
+    *error = dropbox_decode_server_error (response);
+  else
+    *error = strdup (response); 
+
+  arena_destroy (arena);
+  OUT
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_search_page
+Fetch and parse one page of search results -- the first, if cursor is
+NULL
+---------------------------------------------------------------------------*/
+static void dropbox_search_page (const char *token, const char *path, 
+    const char *query, DBStatStore *store, BOOL include_dirs, 
+    const char *cursor, char **next_cursor, char **error)
+  {
+  IN
+  log_debug ("path=%s, query=%s, cursor=%s", path, query, cursor);
+  CURL* curl = dropbox_curl_acquire();
+  if (curl)
+    {
+    struct DBWriteStruct response;
+    dropbox_response_init (&response);
+ 
+    struct curl_slist *headers = NULL;
+    curl_easy_setopt (curl, CURLOPT_POST, 1);
+
+    char *auth_header, *data;
+    asprintf (&auth_header, "Authorization: Bearer %s", token);
+    headers = curl_slist_append (headers, auth_header);
+    headers = curl_slist_append (headers, "Content-Type: application/json");
+
+    if (cursor)
+      {
+      curl_easy_setopt (curl, CURLOPT_URL, 
+        "https://api.dropboxapi.com/2/files/search/continue_v2");
+      asprintf (&data, "{\"cursor\":\"%s\"}", cursor); 
+      }
+    else
+      {
+      curl_easy_setopt (curl, CURLOPT_URL, 
+        "https://api.dropboxapi.com/2/files/search_v2");
+      // The root is searched by leaving out the path
+      char *s_path = NULL;
+      if (path[0])
+        asprintf (&s_path, "\"path\":\"%s\",", path);
+      asprintf (&data, "{\"query\":\"%s\",\"options\":{%s"
+        "\"max_results\":1000,\"file_status\":\"active\","
+        "\"filename_only\":true}}", query, s_path ? s_path : "");
+      free (s_path);
+      }
+
+    char curl_error [CURL_ERROR_SIZE];
+    curl_easy_setopt (curl, CURLOPT_ERRORBUFFER, curl_error);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, dropbox_write_callback);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDS, data);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+
+    CURLcode curl_code = curl_easy_perform (curl);
+    if (curl_code == 0)
+      dropbox_parse_search_results (response.memory, include_dirs, store, 
+        next_cursor, error);
+    else
+      *error = strdup (curl_error); 
+
+    free (response.memory);
+    curl_slist_free_all (headers); 
+    free (auth_header);
+    free (data);
+    dropbox_curl_release (curl);
+    }
+  else
+    {
+    *error = strdup (EASY_INIT_FAIL); 
+    }
+
+  OUT
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_search
+Search path, and everything under it, for files -- and folders, if 
+include_dirs is TRUE -- whose names match query, as the server 
+understands it: words, or the beginnings of words, in any case. The 
+server's search index may lag a little behind recent changes. pf is 
+called with each page of results, as dropbox_list_paged() does
+---------------------------------------------------------------------------*/
+void dropbox_search (const char *token, const char *path, 
+    const char *query, DBStatStore *store, BOOL include_dirs, 
+    DBPageFunc pf, void *user, char **error)
+  {
+  IN
+  char *cursor = NULL;
+  do
+    {
+    char *next_cursor = NULL;
+    uint32_t first = dropbox_stat_store_length (store);
+    dropbox_search_page (token, path, query, store, include_dirs, cursor, 
+      &next_cursor, error);
+    uint32_t added = dropbox_stat_store_length (store) - first;
+    if (pf && *error == NULL && added > 0) pf (store, first, added, user);
+    free (cursor);
+    cursor = next_cursor;
+    } while (cursor && *error == NULL);
+  free (cursor);
+  OUT
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_longpoll
+Blocks until the listing that the cursor came from changes, or the 
+timeout (30-480 seconds) expires. *changes is set according to which
+happened. *backoff is set to the number of seconds the server wants us
+to wait before calling again, or zero. This call does not need the
+access token
+---------------------------------------------------------------------------*/
+void dropbox_longpoll (const char *cursor, int timeout, BOOL *changes,
+    int *backoff, char **error)
   {
   IN
-  _dropbox_list_files (token, path, list, include_dirs, recursive, 
-     NULL, error);
+  log_debug ("dropbox_longpoll timeout=%d", timeout);
+  *changes = FALSE;
+  *backoff = 0;
+  CURL* curl = dropbox_curl_acquire();
+  if (curl)
+    {
+    struct DBWriteStruct response;
+    dropbox_response_init (&response);
+ 
+    struct curl_slist *headers = NULL;
+
+    curl_easy_setopt (curl, CURLOPT_POST, 1);
+
+    char *data;
+    headers = curl_slist_append (headers, "Content-Type: application/json");
+
+    curl_easy_setopt (curl, CURLOPT_URL, 
+      "https://notify.dropboxapi.com/2/files/list_folder/longpoll");
+
+    asprintf (&data, "{\"cursor\":\"%s\",\"timeout\":%d}", cursor, 
+      timeout); 
+
+    char curl_error [CURL_ERROR_SIZE];
+    curl_easy_setopt (curl, CURLOPT_ERRORBUFFER, curl_error);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, dropbox_write_callback);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDS, data);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    // The server adds up to 90 seconds to the requested timeout
+    curl_easy_setopt (curl, CURLOPT_TIMEOUT, (long)timeout + 120);
+
+    CURLcode curl_code = curl_easy_perform (curl);
+    if (curl_code == 0)
+      {
+      Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+      cJSON *root = dropbox_json_parse (arena, response.memory); 
+      cJSON *j_changes = root ? cJSON_GetObjectItem (root, "changes") : NULL;
+      if (j_changes)
+        {
+        *changes = cJSON_IsTrue (j_changes);
+        cJSON *j_backoff = cJSON_GetObjectItem (root, "backoff");
+        if (j_backoff) *backoff = j_backoff->valueint;
+        }
+      else
+        {
+        *error = dropbox_decode_server_error (response.memory);
+        }
+      arena_destroy (arena);
+      }
+    else
+      {
+      *error = strdup (curl_error); 
+      }
+
+    free (response.memory);
+    curl_slist_free_all (headers); 
+    free (data);
+    dropbox_curl_release (curl);
+    }
+  else
+    {
+    *error = strdup (EASY_INIT_FAIL); 
+    }
+
   OUT
   }
 
@@ -695,12 +1634,11 @@ void dropbox_newfolder (const char *token, const char *new_path,
   {
   IN
   log_debug ("dropbox_newfolder path=%s", new_path); 
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
    
     struct curl_slist *headers = NULL;
 
@@ -740,7 +1678,7 @@ void dropbox_newfolder (const char *token, const char *new_path,
     curl_slist_free_all (headers); 
     free (auth_header);
     free (data);
-    curl_easy_cleanup (curl);
+    dropbox_curl_release (curl);
     }
   else
     {
@@ -758,12 +1696,11 @@ void dropbox_delete (const char *token, const char *path,
   {
   IN
   log_debug ("dropbox_delete path=%s", path); 
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
    
     struct curl_slist *headers = NULL;
 
@@ -805,7 +1742,7 @@ void dropbox_delete (const char *token, const char *path,
     curl_slist_free_all (headers); 
     free (auth_header);
     free (data);
-    curl_easy_cleanup (curl);
+    dropbox_curl_release (curl);
     }
   else
     {
@@ -873,7 +1810,7 @@ void dropbox_download (const char *token, const char *source,
     {
     struct DBStoreStruct ss;
     ss.f = f;
-    CURL* curl = curl_easy_init();
+    CURL* curl = dropbox_curl_acquire();
     if (curl)
       {
       struct curl_slist *headers = NULL;
@@ -930,7 +1867,7 @@ void dropbox_download (const char *token, const char *source,
       curl_slist_free_all (headers); 
       free (auth_header);
       free (data);
-      curl_easy_cleanup (curl);
+      dropbox_curl_release (curl);
       }
     else
       {
@@ -948,6 +1885,101 @@ void dropbox_download (const char *token, const char *source,
   }
 
 
+/*---------------------------------------------------------------------------
+dropbox_stream_callback
+Successful responses are passed on as they arrive; error responses are
+collected, to be decoded at the end
+---------------------------------------------------------------------------*/
+static size_t dropbox_stream_callback (void *contents, size_t size, 
+    size_t nmemb, void *userp)
+  {
+  size_t realsize = size * nmemb;
+  struct DBStreamStruct *ss = userp;
+  long code = 0;
+  curl_easy_getinfo (ss->curl, CURLINFO_RESPONSE_CODE, &code);
+  if (code != 200)
+    return dropbox_write_callback (contents, size, nmemb, &ss->response);
+  if (!ss->df (contents, realsize, ss->user))
+    {
+    ss->stopped = TRUE;
+    return 0;
+    }
+  return realsize;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_download_zip
+Download a folder, and everything in it, as a zip archive, which is 
+passed to df as it arrives. If df stops the download, *error is set to
+a general message; the caller will know more
+---------------------------------------------------------------------------*/
+void dropbox_download_zip (const char *token, const char *path, 
+    DBDataFunc df, void *user, char **error)
+  {
+  IN
+  log_debug ("dropbox_download_zip path=%s", path);
+
+  CURL* curl = dropbox_curl_acquire();
+  if (curl)
+    {
+    struct DBStreamStruct ss;
+    ss.curl = curl;
+    ss.df = df;
+    ss.user = user;
+    ss.stopped = FALSE;
+    dropbox_response_init (&ss.response);
+
+    struct curl_slist *headers = NULL;
+    curl_easy_setopt (curl, CURLOPT_POST, 1);
+
+    char *auth_header, *data;
+    asprintf (&auth_header, "Authorization: Bearer %s", token);
+    headers = curl_slist_append (headers, auth_header);
+    // Dropbox insists that the content-type is empty
+    headers = curl_slist_append (headers, "Content-Type: ");
+
+    curl_easy_setopt (curl, CURLOPT_URL, 
+      "https://content.dropboxapi.com/2/files/download_zip");
+
+    asprintf (&data, "Dropbox-API-Arg: {\"path\":\"%s\"}", path);
+    headers = curl_slist_append (headers, data);
+
+    char curl_error [CURL_ERROR_SIZE];
+    curl_easy_setopt (curl, CURLOPT_ERRORBUFFER, curl_error);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, dropbox_stream_callback);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, (void *) &ss);
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDS, "");
+
+    CURLcode curl_code = curl_easy_perform (curl);
+    long code = 0;
+    curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &code);
+    if (ss.stopped)
+      *error = strdup ("Download stopped");
+    else if (curl_code != 0)
+      *error = strdup (curl_error); 
+    else if (code != 200)
+      {
+      *error = dropbox_decode_server_error (ss.response.memory);
+      if (!*error) asprintf (error, "Server returned status %ld", code);
+      }
+
+    free (ss.response.memory);
+    curl_slist_free_all (headers); 
+    free (auth_header);
+    free (data);
+    dropbox_curl_release (curl);
+    }
+  else
+    {
+    *error = strdup (EASY_INIT_FAIL); 
+    }
+
+  OUT
+  }
+
+
 /*---------------------------------------------------------------------------
 dropbox_upload_start
 ---------------------------------------------------------------------------*/
@@ -955,12 +1987,11 @@ void dropbox_upload_start (const char *token, char**session, char **error)
   {
   log_debug ("Upload start");
 
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
      
     struct curl_slist *headers = NULL;
 
@@ -992,7 +2023,8 @@ void dropbox_upload_start (const char *token, char**session, char **error)
     if (curl_code == 0)
       {
       char *text = response.memory;
-      cJSON *root = cJSON_Parse (text); 
+      Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+      cJSON *root = dropbox_json_parse (arena, text); 
       if (root)
 	{
 	cJSON *j_sid  = cJSON_GetObjectItem (root, "session_id");
@@ -1000,8 +2032,8 @@ void dropbox_upload_start (const char *token, char**session, char **error)
 	  {
           *session = strdup (j_sid->valuestring);
           }
-        cJSON_Delete (root);
         }
+      arena_destroy (arena);
       if (*session == NULL)
         dropbox_check_response_for_error (text, error);
       }
@@ -1014,7 +2046,7 @@ void dropbox_upload_start (const char *token, char**session, char **error)
      curl_slist_free_all (headers); 
      free (auth_header);
      free (data);
-     curl_easy_cleanup (curl);
+     dropbox_curl_release (curl);
      }
   else
      {
@@ -1026,18 +2058,19 @@ void dropbox_upload_start (const char *token, char**session, char **error)
 
 /*---------------------------------------------------------------------------
 dropbox_upload_done
+The file's modification time is stored on the server as client_modified,
+so that a later get can give the local copy the same time
 ---------------------------------------------------------------------------*/
 void dropbox_upload_done (const char *token, const char *session, 
-    size_t offset, const char *path,  char **error)
+    size_t offset, const char *path, time_t client_modified, char **error)
   {
   log_debug ("Upload done, session = %s, offset=%ld\n", session, offset);
 
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
      
     struct curl_slist *headers = NULL;
 
@@ -1052,9 +2085,11 @@ void dropbox_upload_done (const char *token, const char *session,
     curl_easy_setopt (curl, CURLOPT_URL, 
 	  "https://content.dropboxapi.com/2/files/upload_session/finish");
 
+    char client_modified_s [21];
+    dropbox_format_timestamp (client_modified, client_modified_s);
     asprintf (&data, 
-	  "Dropbox-API-Arg: {\"cursor\":{\"session_id\":\"%s\",\"offset\":%ld},\"commit\":{\"path\":\"%s\",\"mode\":\"overwrite\"}}",
-          session, offset, path);
+	  "Dropbox-API-Arg: {\"cursor\":{\"session_id\":\"%s\",\"offset\":%ld},\"commit\":{\"path\":\"%s\",\"mode\":\"overwrite\",\"client_modified\":\"%s\"}}",
+          session, offset, path, client_modified_s);
     headers = curl_slist_append (headers, data);
 
     char curl_error [CURL_ERROR_SIZE];
@@ -1071,7 +2106,8 @@ void dropbox_upload_done (const char *token, const char *session,
       {
       // TODO -- confirm response
       char *text = response.memory;
-      cJSON *root = cJSON_Parse (text); 
+      Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+      cJSON *root = dropbox_json_parse (arena, text); 
       if (root)
 	{
 	cJSON *j_name  = cJSON_GetObjectItem (root, "name");
@@ -1084,8 +2120,8 @@ void dropbox_upload_done (const char *token, const char *session,
           {
           dropbox_check_response_for_error (text, error);
           }
-        cJSON_Delete (root);
         }
+      arena_destroy (arena);
       }
      else
       {
@@ -1096,7 +2132,7 @@ void dropbox_upload_done (const char *token, const char *session,
      curl_slist_free_all (headers); 
      free (auth_header);
      free (data);
-     curl_easy_cleanup (curl);
+     dropbox_curl_release (curl);
      }
   else
      {
@@ -1115,12 +2151,11 @@ void dropbox_upload_block (const char *token, void *data, int length,
   {
   log_debug ("Upload block, session = %s, offset=%ld\n", session, offset);
 
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
      
     struct curl_slist *headers = NULL;
 
@@ -1169,7 +2204,7 @@ void dropbox_upload_block (const char *token, void *data, int length,
      curl_slist_free_all (headers); 
      free (auth_header);
      free (argdata);
-     curl_easy_cleanup (curl);
+     dropbox_curl_release (curl);
      }
   else
      {
@@ -1222,19 +2257,19 @@ void dropbox_upload (const char *token, const char *source,
       prog.offset = offset;
       }
 
-    dropbox_upload_done (token, session, offset, target, error);
+    dropbox_upload_done (token, session, offset, target, sb.st_mtime, 
+      error);
     if (pf) pf (prog.total, prog.total); // Ensure that 100% is shown 
     if (pf) pf (-1, -1); // Clear progress
 
     if (session) free (session);
 
 #ifdef no_longer_used 
-    CURL* curl = curl_easy_init();
+    CURL* curl = dropbox_curl_acquire();
     if (curl)
       {
       struct DBWriteStruct response;
-      response.memory = malloc(1);  
-      response.size = 0;    
+      dropbox_response_init (&response);
    
       struct curl_slist *headers = NULL;
 
@@ -1276,7 +2311,7 @@ void dropbox_upload (const char *token, const char *source,
       curl_slist_free_all (headers); 
       free (auth_header);
       free (data);
-      curl_easy_cleanup (curl);
+      dropbox_curl_release (curl);
       }
     else
       {
@@ -1303,12 +2338,11 @@ void dropbox_get_usage (const char *token, int64_t *quota,
   {
   *quota = 0;
   *usage = 0;
-  CURL* curl = curl_easy_init();
+  CURL* curl = dropbox_curl_acquire();
   if (curl)
     {
     struct DBWriteStruct response;
-    response.memory = malloc(1);  
-    response.size = 0;    
+    dropbox_response_init (&response);
    
     struct curl_slist *headers = NULL;
 
@@ -1336,7 +2370,8 @@ void dropbox_get_usage (const char *token, int64_t *quota,
     if (curl_code == 0)
       {
       const char *text = response.memory;
-      cJSON *root = cJSON_Parse (text); 
+      Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+      cJSON *root = dropbox_json_parse (arena, text); 
       if (root)
 	{
 	cJSON *j_used  = cJSON_GetObjectItem (root, "used");
@@ -1359,10 +2394,10 @@ void dropbox_get_usage (const char *token, int64_t *quota,
           {
           dropbox_check_response_for_error (text, error);
           }
-        cJSON_Delete (root);
         }
       else
         dropbox_check_response_for_error (text, error);
+      arena_destroy (arena);
       }
     else
       {
@@ -1372,7 +2407,7 @@ void dropbox_get_usage (const char *token, int64_t *quota,
     free (response.memory);
     curl_slist_free_all (headers); 
     free (auth_header);
-    curl_easy_cleanup (curl);
+    dropbox_curl_release (curl);
     }
   else
     {
@@ -1392,7 +2427,18 @@ static size_t dropbox_write_callback (void *contents, size_t size,
   IN
   size_t realsize = size * nmemb;
   struct DBWriteStruct *mem = (struct DBWriteStruct *)userp;
-  mem->memory = realloc (mem->memory, mem->size + realsize + 1);
+  size_t needed = mem->size + realsize + 1;
+  if (needed > mem->capacity)
+    {
+    // Grow geometrically, so that a large response is copied only
+    //  a few times in total, rather than once for every chunk
+    size_t capacity = mem->capacity ? mem->capacity : RESPONSE_INITIAL_SIZE;
+    while (capacity < needed) capacity *= 2;
+    char *memory = realloc (mem->memory, capacity);
+    if (!memory) return 0; // Makes curl abort the transfer
+    mem->memory = memory;
+    mem->capacity = capacity;
+    }
   memcpy(&(mem->memory[mem->size]), contents, realsize);
   mem->size += realsize;
   mem->memory[mem->size] = 0;
@@ -11,9 +11,19 @@ GPL v3.0
 #include "dropbox_stat.h"
 
 typedef void (*DBProgressFunc) (int64_t transferred, int64_t total);
+// Called as each page of a listing arrives, with the index in the store
+//   of the first new entry, and the number of new entries
+typedef void (*DBPageFunc) (const DBStatStore *store, uint32_t first, 
+           uint32_t count, void *user);
+// Called with each piece of a download as it arrives. Returns FALSE to
+//   stop the download
+typedef BOOL (*DBDataFunc) (const void *data, size_t length, void *user);
 
 void dropbox_move (const char *token, const char *old_path, 
            const char *new_path, char **error);
+void dropbox_copy (const char *token, const char *from_path, 
+           const char *to_path, unsigned char hash[DBHASH_RAW_LENGTH],
+           char **error);
 void dropbox_get_usage (const char *token, int64_t *quota, 
            int64_t *usage, char **error);
 void dropbox_newfolder (const char *token, const char *new_path,
@@ -22,12 +32,38 @@ void dropbox_delete (const char *token, const char *path,
            char **error);
 void  dropbox_download (const char *token, const char *source, 
            const char *target, DBProgressFunc pf, char **error);
+void  dropbox_download_zip (const char *token, const char *path, 
+           DBDataFunc df, void *user, char **error);
 void  dropbox_list_files (const char *token, const char *path, 
-           List *list, BOOL include_dirs, BOOL recursive, char **error);
+           DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+           char **error);
+void  dropbox_list_changes (const char *token, const char *path, 
+           DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+           const char *cursor, char **new_cursor, char **error);
+void  dropbox_list_paged (const char *token, const char *path, 
+           DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+           const char *cursor, char **new_cursor, DBPageFunc pf, 
+           void *user, char **error);
+void  dropbox_list_parallel (const char *token, const char *path, 
+           DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+           int jobs, DBPageFunc pf, void *user, char **error);
+BOOL  dropbox_list_is_long (const char *token, const char *path, 
+           DBStatStore *store, BOOL include_dirs, BOOL recursive, 
+           char **error);
+void  dropbox_search (const char *token, const char *path, 
+           const char *query, DBStatStore *store, BOOL include_dirs, 
+           DBPageFunc pf, void *user, char **error);
+void  dropbox_longpoll (const char *cursor, int timeout, BOOL *changes,
+           int *backoff, char **error);
+void  dropbox_cleanup (void);
+time_t dropbox_parse_timestamp (const char *s);
+void  dropbox_format_timestamp (time_t t, char buff[21]);
 char *dropbox_get_token (const char *code, char **error);
 void  dropbox_get_file_info (const char *token, const char *file, 
           DBStat *stat, char **error);
 BOOL  dropbox_hash (const char *filename, char output_hash[65], char **error);
+BOOL  dropbox_hash_raw (const char *filename, 
+          unsigned char output_hash[DBHASH_RAW_LENGTH], char **error);
 void  dropbox_upload (const char *token, const char *source, 
           const char *target, int buffsize_mb, DBProgressFunc pf, char **error);
 
@@ -11,12 +11,60 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 #include <memory.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "token.h"
 #include "cJSON.h"
 #include "dropbox.h"
 #include "dropbox_stat.h"
 #include "list.h"
 #include "log.h"
+#include "arena.h"
+#include "hashindex.h"
+
+// Number of DBStat records in each chunk of a DBStatStore. Records are
+//   never moved once added, so pointers to them remain valid for the
+//   lifetime of the store
+#define STORE_CHUNK_SHIFT 10
+#define STORE_CHUNK_SIZE (1 << STORE_CHUNK_SHIFT)
+
+// Block size for the arena that holds pathnames in a DBStatStore
+#define STORE_PATH_BLOCK_SIZE (256 * 1024)
+
+struct _DBStatStore
+  {
+  DBStat  **chunks;
+  uint32_t  nchunks;
+  uint32_t  length;
+  Arena    *paths;
+  HashIndex *index; // path_lower -> DBStat, if the store is indexed
+  DBStatFilterFn filter; // Entries it rejects are not added, if not NULL
+  void     *filter_user;
+  };
+
+
+/*---------------------------------------------------------------------------
+dropbox_stat_ascii_lower
+---------------------------------------------------------------------------*/
+static char *dropbox_stat_ascii_lower (Arena *arena, const char *path)
+  {
+  char *ret = arena_strdup (arena, path);
+  char *p;
+  for (p = ret; *p; p++)
+    if (*p >= 'A' && *p <= 'Z') *p += 'a' - 'A';
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_stat_name_offset
+The name of a Dropbox item is always the last element of its path
+---------------------------------------------------------------------------*/
+static uint32_t dropbox_stat_name_offset (const char *path)
+  {
+  const char *p = strrchr (path, '/');
+  if (p && p[1]) return (uint32_t)(p - path + 1);
+  return 0; // Root, or a path with no separator
+  }
 
 
 /*---------------------------------------------------------------------------
@@ -27,17 +75,37 @@ DBStat *dropbox_stat_clone (const DBStat *self)
   DBStat *other = dropbox_stat_create();
   if (self->path)
     other->path = strdup (self->path);
-  if (self->name)
-    other->name = strdup (self->name);
+  if (self->path_lower)
+    other->path_lower = strdup (self->path_lower);
+  other->name_offset = self->name_offset;
   other->type = self->type;
   other->length = self->length;
   other->client_modified = self->client_modified; 
   other->server_modified = self->server_modified; 
-  strncpy (other->hash, self->hash, DBHASH_LENGTH);
+  other->flags = self->flags & ~DBSTAT_FLAG_STORE;
+  memcpy (other->hash, self->hash, DBHASH_RAW_LENGTH);
   return other;
   }
 
 
+/*---------------------------------------------------------------------------
+dropbox_stat_init
+Set up a DBStat, usually on the caller's stack, that refers to path and
+path_lower rather than copying them, so that an entry can be offered 
+to dropbox_stat_store_wants() before anything is allocated for it. It
+must not be passed to dropbox_stat_destroy()
+---------------------------------------------------------------------------*/
+void dropbox_stat_init (DBStat *self, const char *path, 
+       const char *path_lower, DBType type)
+  {
+  memset (self, 0, sizeof (DBStat));
+  self->path = (char *)path;
+  self->path_lower = (char *)path_lower;
+  self->name_offset = dropbox_stat_name_offset (path);
+  self->type = type;
+  }
+
+
 /*---------------------------------------------------------------------------
 dropbox_stat_create
 ---------------------------------------------------------------------------*/
@@ -66,12 +134,13 @@ dropbox_stat_destroy
 void dropbox_stat_destroy (DBStat *self)
   {
   log_debug ("Destroying DBStat object %08X", (long) self);
-  if (self)
+  // Objects in a store are released with the store
+  if (self && !(self->flags & DBSTAT_FLAG_STORE))
     {
     if (self->path)
       free (self->path); 
-    if (self->name)
-      free (self->name); 
+    if (self->path_lower)
+      free (self->path_lower); 
     free (self);
     }
   }
@@ -106,10 +175,41 @@ int64_t dropbox_stat_get_length (const DBStat *self)
 
 /*---------------------------------------------------------------------------
 dropbox_stat_get_hash
+Returns the hash in hex, as the server reports it, or an empty string if
+there is no hash (e.g., for a folder). The result is in a per-thread 
+buffer, which is overwritten by the next call
 ---------------------------------------------------------------------------*/
 const char *dropbox_stat_get_hash (const DBStat *self)
   {
-  return self->hash;
+  static __thread char hex[DBHASH_LENGTH];
+  if (self->flags & DBSTAT_FLAG_HAS_HASH)
+    dropbox_hash_to_hex (self->hash, hex);
+  else
+    hex[0] = 0;
+  return hex;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_stat_get_hash_raw
+Returns NULL if there is no hash
+---------------------------------------------------------------------------*/
+const unsigned char *dropbox_stat_get_hash_raw (const DBStat *self)
+  {
+  if (self->flags & DBSTAT_FLAG_HAS_HASH)
+    return self->hash;
+  return NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_stat_hash_equals
+---------------------------------------------------------------------------*/
+BOOL dropbox_stat_hash_equals (const DBStat *self,
+       const unsigned char hash[DBHASH_RAW_LENGTH])
+  {
+  if (!(self->flags & DBSTAT_FLAG_HAS_HASH)) return FALSE;
+  return memcmp (self->hash, hash, DBHASH_RAW_LENGTH) == 0;
   }
 
 
@@ -127,7 +227,19 @@ dropbox_stat_get_name
 ---------------------------------------------------------------------------*/
 const char *dropbox_stat_get_name (const DBStat *self)
   {
-  return self->name;
+  if (!self->path) return NULL;
+  return self->path + self->name_offset;
+  }
+
+
+/*---------------------------------------------------------------------------
+dropbox_stat_get_path_lower
+The server's case-folded form of the path, which is what Dropbox uses
+to decide whether two paths are the same. May be NULL
+---------------------------------------------------------------------------*/
+const char *dropbox_stat_get_path_lower (const DBStat *self)
+  {
+  return self->path_lower;
   }
 
 
@@ -151,11 +263,19 @@ List *dropbox_stat_create_list (void)
 
 /*==========================================================================
 dropbox_stat_set_name 
+The name is not stored separately -- it must be the last part of the
+path, which should be set first. If it is not, the name derived from
+the path is kept
 *==========================================================================*/
 void dropbox_stat_set_name (DBStat *self, const char *name)
   {
-  if (self->name) free (self->name);
-  self->name = strdup (name);
+  if (!self->path) return;
+  size_t lp = strlen (self->path);
+  size_t ln = strlen (name);
+  if (ln <= lp && strcmp (self->path + lp - ln, name) == 0)
+    self->name_offset = (uint32_t)(lp - ln);
+  else
+    log_debug ("Name %s is not part of path %s", name, self->path);
   }
 
 
@@ -164,8 +284,12 @@ dropbox_stat_set_path
 *==========================================================================*/
 void dropbox_stat_set_path (DBStat *self, const char *path)
   {
+  // Paths of objects in a store live in the store's arena, and can't
+  //   be changed
+  if (self->flags & DBSTAT_FLAG_STORE) return;
   if (self->path) free (self->path);
   self->path = strdup (path);
+  self->name_offset = dropbox_stat_name_offset (path);
   }
 
 
@@ -192,7 +316,21 @@ dropbox_stat_set_hash
 *==========================================================================*/
 void dropbox_stat_set_hash (DBStat *self, const char *hash)
   {
-  strncpy (self->hash, hash, DBHASH_LENGTH);
+  if (dropbox_hash_from_hex (hash, self->hash))
+    self->flags |= DBSTAT_FLAG_HAS_HASH;
+  else
+    self->flags &= ~DBSTAT_FLAG_HAS_HASH;
+  }
+
+
+/*==========================================================================
+dropbox_stat_set_hash_raw
+*==========================================================================*/
+void dropbox_stat_set_hash_raw (DBStat *self, 
+       const unsigned char hash[DBHASH_RAW_LENGTH])
+  {
+  memcpy (self->hash, hash, DBHASH_RAW_LENGTH);
+  self->flags |= DBSTAT_FLAG_HAS_HASH;
   }
 
 
@@ -214,3 +352,234 @@ void dropbox_stat_set_length (DBStat *self, int64_t length)
   }
 
 
+/*==========================================================================
+dropbox_hash_from_hex
+Returns FALSE if the string is not a 64-digit hex number
+*==========================================================================*/
+BOOL dropbox_hash_from_hex (const char *hex, 
+       unsigned char hash[DBHASH_RAW_LENGTH])
+  {
+  int i;
+  for (i = 0; i < DBHASH_RAW_LENGTH; i++)
+    {
+    int j, v = 0;
+    for (j = 0; j < 2; j++)
+      {
+      char c = hex[i * 2 + j];
+      v <<= 4;
+      if (c >= '0' && c <= '9') v |= c - '0';
+      else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+      else return FALSE;
+      }
+    hash[i] = (unsigned char) v;
+    }
+  return hex[DBHASH_RAW_LENGTH * 2] == 0;
+  }
+
+
+/*==========================================================================
+dropbox_hash_to_hex
+*==========================================================================*/
+void dropbox_hash_to_hex (const unsigned char hash[DBHASH_RAW_LENGTH], 
+       char hex[DBHASH_LENGTH])
+  {
+  static const char digits[] = "0123456789abcdef";
+  int i;
+  for (i = 0; i < DBHASH_RAW_LENGTH; i++)
+    {
+    hex[i * 2] = digits[hash[i] >> 4];
+    hex[i * 2 + 1] = digits[hash[i] & 0x0F];
+    }
+  hex[DBHASH_RAW_LENGTH * 2] = 0;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_create
+A DBStatStore holds a large number of DBStat objects compactly -- the
+records themselves are allocated in chunks, and all the pathnames are
+packed into a single arena. This avoids several small allocations
+for every item in a server listing
+*==========================================================================*/
+DBStatStore *dropbox_stat_store_create (void)
+  {
+  DBStatStore *self = malloc (sizeof (DBStatStore));
+  memset (self, 0, sizeof (DBStatStore));
+  self->paths = arena_create (STORE_PATH_BLOCK_SIZE);
+  return self;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_create_indexed
+Creates a store that maintains a hash index on the lower-case path 
+of each item, so items can be found by dropbox_stat_store_find()
+*==========================================================================*/
+DBStatStore *dropbox_stat_store_create_indexed (void)
+  {
+  DBStatStore *self = dropbox_stat_store_create ();
+  self->index = hashindex_create ();
+  return self;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_is_indexed
+*==========================================================================*/
+BOOL dropbox_stat_store_is_indexed (const DBStatStore *self)
+  {
+  return self && self->index != NULL;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_set_filter
+Entries that filter rejects are not added to the store by the listing
+functions, which check with dropbox_stat_store_wants() before they
+allocate anything. dropbox_stat_store_add() itself does not check
+*==========================================================================*/
+void dropbox_stat_store_set_filter (DBStatStore *self, 
+       DBStatFilterFn filter, void *user)
+  {
+  self->filter = filter;
+  self->filter_user = user;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_wants
+*==========================================================================*/
+BOOL dropbox_stat_store_wants (const DBStatStore *self, const DBStat *stat)
+  {
+  if (!self->filter) return TRUE;
+  return self->filter (stat, self->filter_user);
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_destroy
+*==========================================================================*/
+void dropbox_stat_store_destroy (DBStatStore *self)
+  {
+  if (!self) return;
+  uint32_t i;
+  for (i = 0; i < self->nchunks; i++)
+    free (self->chunks[i]);
+  free (self->chunks);
+  arena_destroy (self->paths);
+  hashindex_destroy (self->index);
+  free (self);
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_add
+Adds a new, zeroed, record with the specified path and type, and 
+returns it so the caller can fill in the other attributes. The record
+remains owned by the store. path_lower should be the server's 
+lower-case form of the path; if it is NULL, it is worked out here.
+If the store is indexed, and already contains the same path, the new
+record replaces the old one in the index
+*==========================================================================*/
+DBStat *dropbox_stat_store_add (DBStatStore *self, const char *path, 
+       const char *path_lower, DBType type)
+  {
+  uint32_t chunk = self->length >> STORE_CHUNK_SHIFT;
+  if (chunk >= self->nchunks)
+    {
+    self->chunks = realloc (self->chunks, 
+      (self->nchunks + 1) * sizeof (DBStat *));
+    self->chunks[self->nchunks] = 
+      malloc (STORE_CHUNK_SIZE * sizeof (DBStat));
+    self->nchunks++;
+    }
+  DBStat *stat = &self->chunks[chunk][self->length & (STORE_CHUNK_SIZE - 1)];
+  self->length++;
+
+  memset (stat, 0, sizeof (DBStat));
+  stat->path = arena_strdup (self->paths, path);
+  if (path_lower)
+    stat->path_lower = arena_strdup (self->paths, path_lower);
+  else
+    stat->path_lower = dropbox_stat_ascii_lower (self->paths, path);
+  stat->name_offset = dropbox_stat_name_offset (path);
+  stat->type = type;
+  stat->flags = DBSTAT_FLAG_STORE;
+  if (self->index)
+    hashindex_put (self->index, stat->path_lower, strlen (stat->path_lower),
+      stat, FALSE);
+  return stat;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_add_copy
+Adds a record with the same attributes as other, which may belong to 
+another store
+*==========================================================================*/
+DBStat *dropbox_stat_store_add_copy (DBStatStore *self, const DBStat *other)
+  {
+  DBStat *stat = dropbox_stat_store_add (self, other->path, 
+    other->path_lower, other->type);
+  stat->length = other->length;
+  stat->client_modified = other->client_modified;
+  stat->server_modified = other->server_modified;
+  stat->flags |= other->flags & ~DBSTAT_FLAG_STORE;
+  memcpy (stat->hash, other->hash, DBHASH_RAW_LENGTH);
+  return stat;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_length
+*==========================================================================*/
+uint32_t dropbox_stat_store_length (const DBStatStore *self)
+  {
+  if (!self) return 0;
+  return self->length;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_find
+Look up a path in an indexed store, ignoring case as Dropbox does. Only
+ASCII letters are case-folded here, so a miss on a path with other 
+characters might be spurious -- if "certain" is not NULL, it is set to
+FALSE in that case, so the caller can check with the server instead
+*==========================================================================*/
+DBStat *dropbox_stat_store_find (const DBStatStore *self, const char *path,
+       BOOL *certain)
+  {
+  if (certain) *certain = FALSE;
+  if (!self || !self->index) return NULL;
+
+  size_t i, l = strlen (path);
+  char buff[1024];
+  char *lower = l < sizeof (buff) ? buff : malloc (l + 1);
+  BOOL ascii = TRUE;
+  for (i = 0; i < l; i++)
+    {
+    unsigned char c = (unsigned char) path[i];
+    if (c >= 0x80) ascii = FALSE;
+    lower[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+  lower[l] = 0;
+
+  DBStat *ret = hashindex_get (self->index, lower, l);
+  if (certain) *certain = (ret != NULL || ascii);
+  if (lower != buff) free (lower);
+  return ret;
+  }
+
+
+/*==========================================================================
+dropbox_stat_store_get
+*==========================================================================*/
+DBStat *dropbox_stat_store_get (const DBStatStore *self, uint32_t index)
+  {
+  if (index >= self->length) return NULL;
+  return &self->chunks[index >> STORE_CHUNK_SHIFT]
+    [index & (STORE_CHUNK_SIZE - 1)];
+  }
+
@@ -6,29 +6,53 @@ GPL v3.0
 
 #pragma once
 
+#include <stdint.h>
+#include <time.h>
 #include "bool.h"
 #include "list.h"
 
+// Length of a content hash in hex, with its terminating null
 #define DBHASH_LENGTH 65
+// Length of a content hash as raw SHA256 bytes
+#define DBHASH_RAW_LENGTH 32
 
-typedef enum {DBSTAT_NONE, DBSTAT_FILE, DBSTAT_FOLDER} DBType;
+// DBSTAT_DELETED only appears in lists of changes since a cursor
+typedef enum {DBSTAT_NONE, DBSTAT_FILE, DBSTAT_FOLDER, DBSTAT_DELETED} DBType;
+
+// Set on DBStat objects that belong to a DBStatStore, rather than
+//   being individually allocated
+#define DBSTAT_FLAG_STORE    0x01
+#define DBSTAT_FLAG_HAS_HASH 0x02
 
 typedef struct _DBStat
   {
   char     *path;
-  char     *name;
+  char     *path_lower;  // Only set for objects in a store
+  uint32_t  name_offset; // The name is the part of path from this offset
   DBType    type;
   int64_t   length;
   time_t    client_modified;
   time_t    server_modified;
-  char      hash[DBHASH_LENGTH];
+  uint8_t   flags;
+  unsigned char hash[DBHASH_RAW_LENGTH];
   } DBStat;
 
+struct _DBStatStore;
+typedef struct _DBStatStore DBStatStore;
+
+// Decides whether an entry should be added to a store. It is called
+//   once for each entry offered, on the thread that adds it
+typedef BOOL (*DBStatFilterFn) (const DBStat *stat, void *user);
+
 List        *dropbox_stat_create_list (void);
 DBStat      *dropbox_stat_create (void);
 const char  *dropbox_stat_get_path (const DBStat *self);
 const char  *dropbox_stat_get_name (const DBStat *self);
+const char  *dropbox_stat_get_path_lower (const DBStat *self);
 const char  *dropbox_stat_get_hash (const DBStat *self);
+const unsigned char *dropbox_stat_get_hash_raw (const DBStat *self);
+BOOL         dropbox_stat_hash_equals (const DBStat *self,
+               const unsigned char hash[DBHASH_RAW_LENGTH]);
 int64_t      dropbox_stat_get_length (const DBStat *self);
 DBType       dropbox_stat_get_type (const DBStat *self);
 time_t       dropbox_stat_get_server_modified (const DBStat *self);
@@ -38,7 +62,34 @@ void         dropbox_stat_set_path (DBStat *self, const char *path);
 void         dropbox_stat_set_type (DBStat *self, DBType type);
 void         dropbox_stat_set_client_modified (DBStat *self, time_t t);
 void         dropbox_stat_set_hash (DBStat *self, const char *hash);
+void         dropbox_stat_set_hash_raw (DBStat *self,
+               const unsigned char hash[DBHASH_RAW_LENGTH]);
 void         dropbox_stat_set_length (DBStat *self, int64_t length);
 void         dropbox_stat_set_server_modified (DBStat *self, time_t t);
 void         dropbox_stat_destroy (DBStat *self);
 DBStat      *dropbox_stat_clone (const DBStat *self);
+void         dropbox_stat_init (DBStat *self, const char *path, 
+               const char *path_lower, DBType type);
+
+BOOL         dropbox_hash_from_hex (const char *hex,
+               unsigned char hash[DBHASH_RAW_LENGTH]);
+void         dropbox_hash_to_hex (const unsigned char hash[DBHASH_RAW_LENGTH],
+               char hex[DBHASH_LENGTH]);
+
+DBStatStore *dropbox_stat_store_create (void);
+DBStatStore *dropbox_stat_store_create_indexed (void);
+void         dropbox_stat_store_destroy (DBStatStore *self);
+DBStat      *dropbox_stat_store_add (DBStatStore *self, const char *path,
+               const char *path_lower, DBType type);
+DBStat      *dropbox_stat_store_add_copy (DBStatStore *self, 
+               const DBStat *other);
+DBStat      *dropbox_stat_store_find (const DBStatStore *self, 
+               const char *path, BOOL *certain);
+BOOL         dropbox_stat_store_is_indexed (const DBStatStore *self);
+void         dropbox_stat_store_set_filter (DBStatStore *self, 
+               DBStatFilterFn filter, void *user);
+BOOL         dropbox_stat_store_wants (const DBStatStore *self, 
+               const DBStat *stat);
+uint32_t     dropbox_stat_store_length (const DBStatStore *self);
+DBStat      *dropbox_stat_store_get (const DBStatStore *self, uint32_t index);
+
@@ -20,5 +20,7 @@ GPL v3.0
 #define ERROR_DOWNLOAD "Can't download from server"
 #define ERROR_UPLOAD "Can't upload to server"
 #define ERROR_CANTUSAGE "Can't get usage information from server"
+#define ERROR_NOTLOCALDIR "Local path must be an existing directory"
+#define ERROR_LONGPOLL "Can't wait for changes on server"
 
 
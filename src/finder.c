@@ -0,0 +1,252 @@
+/*---------------------------------------------------------------------------
+dbcmd
+finder.c
+GPL v3.0
+
+Collects the entries on the server that might match a filename pattern,
+for the caller to check, usually with a filter on the store that keeps 
+what finder_matches() accepts. Normally that means listing the
+whole tree. But when the pattern starts with a few literal characters,
+as in "report-2024*.pdf", the server's search can find the candidates
+instead, which, in a tree of a million files, takes a few requests
+rather than hundreds.
+
+The search matches words, and the beginnings of words, in the names of
+files and folders, ignoring case, so searching for the literal start of
+the pattern finds every name that the pattern could match, and some that
+it won't. A file can also be selected because the folder it is in
+matches the pattern, so every folder that matches is listed in full.
+So is every folder whose name starts with the query: get matches the
+pattern against the whole path as well, where a '*' crosses '/', so
+"rep*.txt" selects report/a.txt, and a search must find what a listing
+would.
+
+In automatic mode, the first page of the listing is fetched; if that is
+all there is, it is used, and the search is only made for a tree that
+runs to more pages. The server's search index can lag a little behind
+recent changes, so a file that was added moments ago might not be
+found; FINDER_SEARCH_NEVER always lists.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "finder.h"
+#include "hashindex.h"
+#include "list.h"
+#include "log.h"
+#include "matcher.h"
+
+// A pattern must start with at least this many literal characters for
+//   a search to narrow things down usefully
+#define FINDER_MIN_QUERY 3
+
+typedef struct _FinderState
+  {
+  Matcher *spec;
+  const char *query;
+  DBStatStore *store;   // The caller's
+  DBStatStore *found;   // Our own, of everything the server sent
+  BOOL include_dirs;
+  BOOL expanding;       // Listing matching folders, not searching
+  HashIndex *seen;      // Lower-case paths already passed on
+  List *folders;        // Matching folders to list, of strings
+  DBPageFunc pf;
+  void *user;
+  } FinderState;
+
+
+/*---------------------------------------------------------------------------
+finder_parse_search
+Parse the argument of --search. Returns FALSE if it isn't recognized
+---------------------------------------------------------------------------*/
+BOOL finder_parse_search (const char *s, FinderSearch *search)
+  {
+  if (strcmp (s, "auto") == 0)
+    *search = FINDER_SEARCH_AUTO;
+  else if (strcmp (s, "always") == 0)
+    *search = FINDER_SEARCH_ALWAYS;
+  else if (strcmp (s, "never") == 0)
+    *search = FINDER_SEARCH_NEVER;
+  else
+    return FALSE;
+  return TRUE;
+  }
+
+
+/*---------------------------------------------------------------------------
+finder_matches
+A DBStatFilterFn that keeps the entries whose path, or name, matches
+the Matcher that is passed as user
+---------------------------------------------------------------------------*/
+BOOL finder_matches (const DBStat *stat, void *user)
+  {
+  Matcher *spec = user;
+  return matcher_match (spec, dropbox_stat_get_path (stat))
+    || matcher_match (spec, dropbox_stat_get_name (stat));
+  }
+
+
+/*---------------------------------------------------------------------------
+finder_get_query
+The literal characters at the start of a pattern, or NULL if there are
+too few of them. Quotes and backslashes end the query, as well as
+wildcards, so it needs no escaping. Caller frees the result
+---------------------------------------------------------------------------*/
+static char *finder_get_query (const char *spec)
+  {
+  size_t len = strcspn (spec, "*?[\\\"");
+  if (len < FINDER_MIN_QUERY) return NULL;
+  return strndup (spec, len);
+  }
+
+
+/*---------------------------------------------------------------------------
+finder_page
+Called with each page of search results, or of the listing of a
+matching folder, in a store of our own. Entries that haven't been seen
+before, and that the caller's store wants, are copied to it, and passed
+on to the caller
+---------------------------------------------------------------------------*/
+static void finder_page (const DBStatStore *found, uint32_t first,
+    uint32_t count, void *user)
+  {
+  FinderState *state = user;
+  uint32_t start = dropbox_stat_store_length (state->store);
+  uint32_t i;
+  for (i = first; i < first + count; i++)
+    {
+    const DBStat *stat = dropbox_stat_store_get (found, i);
+    const char *lower = dropbox_stat_get_path_lower (stat);
+    if (hashindex_get (state->seen, lower, strlen (lower))) continue;
+    hashindex_put (state->seen, lower, strlen (lower), (void *)stat, FALSE);
+    if (dropbox_stat_get_type (stat) == DBSTAT_FOLDER)
+      {
+      const char *name = dropbox_stat_get_name (stat);
+      if (!state->expanding && (matcher_match (state->spec, name)
+           || strncasecmp (name, state->query, strlen (state->query)) == 0))
+        list_append (state->folders, strdup (lower));
+      if (!state->include_dirs) continue;
+      }
+    if (dropbox_stat_store_wants (state->store, stat))
+      dropbox_stat_store_add_copy (state->store, stat);
+    }
+  uint32_t added = dropbox_stat_store_length (state->store) - start;
+  if (state->pf && added > 0)
+    state->pf (state->store, start, added, state->user);
+  }
+
+
+/*---------------------------------------------------------------------------
+finder_compare_strings
+---------------------------------------------------------------------------*/
+static int finder_compare_strings (const void *p1, const void *p2)
+  {
+  return strcmp (p1, p2);
+  }
+
+
+/*---------------------------------------------------------------------------
+finder_search
+Search for query, and then list each folder that the search found, and
+that matches the pattern, or starts with query, unless it is inside 
+another one
+---------------------------------------------------------------------------*/
+static void finder_search (const char *token, const char *path,
+    const char *query, FinderState *state, int list_jobs, char **error)
+  {
+  dropbox_search (token, path, query, state->found, TRUE, finder_page, 
+    state, error);
+
+  list_sort (state->folders, finder_compare_strings);
+  state->expanding = TRUE;
+  const char *last = NULL;
+  int i, l = list_length (state->folders);
+  for (i = 0; i < l && *error == NULL; i++)
+    {
+    const char *folder = list_get (state->folders, i);
+    size_t ll = last ? strlen (last) : 0;
+    if (last && strncmp (folder, last, ll) == 0 && folder[ll] == '/')
+      continue;
+    last = folder;
+    log_debug ("Listing '%s', which matches the pattern", folder);
+    dropbox_list_parallel (token, folder, state->found, TRUE, TRUE, 
+      list_jobs, finder_page, state, error);
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+finder_find
+Add to store everything under path that might match spec, which is a
+pattern for a single pathname element. If recursive is FALSE, or the
+pattern doesn't suit a search, this is a listing of path, as from
+dropbox_list_parallel(); otherwise, search decides whether to use the
+server's search instead. pf, if not NULL, is called as entries are
+added, on the calling thread
+---------------------------------------------------------------------------*/
+void finder_find (const char *token, const char *path, const char *spec,
+    DBStatStore *store, BOOL include_dirs, BOOL recursive,
+    int list_jobs, FinderSearch search, DBPageFunc pf, void *user,
+    char **error)
+  {
+  char *query = recursive && search != FINDER_SEARCH_NEVER
+    ? finder_get_query (spec) : NULL;
+  if (!query)
+    {
+    dropbox_list_parallel (token, path, store, include_dirs, recursive,
+      list_jobs, pf, user, error);
+    return;
+    }
+
+  FinderState state;
+  memset (&state, 0, sizeof (FinderState));
+  state.spec = matcher_create (spec);
+  state.query = query;
+  state.store = store;
+  state.found = dropbox_stat_store_create ();
+  state.include_dirs = include_dirs;
+  state.seen = hashindex_create ();
+  state.folders = list_create (free);
+  state.pf = pf;
+  state.user = user;
+
+  BOOL use_search = TRUE;
+  if (search == FINDER_SEARCH_AUTO)
+    {
+    use_search = dropbox_list_is_long (token, path, state.found, TRUE, 
+      TRUE, error);
+    // A tree that fits in one page has been listed already
+    if (!use_search && *error == NULL)
+      {
+      state.expanding = TRUE;
+      finder_page (state.found, 0, dropbox_stat_store_length (state.found),
+        &state);
+      }
+    }
+
+  if (use_search && *error == NULL)
+    {
+    log_debug ("Searching '%s' for '%s'", path, query);
+    finder_search (token, path, query, &state, list_jobs, error);
+    if (*error)
+      {
+      // Whatever was found already is not passed on again
+      log_warning ("Can't search '%s', so listing it: %s", path, *error);
+      free (*error);
+      *error = NULL;
+      state.expanding = TRUE;
+      dropbox_list_parallel (token, path, state.found, TRUE, TRUE, 
+        list_jobs, finder_page, &state, error);
+      }
+    }
+
+  dropbox_stat_store_destroy (state.found);
+  matcher_destroy (state.spec);
+  list_destroy (state.folders);
+  hashindex_destroy (state.seen);
+  free (query);
+  }
+
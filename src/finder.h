@@ -0,0 +1,28 @@
+/*---------------------------------------------------------------------------
+dbcmd
+finder.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bool.h"
+#include "dropbox.h"
+#include "dropbox_stat.h"
+
+// Whether to use the server's search, rather than a listing, to find
+//   the files in a tree whose names match a pattern
+typedef enum
+  {
+  FINDER_SEARCH_AUTO,   // When the tree turns out to be large
+  FINDER_SEARCH_ALWAYS, // Whenever the pattern allows it
+  FINDER_SEARCH_NEVER
+  } FinderSearch;
+
+BOOL finder_parse_search (const char *s, FinderSearch *search);
+BOOL finder_matches (const DBStat *stat, void *user);
+void finder_find (const char *token, const char *path, const char *spec,
+       DBStatStore *store, BOOL include_dirs, BOOL recursive,
+       int list_jobs, FinderSearch search, DBPageFunc pf, void *user,
+       char **error);
+
@@ -0,0 +1,216 @@
+/*---------------------------------------------------------------------------
+dbcmd
+hashindex.c
+GPL v3.0
+
+An open-addressing (linear probing) hash table, mapping arbitrary byte
+strings to pointers. Keys are either copied into the index's own arena,
+or referenced in place, in which case the caller must keep them valid
+for the lifetime of the index. Removed entries leave a tombstone, which
+is reused by later insertions, and cleared when the table is resized.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashindex.h"
+#include "arena.h"
+
+#define HASHINDEX_INITIAL_SLOTS 64
+
+// The table is grown when live entries plus tombstones exceed this
+//   proportion (in percent) of the slots
+#define HASHINDEX_MAX_LOAD 70
+
+typedef struct _HashSlot
+  {
+  uint64_t hash;   // Zero means the slot has never been used
+  const void *key; // NULL, with a non-zero hash, marks a tombstone
+  size_t keylen;
+  void *value;
+  } HashSlot;
+
+struct _HashIndex
+  {
+  HashSlot *slots;
+  uint32_t nslots; // Always a power of two
+  uint32_t length;
+  uint32_t tombstones;
+  Arena *keys;
+  };
+
+
+/*---------------------------------------------------------------------------
+hashindex_hash
+FNV-1a. The result is never zero, as zero marks an empty slot
+---------------------------------------------------------------------------*/
+static uint64_t hashindex_hash (const void *key, size_t keylen)
+  {
+  const unsigned char *p = key;
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < keylen; i++)
+    {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+    }
+  return h ? h : 1;
+  }
+
+
+/*---------------------------------------------------------------------------
+hashindex_create
+---------------------------------------------------------------------------*/
+HashIndex *hashindex_create (void)
+  {
+  HashIndex *self = malloc (sizeof (HashIndex));
+  memset (self, 0, sizeof (HashIndex));
+  self->nslots = HASHINDEX_INITIAL_SLOTS;
+  self->slots = calloc (self->nslots, sizeof (HashSlot));
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+hashindex_destroy
+---------------------------------------------------------------------------*/
+void hashindex_destroy (HashIndex *self)
+  {
+  if (!self) return;
+  free (self->slots);
+  if (self->keys) arena_destroy (self->keys);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+hashindex_find_slot
+Returns the slot holding the key, or NULL
+---------------------------------------------------------------------------*/
+static HashSlot *hashindex_find_slot (const HashIndex *self,
+    const void *key, size_t keylen, uint64_t hash)
+  {
+  uint32_t mask = self->nslots - 1;
+  uint32_t i = (uint32_t)hash & mask;
+  while (self->slots[i].hash != 0)
+    {
+    HashSlot *slot = &self->slots[i];
+    if (slot->hash == hash && slot->key && slot->keylen == keylen
+          && memcmp (slot->key, key, keylen) == 0)
+      return slot;
+    i = (i + 1) & mask;
+    }
+  return NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+hashindex_resize
+---------------------------------------------------------------------------*/
+static void hashindex_resize (HashIndex *self, uint32_t nslots)
+  {
+  HashSlot *old = self->slots;
+  uint32_t old_nslots = self->nslots;
+  self->slots = calloc (nslots, sizeof (HashSlot));
+  self->nslots = nslots;
+  self->tombstones = 0;
+  uint32_t mask = nslots - 1;
+  uint32_t i;
+  for (i = 0; i < old_nslots; i++)
+    {
+    if (old[i].hash == 0 || old[i].key == NULL) continue;
+    uint32_t j = (uint32_t)old[i].hash & mask;
+    while (self->slots[j].hash != 0)
+      j = (j + 1) & mask;
+    self->slots[j] = old[i];
+    }
+  free (old);
+  }
+
+
+/*---------------------------------------------------------------------------
+hashindex_put
+Adds a key, or replaces the value of an existing one
+---------------------------------------------------------------------------*/
+void hashindex_put (HashIndex *self, const void *key, size_t keylen,
+       void *value, BOOL copy_key)
+  {
+  uint64_t hash = hashindex_hash (key, keylen);
+  HashSlot *slot = hashindex_find_slot (self, key, keylen, hash);
+  if (slot)
+    {
+    slot->value = value;
+    return;
+    }
+
+  if ((uint64_t)(self->length + self->tombstones + 1) * 100
+        > (uint64_t)self->nslots * HASHINDEX_MAX_LOAD)
+    {
+    uint32_t nslots = self->nslots;
+    // Only grow if it's live entries, not tombstones, that fill the table
+    if ((uint64_t)(self->length + 1) * 100 * 2
+          > (uint64_t)nslots * HASHINDEX_MAX_LOAD)
+      nslots *= 2;
+    hashindex_resize (self, nslots);
+    }
+
+  if (copy_key)
+    {
+    if (!self->keys) self->keys = arena_create (ARENA_BLOCK_SIZE);
+    void *copy = arena_alloc (self->keys, keylen);
+    memcpy (copy, key, keylen);
+    key = copy;
+    }
+
+  uint32_t mask = self->nslots - 1;
+  uint32_t i = (uint32_t)hash & mask;
+  while (self->slots[i].hash != 0 && self->slots[i].key != NULL)
+    i = (i + 1) & mask;
+  if (self->slots[i].hash != 0) self->tombstones--;
+  self->slots[i].hash = hash;
+  self->slots[i].key = key;
+  self->slots[i].keylen = keylen;
+  self->slots[i].value = value;
+  self->length++;
+  }
+
+
+/*---------------------------------------------------------------------------
+hashindex_get
+Returns NULL if the key is not present
+---------------------------------------------------------------------------*/
+void *hashindex_get (const HashIndex *self, const void *key, size_t keylen)
+  {
+  if (!self) return NULL;
+  HashSlot *slot = hashindex_find_slot (self, key, keylen,
+    hashindex_hash (key, keylen));
+  return slot ? slot->value : NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+hashindex_remove
+Returns TRUE if the key was present
+---------------------------------------------------------------------------*/
+BOOL hashindex_remove (HashIndex *self, const void *key, size_t keylen)
+  {
+  HashSlot *slot = hashindex_find_slot (self, key, keylen,
+    hashindex_hash (key, keylen));
+  if (!slot) return FALSE;
+  slot->key = NULL; // Leaves a tombstone; hash stays non-zero
+  slot->value = NULL;
+  self->length--;
+  self->tombstones++;
+  return TRUE;
+  }
+
+
+/*---------------------------------------------------------------------------
+hashindex_length
+---------------------------------------------------------------------------*/
+uint32_t hashindex_length (const HashIndex *self)
+  {
+  return self ? self->length : 0;
+  }
+
@@ -0,0 +1,25 @@
+/*---------------------------------------------------------------------------
+dbcmd
+hashindex.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bool.h"
+
+struct _HashIndex;
+typedef struct _HashIndex HashIndex;
+
+HashIndex *hashindex_create (void);
+void       hashindex_destroy (HashIndex *self);
+void       hashindex_put (HashIndex *self, const void *key, size_t keylen,
+             void *value, BOOL copy_key);
+void      *hashindex_get (const HashIndex *self, const void *key,
+             size_t keylen);
+BOOL       hashindex_remove (HashIndex *self, const void *key,
+             size_t keylen);
+uint32_t   hashindex_length (const HashIndex *self);
+
@@ -0,0 +1,388 @@
+/*---------------------------------------------------------------------------
+dbcmd
+journal.c
+GPL v3.0
+
+A record of the files that a recursive get or put has finished with, so
+that an interrupted run can be resumed without checking them all again.
+Each operation has its own journal file, named after a hash of a key
+made from the command and its arguments. The file starts with a line
+that holds the key itself, followed by one line for each file:
+
+  size<TAB>mtime<TAB>hash<TAB>path
+
+where size and mtime are those of the local file when the transfer
+completed, and hash is the content hash, in hex, or "-" if it wasn't
+needed. The path comes last, so it may contain tabs.
+
+Each line is appended with a single write(), so a crash of the program
+loses nothing that was recorded; the file is flushed to disk every
+JOURNAL_SYNC_RECORDS lines, so a crash of the system loses at most
+that many. A torn last line is ignored when the journal is read. A file
+may be recorded more than once; the last record wins. When the run
+ends, the journal is either removed, if everything was done, or
+rewritten with one line per file.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "hashindex.h"
+#include "arena.h"
+#include "list.h"
+#include "log.h"
+
+#define DIRNAME ".dbcmd_journals"
+#define JOURNAL_MAGIC "dbcmd-journal-1"
+#define JOURNAL_SYNC_RECORDS 64
+
+typedef struct _JournalRecord
+  {
+  const char *path;
+  JournalEntry entry;
+  } JournalRecord;
+
+struct _Journal
+  {
+  char *key;
+  char *filename;
+  int fd;
+  int unsynced;
+  Arena *arena;       // Records and their paths
+  List *records;      // Of JournalRecord, in the order first seen
+  HashIndex *index;   // Path to JournalRecord
+  int loaded;
+  pthread_mutex_t mutex;
+  };
+
+
+/*---------------------------------------------------------------------------
+journal_get_filename
+The name of the journal for a key: an FNV-1a hash of the key, in hex
+---------------------------------------------------------------------------*/
+static char *journal_get_filename (const char *key)
+  {
+  uint64_t h = 14695981039346656037ULL;
+  const unsigned char *p;
+  for (p = (const unsigned char *)key; *p; p++)
+    {
+    h ^= *p;
+    h *= 1099511628211ULL;
+    }
+  char *ret = NULL;
+  asprintf (&ret, "%s/" DIRNAME "/%016llx", getenv ("HOME"),
+    (unsigned long long)h);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_set
+Add or replace the record for a path. Call with the mutex held, or
+before anyone else can see the journal
+---------------------------------------------------------------------------*/
+static void journal_set (Journal *self, const char *path,
+    const JournalEntry *entry)
+  {
+  JournalRecord *r = hashindex_get (self->index, path, strlen (path));
+  if (!r)
+    {
+    r = arena_alloc (self->arena, sizeof (JournalRecord));
+    r->path = arena_strdup (self->arena, path);
+    list_append (self->records, r);
+    hashindex_put (self->index, r->path, strlen (r->path), r, FALSE);
+    }
+  r->entry = *entry;
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_format
+Returns a journal line, which the caller must free
+---------------------------------------------------------------------------*/
+static char *journal_format (const char *path, const JournalEntry *entry)
+  {
+  char hex [DBHASH_LENGTH];
+  if (entry->has_hash)
+    dropbox_hash_to_hex (entry->hash, hex);
+  else
+    strcpy (hex, "-");
+  char *ret = NULL;
+  asprintf (&ret, "%lld\t%lld\t%s\t%s\n", (long long)entry->size,
+    (long long)entry->mtime, hex, path);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_parse
+Parse one line, without its newline, into a path and an entry. Returns
+FALSE if the line is malformed
+---------------------------------------------------------------------------*/
+static BOOL journal_parse (char *s, const char **path, JournalEntry *entry)
+  {
+  char *f[3];
+  int i;
+  for (i = 0; i < 3; i++)
+    {
+    f[i] = s;
+    s = strchr (s, '\t');
+    if (!s) return FALSE;
+    *s++ = 0;
+    }
+  if (!*s) return FALSE;
+  char *end;
+  entry->size = strtoll (f[0], &end, 10);
+  if (*end || end == f[0]) return FALSE;
+  entry->mtime = (time_t)strtoll (f[1], &end, 10);
+  if (*end || end == f[1]) return FALSE;
+  if (strcmp (f[2], "-") == 0)
+    entry->has_hash = FALSE;
+  else if (dropbox_hash_from_hex (f[2], entry->hash))
+    entry->has_hash = TRUE;
+  else
+    return FALSE;
+  *path = s;
+  return TRUE;
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_load
+Read the records left by an earlier run with the same key
+---------------------------------------------------------------------------*/
+static void journal_load (Journal *self)
+  {
+  FILE *f = fopen (self->filename, "r");
+  if (!f) return;
+
+  char *s = NULL;
+  size_t n = 0;
+  ssize_t len = getline (&s, &n, f);
+  size_t keylen = strlen (self->key);
+  if (len > 0 && strncmp (s, JOURNAL_MAGIC "\t",
+       sizeof (JOURNAL_MAGIC)) == 0
+      && strncmp (s + sizeof (JOURNAL_MAGIC), self->key, keylen) == 0
+      && s [sizeof (JOURNAL_MAGIC) + keylen] == '\n')
+    {
+    while ((len = getline (&s, &n, f)) > 0)
+      {
+      // A line without a newline was being written when we stopped
+      if (s[len - 1] != '\n') break;
+      s[len - 1] = 0;
+      const char *path;
+      JournalEntry entry;
+      if (journal_parse (s, &path, &entry))
+        journal_set (self, path, &entry);
+      }
+    }
+  else if (len > 0)
+    log_warning ("Ignoring journal %s, which belongs to another operation",
+      self->filename);
+
+  free (s);
+  fclose (f);
+  self->loaded = list_length (self->records);
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_write_all
+Write the header, and then every record, to fd. Returns FALSE on error
+---------------------------------------------------------------------------*/
+static BOOL journal_write_all (Journal *self, int fd)
+  {
+  FILE *f = fdopen (dup (fd), "w");
+  if (!f) return FALSE;
+  fprintf (f, JOURNAL_MAGIC "\t%s\n", self->key);
+  int i, l = list_length (self->records);
+  for (i = 0; i < l; i++)
+    {
+    const JournalRecord *r = list_get (self->records, i);
+    char *line = journal_format (r->path, &r->entry);
+    fputs (line, f);
+    free (line);
+    }
+  BOOL ok = (fflush (f) == 0 && fdatasync (fd) == 0);
+  if (fclose (f) != 0) ok = FALSE;
+  return ok;
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_free
+---------------------------------------------------------------------------*/
+static void journal_free (Journal *self)
+  {
+  hashindex_destroy (self->index);
+  list_destroy (self->records);
+  arena_destroy (self->arena);
+  pthread_mutex_destroy (&self->mutex);
+  free (self->filename);
+  free (self->key);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_open
+Open the journal for an operation identified by key. If resume is TRUE,
+the records of an earlier run are read, and kept; otherwise, they are
+thrown away. Returns NULL if there can't be a journal, which the caller
+should treat as a journal with nothing in it
+---------------------------------------------------------------------------*/
+Journal *journal_open (const char *key, BOOL resume)
+  {
+  if (strchr (key, '\n'))
+    {
+    log_warning ("Can't keep a journal for a pathname containing a newline");
+    return NULL;
+    }
+
+  char *dir = NULL;
+  asprintf (&dir, "%s/" DIRNAME, getenv ("HOME"));
+  mkdir (dir, 0700);
+  free (dir);
+
+  Journal *self = malloc (sizeof (Journal));
+  memset (self, 0, sizeof (Journal));
+  self->key = strdup (key);
+  self->filename = journal_get_filename (key);
+  self->arena = arena_create (ARENA_BLOCK_SIZE);
+  self->records = list_create (NULL);
+  self->index = hashindex_create ();
+  pthread_mutex_init (&self->mutex, NULL);
+
+  if (resume)
+    journal_load (self);
+
+  // Start again with a clean copy of whatever was loaded, so that a torn
+  //   line at the end of the old file doesn't run into our first record
+  self->fd = open (self->filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (self->fd < 0 || !journal_write_all (self, self->fd))
+    {
+    log_warning ("Can't write journal %s: %s", self->filename,
+      strerror (errno));
+    if (self->fd >= 0) close (self->fd);
+    journal_free (self);
+    return NULL;
+    }
+  // Appending from here on
+  lseek (self->fd, 0, SEEK_END);
+
+  if (self->loaded > 0)
+    log_info ("Resuming: %d file(s) already done", self->loaded);
+  log_debug ("Journal is %s", self->filename);
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_find
+If the path was recorded, fill in entry, and return TRUE. Paths recorded
+in this run are found, as well as those from the earlier one
+---------------------------------------------------------------------------*/
+BOOL journal_find (Journal *self, const char *path, JournalEntry *entry)
+  {
+  if (!self) return FALSE;
+  pthread_mutex_lock (&self->mutex);
+  const JournalRecord *r = hashindex_get (self->index, path, strlen (path));
+  if (r) *entry = r->entry;
+  pthread_mutex_unlock (&self->mutex);
+  return r != NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_record
+Record that a file is done. hash may be NULL, if it isn't known. May be
+called from any thread
+---------------------------------------------------------------------------*/
+void journal_record (Journal *self, const char *path, int64_t size,
+    time_t mtime, const unsigned char *hash)
+  {
+  if (!self) return;
+  if (strchr (path, '\n'))
+    {
+    log_debug ("Not journalling %s, which contains a newline", path);
+    return;
+    }
+
+  JournalEntry entry;
+  entry.size = size;
+  entry.mtime = mtime;
+  entry.has_hash = (hash != NULL);
+  if (hash) memcpy (entry.hash, hash, DBHASH_RAW_LENGTH);
+  char *line = journal_format (path, &entry);
+  size_t len = strlen (line);
+
+  pthread_mutex_lock (&self->mutex);
+  journal_set (self, path, &entry);
+  if (write (self->fd, line, len) != (ssize_t)len)
+    log_debug ("Can't write to journal: %s", strerror (errno));
+  if (++self->unsynced == JOURNAL_SYNC_RECORDS)
+    {
+    fdatasync (self->fd);
+    self->unsynced = 0;
+    }
+  pthread_mutex_unlock (&self->mutex);
+  free (line);
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_length
+The number of files recorded so far, in this run and the earlier one
+---------------------------------------------------------------------------*/
+int journal_length (Journal *self)
+  {
+  if (!self) return 0;
+  pthread_mutex_lock (&self->mutex);
+  int ret = list_length (self->records);
+  pthread_mutex_unlock (&self->mutex);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+journal_close
+If complete is TRUE, the operation finished, and there's nothing to
+resume, so the journal is removed. Otherwise it is compacted: rewritten,
+with one line per file, and renamed into place, so that a failure
+part-way through leaves the old contents intact
+---------------------------------------------------------------------------*/
+void journal_close (Journal *self, BOOL complete)
+  {
+  if (!self) return;
+  close (self->fd);
+
+  if (complete)
+    unlink (self->filename);
+  else
+    {
+    char *tempname = NULL;
+    asprintf (&tempname, "%s.tmp", self->filename);
+    int fd = open (tempname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    BOOL ok = (fd >= 0 && journal_write_all (self, fd));
+    if (fd >= 0 && close (fd) != 0) ok = FALSE;
+    if (ok && rename (tempname, self->filename) == 0)
+      log_info ("Journal kept, with %d file(s) done; use --resume "
+        "to carry on", list_length (self->records));
+    else
+      {
+      log_warning ("Can't compact journal %s", self->filename);
+      unlink (tempname);
+      }
+    free (tempname);
+    }
+
+  journal_free (self);
+  }
+
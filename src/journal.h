@@ -0,0 +1,33 @@
+/*---------------------------------------------------------------------------
+dbcmd
+journal.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include "bool.h"
+#include "dropbox_stat.h"
+
+struct _Journal;
+typedef struct _Journal Journal;
+
+// What was recorded about a local file when its transfer completed
+typedef struct _JournalEntry
+  {
+  int64_t size;
+  time_t mtime;
+  BOOL has_hash;
+  unsigned char hash [DBHASH_RAW_LENGTH];
+  } JournalEntry;
+
+Journal *journal_open (const char *key, BOOL resume);
+void     journal_close (Journal *self, BOOL complete);
+BOOL     journal_find (Journal *self, const char *path,
+           JournalEntry *entry);
+void     journal_record (Journal *self, const char *path, int64_t size,
+           time_t mtime, const unsigned char *hash);
+int      journal_length (Journal *self);
+
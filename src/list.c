@@ -2,8 +2,15 @@
 dbcmd
 list.c
 Copyright (c)2017 Kevin Boone, GPLv3.0
+
+The list is a contiguous array of pointers, so list_get() is a constant-
+time operation, and appending is amortized constant-time. Locking is
+optional -- a list created by list_create_locked() takes a mutex for
+every operation, and can be shared between threads; one created by
+list_create() does not, and can't
 *==========================================================================*/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
@@ -11,19 +18,22 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 #include <pthread.h>
 #include "list.h"
 
-typedef struct _ListItem
-  {
-  struct _ListItem *next;
-  void *data;
-  } ListItem;
+#define LIST_INITIAL_CAPACITY 16
 
 struct _List
   {
   pthread_mutex_t mutex;
+  BOOL locked;
   ListItemFreeFn free_fn; 
-  ListItem *head;
+  void **items;
+  int length;
+  int capacity;
   };
 
+#define LIST_LOCK(self) if ((self)->locked) pthread_mutex_lock (&(self)->mutex)
+#define LIST_UNLOCK(self) if ((self)->locked) \
+   pthread_mutex_unlock (&(self)->mutex)
+
 /*==========================================================================
 list_create
 *==========================================================================*/
@@ -32,6 +42,16 @@ List *list_create (ListItemFreeFn free_fn)
   List *list = malloc (sizeof (List));
   memset (list, 0, sizeof (List));
   list->free_fn = free_fn;
+  return list;
+  }
+
+/*==========================================================================
+list_create_locked
+*==========================================================================*/
+List *list_create_locked (ListItemFreeFn free_fn)
+  {
+  List *list = list_create (free_fn);
+  list->locked = TRUE;
   pthread_mutex_init (&list->mutex, NULL);
   return list;
   }
@@ -45,29 +65,53 @@ List *list_create_strings (void)
   }
 
 /*==========================================================================
-list_destroy
+list_clear
+Removes, and frees, all items
 *==========================================================================*/
-void list_destroy (List *self)
+void list_clear (List *self)
   {
   if (!self) return;
 
-  pthread_mutex_lock (&self->mutex);
-  ListItem *l = self->head;
-  while (l)
+  LIST_LOCK (self);
+  int i;
+  if (self->free_fn)
     {
-    if (self->free_fn)
-      self->free_fn (l->data);
-    ListItem *temp = l;
-    l = l->next;
-    free (temp);
+    for (i = 0; i < self->length; i++)
+      self->free_fn (self->items[i]);
     }
+  self->length = 0;
+  LIST_UNLOCK (self);
+  }
+
+/*==========================================================================
+list_destroy
+*==========================================================================*/
+void list_destroy (List *self)
+  {
+  if (!self) return;
 
-  pthread_mutex_unlock (&self->mutex);
-  pthread_mutex_destroy (&self->mutex);
+  list_clear (self);
+  if (self->locked)
+    pthread_mutex_destroy (&self->mutex);
+  free (self->items);
   free (self);
   }
 
 
+/*==========================================================================
+list_ensure_capacity
+Must be called with the lock held
+*==========================================================================*/
+static void list_ensure_capacity (List *self, int needed)
+  {
+  if (needed <= self->capacity) return;
+  int capacity = self->capacity ? self->capacity : LIST_INITIAL_CAPACITY;
+  while (capacity < needed) capacity *= 2;
+  self->items = realloc (self->items, capacity * sizeof (void *));
+  self->capacity = capacity;
+  }
+
+
 /*==========================================================================
 list_prepend
 Note that the caller must not modify or free the item added to the list. It
@@ -76,21 +120,12 @@ the supplied free function
 *==========================================================================*/
 void list_prepend (List *self, void *item)
   {
-  pthread_mutex_lock (&self->mutex);
-  ListItem *i = malloc (sizeof (ListItem));
-  i->data = item;
-  i->next = NULL;
-
-  if (self->head)
-    {
-    i->next = self->head;
-    self->head = i;
-    }
-  else
-    {
-    self->head = i;
-    }
-  pthread_mutex_unlock (&self->mutex);
+  LIST_LOCK (self);
+  list_ensure_capacity (self, self->length + 1);
+  memmove (self->items + 1, self->items, self->length * sizeof (void *));
+  self->items[0] = item;
+  self->length++;
+  LIST_UNLOCK (self);
   }
 
 
@@ -102,23 +137,11 @@ the supplied free function
 *==========================================================================*/
 void list_append (List *self, void *item)
   {
-  pthread_mutex_lock (&self->mutex);
-  ListItem *i = malloc (sizeof (ListItem));
-  i->data = item;
-  i->next = NULL;
-
-  if (self->head)
-    {
-    ListItem *l = self->head;
-    while (l->next)
-      l = l->next;
-    l->next = i;
-    }
-  else
-    {
-    self->head = i;
-    }
-  pthread_mutex_unlock (&self->mutex);
+  LIST_LOCK (self);
+  list_ensure_capacity (self, self->length + 1);
+  self->items[self->length] = item;
+  self->length++;
+  LIST_UNLOCK (self);
   }
 
 
@@ -129,17 +152,10 @@ int list_length (List *self)
   {
   if (!self) return 0;
 
-  pthread_mutex_lock (&self->mutex);
-  ListItem *l = self->head;
-  int i = 0;
-  while (l != NULL)
-    {
-    l = l->next;
-    i++;
-    }
-
-  pthread_mutex_unlock (&self->mutex);
-  return i;
+  LIST_LOCK (self);
+  int ret = self->length;
+  LIST_UNLOCK (self);
+  return ret;
   }
 
 /*==========================================================================
@@ -149,17 +165,13 @@ void *list_get (List *self, int index)
   {
   if (!self) return NULL;
 
-  pthread_mutex_lock (&self->mutex);
-  ListItem *l = self->head;
-  int i = 0;
-  while (l != NULL && i != index)
-    {
-    l = l->next;
-    i++;
-    }
-  pthread_mutex_unlock (&self->mutex);
+  void *ret = NULL;
+  LIST_LOCK (self);
+  if (index >= 0 && index < self->length)
+    ret = self->items[index];
+  LIST_UNLOCK (self);
 
-  return l->data;
+  return ret;
   }
 
 
@@ -183,15 +195,14 @@ list_contains
 BOOL list_contains (List *self, const void *item, ListCompareFn fn)
   {
   if (!self) return FALSE;
-  pthread_mutex_lock (&self->mutex);
-  ListItem *l = self->head;
+  LIST_LOCK (self);
   BOOL found = FALSE;
-  while (l != NULL && !found)
+  int i;
+  for (i = 0; i < self->length && !found; i++)
     {
-    if (fn (l->data, item) == 0) found = TRUE; 
-    l = l->next;
+    if (fn (self->items[i], item) == 0) found = TRUE; 
     }
-  pthread_mutex_unlock (&self->mutex);
+  LIST_UNLOCK (self);
   return found; 
   }
 
@@ -216,33 +227,22 @@ to copy the item first.
 void list_remove (List *self, const void *item, ListCompareFn fn)
   {
   if (!self) return;
-  pthread_mutex_lock (&self->mutex);
-  ListItem *l = self->head;
-  ListItem *last_good = NULL;
-  while (l != NULL)
+  LIST_LOCK (self);
+  int i, j = 0;
+  for (i = 0; i < self->length; i++)
     {
-    if (fn (l->data, item) == 0)
+    if (fn (self->items[i], item) == 0)
       {
-      if (l == self->head)
-        {
-        self->head = l->next; // l-> next might be null
-        }
-      else
-        {
-        if (last_good) last_good->next = l->next;
-        }
-      self->free_fn (l->data);  
-      ListItem *temp = l->next;
-      free (l);
-      l = temp;
-      } 
+      if (self->free_fn) self->free_fn (self->items[i]);  
+      }
     else
       {
-      last_good = l;
-      l = l->next;
+      self->items[j] = self->items[i];
+      j++;
       }
     }
-  pthread_mutex_unlock (&self->mutex);
+  self->length = j;
+  LIST_UNLOCK (self);
   }
 
 /*==========================================================================
@@ -261,19 +261,46 @@ List *list_clone (List *self, ListCopyFn copyFn)
   {
   ListItemFreeFn free_fn = self->free_fn; 
   List *new = list_create (free_fn);
-
-  pthread_mutex_lock (&self->mutex);
-  ListItem *l = self->head;
-  while (l != NULL)
-    {
-    void *data = copyFn (l->data);
-    list_append (new, data);
-    l = l->next;
-    }
-  pthread_mutex_unlock (&self->mutex);
+  new->locked = self->locked;
+  if (new->locked)
+    pthread_mutex_init (&new->mutex, NULL);
+
+  LIST_LOCK (self);
+  list_ensure_capacity (new, self->length);
+  int i;
+  for (i = 0; i < self->length; i++)
+    new->items[i] = copyFn (self->items[i]);
+  new->length = self->length;
+  LIST_UNLOCK (self);
 
   return new;
   }
 
 
+/*==========================================================================
+list_sort_compare
+qsort() passes pointers to the array elements, but list comparison 
+functions take the items themselves
+*==========================================================================*/
+static int list_sort_compare (const void *p1, const void *p2, void *arg)
+  {
+  ListCompareFn fn = (ListCompareFn) arg;
+  return fn (*(void * const *)p1, *(void * const *)p2);
+  }
+
+
+/*==========================================================================
+list_sort
+Sorts the list in place. The comparison function is passed two items
+from the list, as it is for list_contains()
+*==========================================================================*/
+void list_sort (List *self, ListCompareFn fn)
+  {
+  if (!self) return;
+  LIST_LOCK (self);
+  if (self->length > 1)
+    qsort_r (self->items, self->length, sizeof (void *), 
+      list_sort_compare, (void *)fn);
+  LIST_UNLOCK (self);
+  }
 
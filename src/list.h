@@ -17,6 +17,7 @@ typedef void* (*ListCopyFn) (const void *orig);
 typedef void (*ListItemFreeFn) (void *);
 
 List *list_create (ListItemFreeFn free_fn);
+List *list_create_locked (ListItemFreeFn free_fn);
 void list_destroy (List *);
 void list_append (List *self, void *item);
 void list_prepend (List *self, void *item);
@@ -29,4 +30,6 @@ void list_remove (List *self, const void *item, ListCompareFn fn);
 void list_remove_string (List *self, const char *item);
 List *list_clone (List *self, ListCopyFn copyFn);
 List *list_create_strings (void);
+void list_sort (List *self, ListCompareFn fn);
+void list_clear (List *self);
 
@@ -0,0 +1,416 @@
+/*---------------------------------------------------------------------------
+dbcmd
+localwatch.c
+GPL v3.0
+
+Reports changes to local files using inotify. A watched directory 
+can be watched recursively, in which case subdirectories that are
+created later are watched as well. Changes are collected until there
+has been no activity for a while, so that a burst of writes results in
+each file being reported once.
+
+Paths are kept as a base and a path relative to it, because that is 
+how 'put' works out the corresponding remote path. Directories below
+a watched one that the include and exclude rules leave out are not
+watched, as the walk that uploads them would not go into them.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "localwatch.h"
+#include "hashindex.h"
+#include "log.h"
+
+#define LOCALWATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+typedef struct _WatchDir
+  {
+  int wd;
+  char *base;
+  char *relative; // "" for the base itself
+  char *only;     // If not NULL, only this name in the directory is watched
+  BOOL recursive;
+  struct _WatchDir *next; // Another watch with the same descriptor
+  } WatchDir;
+
+struct _LocalWatch
+  {
+  int fd;
+  const Rules *rules; // Or NULL
+  List *dirs;    // Owns the WatchDir objects
+  List *roots;   // The WatchDirs added by localwatch_add()
+  HashIndex *by_wd;
+  };
+
+
+/*---------------------------------------------------------------------------
+localwatch_dir_free
+---------------------------------------------------------------------------*/
+static void localwatch_dir_free (void *p)
+  {
+  WatchDir *w = p;
+  free (w->base);
+  free (w->relative);
+  free (w->only);
+  free (w);
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_change_free
+---------------------------------------------------------------------------*/
+static void localwatch_change_free (void *p)
+  {
+  LocalChange *c = p;
+  free (c->base);
+  free (c->relative);
+  free (c);
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_create
+rules, if not NULL, must last as long as the watch
+---------------------------------------------------------------------------*/
+LocalWatch *localwatch_create (const Rules *rules, char **error)
+  {
+  int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    {
+    asprintf (error, "Can't initialize inotify: %s", strerror (errno));
+    return NULL;
+    }
+  LocalWatch *self = malloc (sizeof (LocalWatch));
+  self->fd = fd;
+  self->rules = rules;
+  self->dirs = list_create (localwatch_dir_free);
+  self->roots = list_create (NULL);
+  self->by_wd = hashindex_create ();
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_destroy
+---------------------------------------------------------------------------*/
+void localwatch_destroy (LocalWatch *self)
+  {
+  if (!self) return;
+  close (self->fd);
+  hashindex_destroy (self->by_wd);
+  list_destroy (self->roots);
+  list_destroy (self->dirs);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_join
+---------------------------------------------------------------------------*/
+static char *localwatch_join (const char *dir, const char *name)
+  {
+  char *ret;
+  if (dir[0] == 0)
+    ret = strdup (name);
+  else
+    asprintf (&ret, "%s/%s", dir, name);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_add_dir
+Watch base/relative. If recursive, watch its subdirectories as well.
+Returns the new watch, or NULL if it couldn't be set up
+---------------------------------------------------------------------------*/
+static WatchDir *localwatch_add_dir (LocalWatch *self, const char *base, 
+    const char *relative, const char *only, BOOL recursive)
+  {
+  char *full = relative[0] ? localwatch_join (base, relative) 
+    : strdup (base);
+  int wd = inotify_add_watch (self->fd, full, LOCALWATCH_MASK);
+  if (wd < 0)
+    {
+    log_warning ("Can't watch '%s': %s", full, strerror (errno));
+    free (full);
+    return NULL;
+    }
+
+  WatchDir *w = malloc (sizeof (WatchDir));
+  w->wd = wd;
+  w->base = strdup (base);
+  w->relative = strdup (relative);
+  w->only = only ? strdup (only) : NULL;
+  w->recursive = recursive;
+  w->next = hashindex_get (self->by_wd, &wd, sizeof (int));
+  list_append (self->dirs, w);
+  hashindex_put (self->by_wd, &w->wd, sizeof (int), w, FALSE);
+  log_debug ("Watching '%s'", full);
+
+  if (recursive)
+    {
+    DIR *d = opendir (full);
+    if (d)
+      {
+      struct dirent *de;
+      while ((de = readdir (d)) != NULL)
+        {
+        if (strcmp (de->d_name, ".") == 0) continue;
+        if (strcmp (de->d_name, "..") == 0) continue;
+        BOOL is_dir = (de->d_type == DT_DIR);
+        if (de->d_type == DT_UNKNOWN)
+          {
+          struct stat sb;
+          char *path = localwatch_join (full, de->d_name);
+          is_dir = (lstat (path, &sb) == 0 && S_ISDIR (sb.st_mode));
+          free (path);
+          }
+        if (is_dir)
+          {
+          char *rel = localwatch_join (relative, de->d_name);
+          if (!rules_excluded (self->rules, rel, TRUE))
+            localwatch_add_dir (self, base, rel, NULL, TRUE);
+          free (rel);
+          }
+        }
+      closedir (d);
+      }
+    }
+  free (full);
+  return w;
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_add
+Watch base/relative, which may be a file or a directory. A file is 
+watched by watching its directory for changes to that name only.
+A directory is only watched if recursive is TRUE -- that is what 'put'
+needs, since it doesn't upload directories otherwise
+---------------------------------------------------------------------------*/
+void localwatch_add (LocalWatch *self, const char *base, 
+    const char *relative, BOOL recursive)
+  {
+  if (strcmp (relative, ".") == 0) relative = "";
+  char *full = relative[0] ? localwatch_join (base, relative) 
+    : strdup (base);
+  struct stat sb;
+  WatchDir *w = NULL;
+  if (stat (full, &sb) != 0)
+    log_warning ("Can't watch '%s': %s", full, strerror (errno));
+  else if (S_ISDIR (sb.st_mode))
+    {
+    if (recursive)
+      w = localwatch_add_dir (self, base, relative, NULL, TRUE);
+    }
+  else
+    {
+    // Watch the parent, for this name only
+    char *parent = strdup (relative);
+    char *p = strrchr (parent, '/');
+    const char *name = p ? p + 1 : relative;
+    if (p) *p = 0; else parent[0] = 0;
+    w = localwatch_add_dir (self, base, parent, name, FALSE);
+    free (parent);
+    }
+  if (w) list_append (self->roots, w);
+  free (full);
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_report
+Add a change to the list, unless it is already there
+---------------------------------------------------------------------------*/
+static void localwatch_report (List *changes, HashIndex *seen, 
+    const char *base, const char *relative, BOOL is_dir)
+  {
+  char *key = NULL;
+  asprintf (&key, "%s\t%s", base, relative);
+  if (!hashindex_get (seen, key, strlen (key)))
+    {
+    LocalChange *c = malloc (sizeof (LocalChange));
+    c->base = strdup (base);
+    c->relative = strdup (relative);
+    c->is_dir = is_dir;
+    list_append (changes, c);
+    hashindex_put (seen, key, strlen (key), c, TRUE);
+    }
+  free (key);
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_handle_event
+---------------------------------------------------------------------------*/
+static void localwatch_handle_event (LocalWatch *self, 
+    const struct inotify_event *ev, List *changes, HashIndex *seen)
+  {
+  if (ev->mask & IN_Q_OVERFLOW)
+    {
+    // We've lost track; report everything, and let the caller sort it out
+    log_warning ("Too many local changes to track -- rescanning");
+    int i, l = list_length (self->roots);
+    for (i = 0; i < l; i++)
+      {
+      WatchDir *w = list_get (self->roots, i);
+      const char *rel = w->relative;
+      char *tmp = NULL;
+      if (w->only) rel = tmp = localwatch_join (w->relative, w->only);
+      localwatch_report (changes, seen, w->base, rel, w->only == NULL);
+      free (tmp);
+      }
+    return;
+    }
+
+  WatchDir *w = hashindex_get (self->by_wd, &ev->wd, sizeof (int));
+  if (ev->mask & IN_IGNORED)
+    {
+    // The directory has gone. Its WatchDirs stay in the list, unused,
+    //   since descriptor numbers can be reused
+    hashindex_remove (self->by_wd, &ev->wd, sizeof (int));
+    return;
+    }
+  if (ev->len == 0) return;
+
+  for (; w != NULL; w = w->next)
+    {
+    if (w->only && strcmp (w->only, ev->name) != 0) continue;
+    char *rel = localwatch_join (w->relative, ev->name);
+    if (ev->mask & IN_ISDIR)
+      {
+      if (w->recursive && (ev->mask & (IN_CREATE | IN_MOVED_TO))
+          && !rules_excluded (self->rules, rel, TRUE))
+        {
+        // Files may already have been written into the new directory
+        //   before the watch is in place, so report the directory itself
+        localwatch_add_dir (self, w->base, rel, NULL, TRUE);
+        localwatch_report (changes, seen, w->base, rel, TRUE);
+        }
+      }
+    else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+      {
+      localwatch_report (changes, seen, w->base, rel, FALSE);
+      }
+    free (rel);
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_compare_changes
+---------------------------------------------------------------------------*/
+static int localwatch_compare_changes (const void *p1, const void *p2)
+  {
+  const LocalChange *c1 = p1, *c2 = p2;
+  int ret = strcmp (c1->base, c2->base);
+  if (ret == 0) ret = strcmp (c1->relative, c2->relative);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_now_ms
+---------------------------------------------------------------------------*/
+static int64_t localwatch_now_ms (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+
+/*---------------------------------------------------------------------------
+localwatch_wait
+Block until something changes, then keep collecting changes until there
+have been none for debounce_ms, or max_delay_ms has passed since the 
+first. Returns a list of LocalChange, sorted by path, which the caller
+must destroy. Files inside a directory that is itself reported are left
+out, since handling the directory will take care of them. Returns NULL 
+if the inotify descriptor fails.
+---------------------------------------------------------------------------*/
+List *localwatch_wait (LocalWatch *self, int debounce_ms, int max_delay_ms)
+  {
+  // Items are moved to the returned list, or freed, at the end
+  List *changes = list_create (NULL);
+  BOOL failed = FALSE;
+  HashIndex *seen = hashindex_create ();
+  int64_t first = 0;
+  char buf [16384] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+  while (TRUE)
+    {
+    int timeout = -1;
+    if (list_length (changes) > 0)
+      {
+      int64_t left = first + max_delay_ms - localwatch_now_ms ();
+      timeout = left < debounce_ms ? (int)left : debounce_ms;
+      if (timeout <= 0) break;
+      }
+
+    struct pollfd pfd = { self->fd, POLLIN, 0 };
+    int n = poll (&pfd, 1, timeout);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0)
+      {
+      log_error ("Can't read local changes: %s", strerror (errno));
+      failed = TRUE;
+      break;
+      }
+    if (n == 0) break; // Quiet for debounce_ms
+
+    ssize_t len;
+    while ((len = read (self->fd, buf, sizeof (buf))) > 0)
+      {
+      char *p;
+      for (p = buf; p < buf + len; )
+        {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        localwatch_handle_event (self, ev, changes, seen);
+        p += sizeof (struct inotify_event) + ev->len;
+        }
+      }
+    if (first == 0 && list_length (changes) > 0)
+      first = localwatch_now_ms ();
+    }
+
+  hashindex_destroy (seen);
+
+  // Drop anything under a directory that is in the list
+  list_sort (changes, localwatch_compare_changes);
+  List *ret = failed ? NULL : list_create (localwatch_change_free);
+  const LocalChange *dir = NULL;
+  int i, l = list_length (changes);
+  for (i = 0; i < l; i++)
+    {
+    LocalChange *c = list_get (changes, i);
+    if (failed)
+      {
+      localwatch_change_free (c);
+      continue;
+      }
+    size_t dl = dir ? strlen (dir->relative) : 0;
+    if (dir && strcmp (dir->base, c->base) == 0 
+          && strncmp (dir->relative, c->relative, dl) == 0
+          && c->relative[dl] == '/')
+      {
+      localwatch_change_free (c);
+      continue;
+      }
+    list_append (ret, c);
+    if (c->is_dir) dir = c;
+    }
+  list_destroy (changes);
+  return ret;
+  }
+
@@ -0,0 +1,32 @@
+/*---------------------------------------------------------------------------
+dbcmd
+localwatch.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bool.h"
+#include "list.h"
+#include "rules.h"
+
+struct _LocalWatch;
+typedef struct _LocalWatch LocalWatch;
+
+// A local file or directory that has been written, created, or moved
+//   into place. The path is base/relative, as in the arguments to
+//   localwatch_add()
+typedef struct _LocalChange
+  {
+  char *base;
+  char *relative;
+  BOOL is_dir;
+  } LocalChange;
+
+LocalWatch *localwatch_create (const Rules *rules, char **error);
+void        localwatch_destroy (LocalWatch *self);
+void        localwatch_add (LocalWatch *self, const char *base, 
+              const char *relative, BOOL recursive);
+List       *localwatch_wait (LocalWatch *self, int debounce_ms, 
+              int max_delay_ms);
+
@@ -44,6 +44,27 @@ void log_set_log_console (const BOOL f)
   log_console = f;
   }
 
+/*==========================================================================
+log_lock
+Hold stdout for output that takes more than one call to write -- a
+progress line, for example -- so that log messages from other threads
+don't land in the middle of it. Calls may be nested
+*==========================================================================*/
+void log_lock (void)
+  {
+  flockfile (stdout);
+  }
+
+
+/*==========================================================================
+log_unlock
+*==========================================================================*/
+void log_unlock (void)
+  {
+  funlockfile (stdout);
+  }
+
+
 /*==========================================================================
 log_vprintf
 *==========================================================================*/
@@ -64,7 +85,9 @@ void log_vprintf (const int level, const char *fmt, va_list ap)
     // It's easier to fix that here than in the rest of the code ;) 
     if (str[strlen(str) - 1] == '\n')
       str[strlen(str) - 1] = 0;
+    log_lock ();
     printf ("%s %s %s\n", NAME, s, str);
+    log_unlock ();
     free (str);
     }
   }
@@ -27,6 +27,8 @@ void log_set_level (const int level);
 
 void log_set_log_syslog (const BOOL f);
 void log_set_log_console (const BOOL f);
+void log_lock (void);
+void log_unlock (void);
 
 
 
@@ -53,6 +53,10 @@ CmdTableEntry cmd_table[] =
   {"commands", cmd_commands, "", "list commands", NULL},
   {"delete",  cmd_delete, "{remote_path_spec}", "delete files on server", 
       NULL},
+  {"du",  cmd_du, "[remote_path]", "show space used by folders on server", 
+      NULL},
+  {"find",  cmd_find, "[remote_path]", 
+      "list files on server that pass tests", NULL},
   {"get",  cmd_get, "{remote_paths...} {local_path}", 
       "download files from server", NULL},
   {"help",  cmd_help, "[command]", "get help [on command]", NULL},
@@ -69,6 +73,8 @@ CmdTableEntry cmd_table[] =
      NULL},
   {"usage",  cmd_usage, "", "show server quota and usage", 
      NULL},
+  {"watch",  cmd_watch, "{remote_path} {local_path}", 
+     "keep a local directory up to date with the server", NULL},
   {NULL, NULL}
   };
 
@@ -194,10 +200,28 @@ int main (int argc, char **argv)
   BOOL long_ = FALSE;
   BOOL yes = FALSE;
   BOOL new_files_only = FALSE;
+  BOOL incremental = FALSE;
+  BOOL watch = FALSE;
+  BOOL plan = FALSE;
+  BOOL resume = FALSE;
+  BOOL checksum = FALSE;
+  BOOL server_copy = FALSE;
+  BOOL download_zip = FALSE;
   int buffsize_mb = 4;
   int screen_width = 80; //TODO
   int loglevel = INFO;
   int days_old = 0;
+  int walk_threads = 4;
+  int jobs = 1;
+  int stat_jobs = 0;
+  int hash_jobs = 1;
+  int list_jobs = 1;
+  FinderSearch search = FINDER_SEARCH_AUTO;
+  Rules *rules = NULL;
+  RankBy sort = RANK_NONE;
+  int top = 0;
+  int max_depth = -1;
+  Predicates *predicates = NULL;
 
   // Sort the arguments so that switches come first
   // A consequence of this rather ugly process is that
@@ -210,9 +234,10 @@ int main (int argc, char **argv)
   sorted_argv[0] = argv[0];
   ii++;
 
+  // "-" on its own is an argument, meaning standard input
   for (i = 1; i < argc; i++)
     {
-    if (argv[i][0] == '-')
+    if (argv[i][0] == '-' && argv[i][1])
       {
       sorted_argv[ii] = argv[i];
       ii++;
@@ -221,7 +246,7 @@ int main (int argc, char **argv)
 
   for (i = 1; i < argc; i++)
     {
-    if (argv[i][0] != '-')
+    if (argv[i][0] != '-' || !argv[i][1])
       {
       sorted_argv[ii] = argv[i];
       ii++;
@@ -244,6 +269,30 @@ int main (int argc, char **argv)
      {"yes", no_argument, NULL, 'y'},
      {"dry-run", no_argument, NULL, 'L'},
      {"new-files-only", no_argument, NULL, 'N'},
+     {"incremental", no_argument, NULL, 0},
+     {"watch", no_argument, NULL, 0},
+     {"plan", no_argument, NULL, 0},
+     {"resume", no_argument, NULL, 0},
+     {"checksum", no_argument, NULL, 0},
+     {"server-copy", no_argument, NULL, 0},
+     {"download-zip", no_argument, NULL, 0},
+     {"walk-threads", required_argument, NULL, 0},
+     {"jobs", required_argument, NULL, 0},
+     {"stat-jobs", required_argument, NULL, 0},
+     {"hash-jobs", required_argument, NULL, 0},
+     {"list-jobs", required_argument, NULL, 0},
+     {"search", required_argument, NULL, 0},
+     {"exclude", required_argument, NULL, 0},
+     {"include", required_argument, NULL, 0},
+     {"exclude-from", required_argument, NULL, 0},
+     {"sort", required_argument, NULL, 0},
+     {"top", required_argument, NULL, 0},
+     {"max-depth", required_argument, NULL, 0},
+     {"name", required_argument, NULL, 0},
+     {"size", required_argument, NULL, 0},
+     {"mtime", required_argument, NULL, 0},
+     {"client-mtime", required_argument, NULL, 0},
+     {"type", required_argument, NULL, 0},
      {0, 0, 0, 0}
    };
 
@@ -285,6 +334,23 @@ int main (int argc, char **argv)
         else if (strcmp (long_options[option_index].name, 
 	    "new-files-only") == 0)
           new_files_only = TRUE;
+        else if (strcmp (long_options[option_index].name, 
+	    "incremental") == 0)
+          incremental = TRUE;
+        else if (strcmp (long_options[option_index].name, "watch") == 0)
+          watch = TRUE;
+        else if (strcmp (long_options[option_index].name, "plan") == 0)
+          plan = TRUE;
+        else if (strcmp (long_options[option_index].name, "resume") == 0)
+          resume = TRUE;
+        else if (strcmp (long_options[option_index].name, "checksum") == 0)
+          checksum = TRUE;
+        else if (strcmp (long_options[option_index].name, 
+	    "server-copy") == 0)
+          server_copy = TRUE;
+        else if (strcmp (long_options[option_index].name, 
+	    "download-zip") == 0)
+          download_zip = TRUE;
         else if (strcmp (long_options[option_index].name, "yes") == 0)
           yes = TRUE;
         else if (strcmp (long_options[option_index].name, "loglevel") == 0)
@@ -295,6 +361,77 @@ int main (int argc, char **argv)
           screen_width = atoi (optarg);
         else if (strcmp (long_options[option_index].name, "days-old") == 0)
           days_old = atoi (optarg);
+        else if (strcmp (long_options[option_index].name, 
+	    "walk-threads") == 0)
+          walk_threads = atoi (optarg);
+        else if (strcmp (long_options[option_index].name, "jobs") == 0)
+          jobs = atoi (optarg);
+        else if (strcmp (long_options[option_index].name, "stat-jobs") == 0)
+          stat_jobs = atoi (optarg);
+        else if (strcmp (long_options[option_index].name, "hash-jobs") == 0)
+          hash_jobs = atoi (optarg);
+        else if (strcmp (long_options[option_index].name, "list-jobs") == 0)
+          list_jobs = atoi (optarg);
+        else if (strcmp (long_options[option_index].name, "search") == 0)
+          {
+          if (!finder_parse_search (optarg, &search))
+            {
+            fprintf (stderr, "%s: --search must be auto, always, or never\n",
+              NAME);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "exclude") == 0
+            || strcmp (long_options[option_index].name, "include") == 0)
+          {
+          // Rules are checked in the order they are given
+          if (!rules) rules = rules_create ();
+          rules_add (rules, optarg, 
+            strcmp (long_options[option_index].name, "include") == 0);
+          }
+        else if (strcmp (long_options[option_index].name, 
+	    "exclude-from") == 0)
+          {
+          char *error = NULL;
+          if (!rules) rules = rules_create ();
+          if (!rules_add_file (rules, optarg, &error))
+            {
+            fprintf (stderr, "%s: --exclude-from: %s\n", NAME, error);
+            free (error);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "sort") == 0)
+          {
+          if (!ranking_parse (optarg, &sort))
+            {
+            fprintf (stderr, "%s: --sort must be name, size, or mtime\n",
+              NAME);
+            exit (-1);
+            }
+          }
+        else if (strcmp (long_options[option_index].name, "top") == 0)
+          top = atoi (optarg);
+        else if (strcmp (long_options[option_index].name, "max-depth") == 0)
+          max_depth = atoi (optarg);
+        else if (strcmp (long_options[option_index].name, "name") == 0
+            || strcmp (long_options[option_index].name, "size") == 0
+            || strcmp (long_options[option_index].name, "mtime") == 0
+            || strcmp (long_options[option_index].name, 
+	      "client-mtime") == 0
+            || strcmp (long_options[option_index].name, "type") == 0)
+          {
+          char *error = NULL;
+          if (!predicates) predicates = predicates_create ();
+          if (!predicates_add (predicates, long_options[option_index].name,
+               optarg, &error))
+            {
+            fprintf (stderr, "%s: --%s: %s\n", NAME, 
+              long_options[option_index].name, error);
+            free (error);
+            exit (-1);
+            }
+          }
         else
           exit (-1);
         break;
@@ -371,6 +508,24 @@ int main (int argc, char **argv)
       context.buffsize_mb = buffsize_mb; 
       context.days_old = days_old;
       context.new_files_only = new_files_only;
+      context.incremental = incremental;
+      context.watch = watch;
+      context.plan = plan;
+      context.resume = resume;
+      context.checksum = checksum;
+      context.server_copy = server_copy;
+      context.download_zip = download_zip;
+      context.walk_threads = walk_threads;
+      context.jobs = jobs;
+      context.stat_jobs = stat_jobs;
+      context.hash_jobs = hash_jobs;
+      context.list_jobs = list_jobs;
+      context.search = search;
+      context.rules = rules;
+      context.sort = sort;
+      context.top = top;
+      context.max_depth = max_depth;
+      context.predicates = predicates;
       ret = cmd_entry->fn (&context, new_argc, new_argv); 
       }
     else
@@ -386,9 +541,12 @@ int main (int argc, char **argv)
     }
 
 
+  dropbox_cleanup();
   curl_global_cleanup();
 
   free (sorted_argv);
+  rules_destroy (rules);
+  predicates_destroy (predicates);
 
   OUT
   return ret;
@@ -0,0 +1,504 @@
+/*---------------------------------------------------------------------------
+dbcmd
+matcher.c
+GPL v3.0
+
+A shell wildcard pattern, compiled once, and then matched against any
+number of strings, with the same result as fnmatch() with no flags, in
+the C locale: '*' and '?' match any characters, including '/', and
+'[...]' matches one character from a set. fnmatch() parses the pattern
+again for every string, and backtracks over each '*'; matching a large
+listing against it adds up.
+
+Most patterns need nothing clever. One with no wildcards is compared
+directly; one made of literal text and at most one '*', or of the form
+"*text*", is checked by comparing its literal prefix and suffix, or by
+searching for the text. Anything else is matched by a DFA, built lazily:
+the pattern is a sequence of steps, and a state of the DFA is the set
+of steps that the input so far could have reached. States, and the
+transitions between them, are only worked out when a string first needs
+them, and then cached, so each character of each string costs one table
+lookup once the cache is warm. If a pathological pattern produces too
+many states, the cache is emptied, and filled again. The rare pattern
+with a collating symbol or equivalence class ("[.", "[=") is simply
+passed to fnmatch().
+
+A matcher can be shared between threads; the DFA cache is protected by
+a mutex.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include "matcher.h"
+#include "hashindex.h"
+
+// The most DFA states that are cached at once
+#define MATCHER_MAX_STATES 512
+
+typedef enum {STEP_CHAR, STEP_ANY, STEP_SET, STEP_STAR} StepType;
+
+typedef struct _MatcherStep
+  {
+  StepType type;
+  unsigned char c;     // For STEP_CHAR
+  uint8_t set[32];     // For STEP_SET, a bit for each byte
+  } MatcherStep;
+
+typedef enum
+  {
+  MATCH_EXACT,   // literal
+  MATCH_PREFIX,  // literal*, or literal*literal
+  MATCH_SUFFIX,  // *literal
+  MATCH_CONTAINS,// *literal*
+  MATCH_DFA,
+  MATCH_FNMATCH  // Collating symbols, which we leave to fnmatch()
+  } MatchKind;
+
+typedef struct _MatcherState
+  {
+  uint64_t *steps;  // The steps reached, one bit each
+  int next[256];    // Index of the following state, or -1 if not known
+  BOOL accept;
+  BOOL dead;        // No match is possible from here
+  } MatcherState;
+
+struct _Matcher
+  {
+  MatchKind kind;
+  char *pattern;
+  char *prefix;
+  size_t prefix_len;
+  char *suffix;
+  size_t suffix_len;
+  MatcherStep *steps;
+  int nsteps;
+  int nwords;             // Of a state's bit set
+  MatcherState *states;
+  int nstates;
+  int start;
+  HashIndex *index;       // Bit set to index in states
+  pthread_mutex_t mutex;  // Protects the DFA cache
+  };
+
+
+/*---------------------------------------------------------------------------
+matcher_parse_class
+Add the bytes of a class such as [:alpha:] to a set. p points after
+"[:"; returns the end of the class, after ":]", or NULL if it isn't a
+class that we know
+---------------------------------------------------------------------------*/
+static const char *matcher_parse_class (const char *p, uint8_t set[32])
+  {
+  static const struct { const char *name; int (*fn) (int); } classes[] =
+    {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+    {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+    {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+    {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}
+    };
+  const char *end = strstr (p, ":]");
+  if (!end) return NULL;
+  size_t i, len = end - p;
+  for (i = 0; i < sizeof (classes) / sizeof (classes[0]); i++)
+    {
+    if (strlen (classes[i].name) != len
+         || strncmp (classes[i].name, p, len) != 0) continue;
+    int c;
+    for (c = 0; c < 256; c++)
+      if (classes[i].fn (c)) set[c >> 3] |= 1 << (c & 7);
+    return end + 2;
+    }
+  return NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_parse_set
+Parse a bracket expression; p points after the '['. Returns the end of
+it, or NULL if there is no closing ']', in which case the '[' is just a
+character, as it is to fnmatch()
+---------------------------------------------------------------------------*/
+static const char *matcher_parse_set (const char *p, MatcherStep *step)
+  {
+  memset (step->set, 0, sizeof (step->set));
+  BOOL negate = FALSE;
+  if (*p == '!' || *p == '^')
+    {
+    negate = TRUE;
+    p++;
+    }
+  BOOL first = TRUE;
+  while (*p && (*p != ']' || first))
+    {
+    first = FALSE;
+    if (p[0] == '[' && p[1] == ':')
+      {
+      const char *end = matcher_parse_class (p + 2, step->set);
+      if (end)
+        {
+        p = end;
+        continue;
+        }
+      }
+    if (*p == '\\' && p[1]) p++;
+    unsigned char lo = *p++, hi = lo;
+    if (p[0] == '-' && p[1] && p[1] != ']')
+      {
+      p++;
+      if (*p == '\\' && p[1]) p++;
+      hi = *p++;
+      }
+    int c;
+    for (c = lo; c <= hi; c++)
+      step->set[c >> 3] |= 1 << (c & 7);
+    }
+  if (*p != ']') return NULL;
+  if (negate)
+    {
+    int i;
+    for (i = 0; i < 32; i++) step->set[i] = ~step->set[i];
+    }
+  // fnmatch() never matches the null that ends the string
+  step->set[0] &= ~1;
+  step->type = STEP_SET;
+  return p + 1;
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_compile
+Turn the pattern into steps. Runs of '*' are the same as one
+---------------------------------------------------------------------------*/
+static void matcher_compile (Matcher *self, const char *pattern)
+  {
+  self->steps = malloc ((strlen (pattern) + 1) * sizeof (MatcherStep));
+  const char *p = pattern;
+  while (*p)
+    {
+    MatcherStep *step = &self->steps[self->nsteps];
+    const char *end;
+    if (*p == '*')
+      {
+      p++;
+      if (self->nsteps > 0 && step[-1].type == STEP_STAR) continue;
+      step->type = STEP_STAR;
+      }
+    else if (*p == '?')
+      {
+      p++;
+      step->type = STEP_ANY;
+      }
+    else if (*p == '[' && (end = matcher_parse_set (p + 1, step)) != NULL)
+      p = end;
+    else
+      {
+      // A '[' with no ']' lands here, as does an escaped character
+      const char *q = p;
+      if (*q == '\\' && q[1]) q++;
+      step->type = STEP_CHAR;
+      step->c = *q;
+      p = q + 1;
+      }
+    self->nsteps++;
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_literal
+The literal text of steps [from, to), if they are all literal
+characters, or NULL. Caller frees the result
+---------------------------------------------------------------------------*/
+static char *matcher_literal (const Matcher *self, int from, int to)
+  {
+  char *ret = malloc (to - from + 1);
+  int i;
+  for (i = from; i < to; i++)
+    {
+    if (self->steps[i].type != STEP_CHAR)
+      {
+      free (ret);
+      return NULL;
+      }
+    ret[i - from] = self->steps[i].c;
+    }
+  ret[to - from] = 0;
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_choose
+Pick the quickest way to match the steps
+---------------------------------------------------------------------------*/
+static void matcher_choose (Matcher *self)
+  {
+  int i, stars = 0, star = -1;
+  for (i = 0; i < self->nsteps; i++)
+    if (self->steps[i].type == STEP_STAR)
+      {
+      stars++;
+      if (star < 0) star = i;
+      }
+
+  self->kind = MATCH_DFA;
+  int n = self->nsteps;
+  if (stars == 0)
+    {
+    if ((self->prefix = matcher_literal (self, 0, n)))
+      self->kind = MATCH_EXACT;
+    }
+  else if (stars == 1)
+    {
+    self->prefix = matcher_literal (self, 0, star);
+    self->suffix = matcher_literal (self, star + 1, n);
+    if (self->prefix && self->suffix)
+      self->kind = (star == 0 && n > 1) ? MATCH_SUFFIX : MATCH_PREFIX;
+    }
+  else if (stars == 2 && self->steps[0].type == STEP_STAR
+            && self->steps[n - 1].type == STEP_STAR)
+    {
+    if ((self->prefix = matcher_literal (self, 1, n - 1)))
+      self->kind = MATCH_CONTAINS;
+    }
+  if (self->prefix) self->prefix_len = strlen (self->prefix);
+  if (self->suffix) self->suffix_len = strlen (self->suffix);
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_closure
+Add the steps that can be reached without reading anything: a '*' can
+match nothing
+---------------------------------------------------------------------------*/
+static void matcher_closure (const Matcher *self, uint64_t *bits)
+  {
+  int i;
+  for (i = 0; i < self->nsteps; i++)
+    if ((bits[i >> 6] & (1ULL << (i & 63)))
+         && self->steps[i].type == STEP_STAR)
+      bits[(i + 1) >> 6] |= 1ULL << ((i + 1) & 63);
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_flush
+Empty the DFA cache. Call with the mutex held
+---------------------------------------------------------------------------*/
+static void matcher_flush (Matcher *self)
+  {
+  int i;
+  for (i = 0; i < self->nstates; i++)
+    free (self->states[i].steps);
+  self->nstates = 0;
+  hashindex_destroy (self->index);
+  self->index = hashindex_create ();
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_state
+The index of the state for a set of steps, which is added to the cache
+if it isn't there already. If the cache is full, it is emptied first,
+and start is set to -1, to show that every other state index has gone.
+bits must not belong to a cached state. Call with the mutex held
+---------------------------------------------------------------------------*/
+static int matcher_state (Matcher *self, const uint64_t *bits)
+  {
+  size_t size = self->nwords * sizeof (uint64_t);
+  void *found = hashindex_get (self->index, bits, size);
+  if (found) return (int)(intptr_t)found - 1;
+
+  if (self->nstates == MATCHER_MAX_STATES)
+    {
+    matcher_flush (self);
+    self->start = -1;
+    }
+
+  MatcherState *state = &self->states[self->nstates];
+  state->steps = malloc (size);
+  memcpy (state->steps, bits, size);
+  memset (state->next, -1, sizeof (state->next));
+  state->accept =
+    (bits[self->nsteps >> 6] & (1ULL << (self->nsteps & 63))) != 0;
+  state->dead = TRUE;
+  int i;
+  for (i = 0; i < self->nwords; i++)
+    if (bits[i]) state->dead = FALSE;
+  hashindex_put (self->index, state->steps, size,
+    (void *)(intptr_t)(self->nstates + 1), FALSE);
+  return self->nstates++;
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_start
+The state before anything has been read. Call with the mutex held
+---------------------------------------------------------------------------*/
+static int matcher_start (Matcher *self)
+  {
+  if (self->start >= 0) return self->start;
+  uint64_t *bits = calloc (self->nwords, sizeof (uint64_t));
+  bits[0] = 1;
+  matcher_closure (self, bits);
+  int ret = matcher_state (self, bits);
+  free (bits);
+  self->start = ret;
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_next
+The state after reading c in state s. If the cache had to be emptied
+to make room, *flushed is set, and s no longer means anything. Call
+with the mutex held
+---------------------------------------------------------------------------*/
+static int matcher_next (Matcher *self, int s, unsigned char c,
+    BOOL *flushed)
+  {
+  int next = self->states[s].next[c];
+  if (next >= 0) return next;
+
+  uint64_t *bits = calloc (self->nwords, sizeof (uint64_t));
+  const uint64_t *from = self->states[s].steps;
+  int i;
+  for (i = 0; i < self->nsteps; i++)
+    {
+    if (!(from[i >> 6] & (1ULL << (i & 63)))) continue;
+    const MatcherStep *step = &self->steps[i];
+    int to = -1;
+    switch (step->type)
+      {
+      case STEP_STAR: to = i; break;
+      case STEP_ANY: to = i + 1; break;
+      case STEP_CHAR: if (step->c == c) to = i + 1; break;
+      case STEP_SET:
+        if (step->set[c >> 3] & (1 << (c & 7))) to = i + 1;
+        break;
+      }
+    if (to >= 0) bits[to >> 6] |= 1ULL << (to & 63);
+    }
+  matcher_closure (self, bits);
+
+  next = matcher_state (self, bits);
+  free (bits);
+  if (self->start < 0)
+    *flushed = TRUE;
+  else
+    self->states[s].next[c] = next;
+  return next;
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_match_dfa
+---------------------------------------------------------------------------*/
+static BOOL matcher_match_dfa (Matcher *self, const char *s)
+  {
+  pthread_mutex_lock (&self->mutex);
+  int state = matcher_start (self);
+  const unsigned char *p;
+  for (p = (const unsigned char *)s; *p && !self->states[state].dead; p++)
+    {
+    int next = self->states[state].next[*p];
+    if (next >= 0)
+      {
+      state = next;
+      continue;
+      }
+    BOOL flushed = FALSE;
+    state = matcher_next (self, state, *p, &flushed);
+    // The start state went with the rest; make it again, for the next
+    //   string. There is plenty of room now, so state is safe
+    if (flushed) matcher_start (self);
+    }
+  BOOL ret = self->states[state].accept;
+  pthread_mutex_unlock (&self->mutex);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_create
+---------------------------------------------------------------------------*/
+Matcher *matcher_create (const char *pattern)
+  {
+  Matcher *self = malloc (sizeof (Matcher));
+  memset (self, 0, sizeof (Matcher));
+  self->pattern = strdup (pattern);
+  matcher_compile (self, pattern);
+  matcher_choose (self);
+  if (strstr (pattern, "[.") || strstr (pattern, "[="))
+    self->kind = MATCH_FNMATCH;
+  if (self->kind == MATCH_DFA)
+    {
+    self->nwords = (self->nsteps + 1 + 63) / 64;
+    self->states = malloc (MATCHER_MAX_STATES * sizeof (MatcherState));
+    self->index = hashindex_create ();
+    self->start = -1;
+    pthread_mutex_init (&self->mutex, NULL);
+    }
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_destroy
+---------------------------------------------------------------------------*/
+void matcher_destroy (Matcher *self)
+  {
+  if (!self) return;
+  if (self->kind == MATCH_DFA)
+    {
+    matcher_flush (self);
+    hashindex_destroy (self->index);
+    free (self->states);
+    pthread_mutex_destroy (&self->mutex);
+    }
+  free (self->pattern);
+  free (self->steps);
+  free (self->prefix);
+  free (self->suffix);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+matcher_match
+Returns TRUE if the whole of s matches the pattern
+---------------------------------------------------------------------------*/
+BOOL matcher_match (Matcher *self, const char *s)
+  {
+  size_t len;
+  switch (self->kind)
+    {
+    case MATCH_EXACT:
+      return strcmp (s, self->prefix) == 0;
+    case MATCH_PREFIX:
+      if (strncmp (s, self->prefix, self->prefix_len) != 0) return FALSE;
+      if (self->suffix_len == 0) return TRUE;
+      len = strlen (s);
+      return len >= self->prefix_len + self->suffix_len
+        && memcmp (s + len - self->suffix_len, self->suffix,
+             self->suffix_len) == 0;
+    case MATCH_SUFFIX:
+      len = strlen (s);
+      return len >= self->suffix_len
+        && memcmp (s + len - self->suffix_len, self->suffix,
+             self->suffix_len) == 0;
+    case MATCH_CONTAINS:
+      return strstr (s, self->prefix) != NULL;
+    case MATCH_DFA:
+      return matcher_match_dfa (self, s);
+    default:
+      return fnmatch (self->pattern, s, 0) == 0;
+    }
+  }
+
@@ -0,0 +1,17 @@
+/*---------------------------------------------------------------------------
+dbcmd
+matcher.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bool.h"
+
+struct _Matcher;
+typedef struct _Matcher Matcher;
+
+Matcher *matcher_create (const char *pattern);
+void     matcher_destroy (Matcher *self);
+BOOL     matcher_match (Matcher *self, const char *s);
+
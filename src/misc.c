@@ -10,12 +10,30 @@ GPL v3.0
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 #include "cJSON.h"
 #include "dropbox.h"
 #include "token.h"
 #include "commands.h"
 #include "log.h"
 #include "errmsg.h"
+#include "misc.h"
+
+// Figures for all the transfers in progress, so that parallel transfers
+//   can share a single progress line
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int progress_active = 0;
+static int64_t progress_transferred = 0;
+static int64_t progress_total = 0;
+// The contribution of this thread's transfer to the figures above
+static __thread BOOL progress_started = FALSE;
+static __thread int64_t progress_my_transferred = 0;
+static __thread int64_t progress_my_total = 0;
 
 /*==========================================================================
 misc_format_size
@@ -33,3 +51,130 @@ void misc_format_size (int64_t size, char **result)
   }
 
 
+
+
+/*==========================================================================
+misc_show_progress
+A DBProgressFunc for upload and download: verb is "Uploaded" or 
+"Downloaded". When several files are transferred at once, the progress
+line shows the total for all of them, and is only cleared when the last
+one finishes. With one transfer at a time, that's just the progress of
+the current file
+*==========================================================================*/
+void misc_show_progress (const char *verb, int64_t transferred, 
+    int64_t total)
+  {
+  if (isatty (STDIN_FILENO))
+    {
+    pthread_mutex_lock (&progress_mutex);
+    if (transferred < 0)
+      {
+      progress_transferred -= progress_my_transferred;
+      progress_total -= progress_my_total;
+      progress_active--;
+      progress_started = FALSE;
+      progress_my_transferred = 0;
+      progress_my_total = 0;
+      transferred = progress_transferred;
+      total = progress_total;
+      }
+    else
+      {
+      if (!progress_started)
+        {
+        progress_started = TRUE;
+        progress_active++;
+        }
+      progress_transferred += transferred - progress_my_transferred;
+      progress_total += total - progress_my_total;
+      progress_my_transferred = transferred;
+      progress_my_total = total;
+      transferred = progress_transferred;
+      total = progress_total;
+      }
+    int active = progress_active;
+    pthread_mutex_unlock (&progress_mutex);
+
+    log_lock ();
+    if (active == 0)
+      {
+      printf ("\n"); // Clear progress line when done
+      }
+    else
+      {
+      char *s_transferred, *s_total;
+      misc_format_size (transferred, &s_transferred);
+      misc_format_size (total, &s_total);
+      char *line;
+      asprintf (&line, "%s %s of %s", verb, s_transferred, s_total);
+      printf (line);
+      int i, l = strlen (line);
+      for (i = l; i < 40; i++) fputs (" ", stdout);
+      printf ("\r"); 
+      fflush (stdout);
+      free (line);
+      free (s_transferred);
+      free (s_total);
+      }
+    log_unlock ();
+    }
+  }
+
+
+/*==========================================================================
+misc_copy_file
+Copy a local file, as cheaply as the filesystem allows: first as a 
+reflink, which shares the data until either copy is changed; then with
+copy_file_range(), which copies in the kernel, or on the server for a 
+network filesystem; and, failing those, by reading and writing
+*==========================================================================*/
+void misc_copy_file (const char *source, const char *target, 
+       char **error)
+  {
+  int in = open (source, O_RDONLY);
+  if (in < 0)
+    {
+    asprintf (error, "Can't read %s: %s", source, strerror (errno));
+    return;
+    }
+  int out = open (target, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (out < 0)
+    {
+    asprintf (error, "Can't write %s: %s", target, strerror (errno));
+    close (in);
+    return;
+    }
+
+  if (ioctl (out, FICLONE, in) != 0)
+    {
+    struct stat sb;
+    fstat (in, &sb);
+    off_t left = sb.st_size;
+    ssize_t n = 0;
+    while (left > 0 && (n = copy_file_range (in, NULL, out, NULL, 
+             left, 0)) > 0)
+      left -= n;
+
+    if (left > 0 && n < 0 && lseek (out, 0, SEEK_CUR) == 0)
+      {
+      // Not supported here; nothing has been written yet
+      char buff [65536];
+      while ((n = read (in, buff, sizeof (buff))) > 0)
+        {
+        if (write (out, buff, n) != n)
+          {
+          n = -1;
+          break;
+          }
+        }
+      }
+    if (n < 0)
+      asprintf (error, "Can't copy %s to %s: %s", source, target, 
+        strerror (errno));
+    }
+
+  if (close (out) != 0 && !*error)
+    asprintf (error, "Can't write %s: %s", target, strerror (errno));
+  close (in);
+  }
+
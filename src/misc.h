@@ -6,7 +6,12 @@ GPL v3.0
 
 #pragma once
 
+#include <stdint.h>
 #include "bool.h"
 
 void misc_format_size (int64_t size, char **result);
+void misc_show_progress (const char *verb, int64_t transferred, 
+       int64_t total);
+void misc_copy_file (const char *source, const char *target, 
+       char **error);
 
@@ -0,0 +1,314 @@
+/*---------------------------------------------------------------------------
+dbcmd
+pipeline.c
+GPL v3.0
+
+A chain of processing stages, connected by bounded queues. Each stage
+has its own threads, so that a stage limited by one resource (the
+disk, the CPU, the network) does not hold up the others, except when
+the queue in front of a slow stage fills up. Items only ever move
+forward, but may skip stages, so every queue stays open until all the
+stages before it have finished.
+
+While the pipeline runs, the depth of each queue is logged every few
+seconds at debug level; when it finishes, the throughput of each stage,
+the proportion of its threads' time spent working, and its average and
+largest queue depth are logged, also at debug level. A stage with a
+long queue and busy threads is the one that needs more of them.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pipeline.h"
+#include "log.h"
+
+#define PIPELINE_MAX_STAGES 8
+#define PIPELINE_REPORT_SECONDS 5
+
+typedef struct _PipelineStage
+  {
+  char *name;
+  PipelineFn fn;
+  int nthreads;
+  pthread_t *threads;
+  Queue *queue;
+  // Statistics, updated atomically
+  int64_t items;
+  int64_t busy_ns;
+  int64_t depth_sum;
+  int64_t depth_samples;
+  int max_depth;
+  } PipelineStage;
+
+typedef struct _PipelineWorker
+  {
+  Pipeline *pipeline;
+  PipelineStage *stage;
+  } PipelineWorker;
+
+struct _Pipeline
+  {
+  char *name;
+  void *user;
+  QueueItemFreeFn free_fn;
+  int nstages;
+  PipelineStage stages [PIPELINE_MAX_STAGES];
+  PipelineWorker workers [PIPELINE_MAX_STAGES];
+  int64_t start_ns;
+  pthread_t monitor;
+  pthread_mutex_t mutex; // Protects finished and inflight
+  pthread_cond_t finished_cond;
+  pthread_cond_t idle_cond;
+  BOOL finished;
+  int inflight; // Items pushed, but not yet dealt with by a stage
+  BOOL started;
+  };
+
+
+/*---------------------------------------------------------------------------
+pipeline_now_ns
+---------------------------------------------------------------------------*/
+static int64_t pipeline_now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_create
+The user pointer is passed to every stage function. free_fn is used on
+items that are left in the queues if the pipeline is destroyed early
+---------------------------------------------------------------------------*/
+Pipeline *pipeline_create (const char *name, void *user,
+    QueueItemFreeFn free_fn)
+  {
+  Pipeline *self = malloc (sizeof (Pipeline));
+  memset (self, 0, sizeof (Pipeline));
+  self->name = strdup (name);
+  self->user = user;
+  self->free_fn = free_fn;
+  pthread_mutex_init (&self->mutex, NULL);
+  pthread_cond_init (&self->finished_cond, NULL);
+  pthread_cond_init (&self->idle_cond, NULL);
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_add_stage
+Stages must be added in order, before the pipeline is started. Returns
+the stage's index, for use with pipeline_push()
+---------------------------------------------------------------------------*/
+int pipeline_add_stage (Pipeline *self, const char *name, PipelineFn fn,
+    int threads, int capacity)
+  {
+  if (self->nstages == PIPELINE_MAX_STAGES) return -1;
+  if (threads < 1) threads = 1;
+  if (capacity < threads) capacity = threads;
+  int i = self->nstages++;
+  PipelineStage *stage = &self->stages[i];
+  stage->name = strdup (name);
+  stage->fn = fn;
+  stage->nthreads = threads;
+  stage->threads = malloc (threads * sizeof (pthread_t));
+  stage->queue = queue_create (capacity, self->free_fn);
+  return i;
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_worker
+---------------------------------------------------------------------------*/
+static void *pipeline_worker (void *arg)
+  {
+  PipelineWorker *w = arg;
+  PipelineStage *stage = w->stage;
+  void *item;
+  while ((item = queue_pop (stage->queue)) != NULL)
+    {
+    int64_t start = pipeline_now_ns ();
+    stage->fn (w->pipeline, item, w->pipeline->user);
+    __atomic_add_fetch (&stage->busy_ns, pipeline_now_ns () - start,
+      __ATOMIC_RELAXED);
+    __atomic_add_fetch (&stage->items, 1, __ATOMIC_RELAXED);
+    // Anything this item turned into has been pushed by now
+    pthread_mutex_lock (&w->pipeline->mutex);
+    if (--w->pipeline->inflight == 0)
+      pthread_cond_broadcast (&w->pipeline->idle_cond);
+    pthread_mutex_unlock (&w->pipeline->mutex);
+    }
+  return NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_monitor
+Log the queue depths every few seconds, until the pipeline finishes
+---------------------------------------------------------------------------*/
+static void *pipeline_monitor (void *arg)
+  {
+  Pipeline *self = arg;
+  pthread_mutex_lock (&self->mutex);
+  while (!self->finished)
+    {
+    struct timespec until;
+    clock_gettime (CLOCK_REALTIME, &until);
+    until.tv_sec += PIPELINE_REPORT_SECONDS;
+    int err = 0;
+    while (!self->finished && err != ETIMEDOUT)
+      err = pthread_cond_timedwait (&self->finished_cond, &self->mutex,
+        &until);
+    if (self->finished) break;
+    int i;
+    for (i = 0; i < self->nstages; i++)
+      {
+      PipelineStage *stage = &self->stages[i];
+      log_debug ("%s %s: %d queued, %ld done", self->name, stage->name,
+        queue_length (stage->queue),
+        (long)__atomic_load_n (&stage->items, __ATOMIC_RELAXED));
+      }
+    }
+  pthread_mutex_unlock (&self->mutex);
+  return NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_start
+---------------------------------------------------------------------------*/
+void pipeline_start (Pipeline *self)
+  {
+  self->start_ns = pipeline_now_ns ();
+  int i;
+  for (i = 0; i < self->nstages; i++)
+    {
+    PipelineStage *stage = &self->stages[i];
+    self->workers[i].pipeline = self;
+    self->workers[i].stage = stage;
+    int j;
+    for (j = 0; j < stage->nthreads; j++)
+      pthread_create (&stage->threads[j], NULL, pipeline_worker,
+        &self->workers[i]);
+    }
+  pthread_create (&self->monitor, NULL, pipeline_monitor, self);
+  self->started = TRUE;
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_push
+Queue an item for a stage, blocking while that stage's queue is full.
+Stage functions may only push to later stages than their own
+---------------------------------------------------------------------------*/
+void pipeline_push (Pipeline *self, int stage_index, void *item)
+  {
+  PipelineStage *stage = &self->stages[stage_index];
+  pthread_mutex_lock (&self->mutex);
+  self->inflight++;
+  pthread_mutex_unlock (&self->mutex);
+  if (!queue_push (stage->queue, item))
+    {
+    pthread_mutex_lock (&self->mutex);
+    self->inflight--;
+    pthread_mutex_unlock (&self->mutex);
+    // Can only happen if the pipeline is misused
+    log_warning ("%s: item pushed to %s after it finished", self->name,
+      stage->name);
+    if (self->free_fn) self->free_fn (item);
+    return;
+    }
+  int depth = queue_length (stage->queue);
+  __atomic_add_fetch (&stage->depth_sum, depth, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&stage->depth_samples, 1, __ATOMIC_RELAXED);
+  int max = __atomic_load_n (&stage->max_depth, __ATOMIC_RELAXED);
+  while (depth > max && !__atomic_compare_exchange_n (&stage->max_depth,
+           &max, depth, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_wait
+Wait until every item pushed so far has gone all the way through, 
+without shutting the pipeline down
+---------------------------------------------------------------------------*/
+void pipeline_wait (Pipeline *self)
+  {
+  pthread_mutex_lock (&self->mutex);
+  while (self->inflight > 0)
+    pthread_cond_wait (&self->idle_cond, &self->mutex);
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_finish
+Call when no more items will be pushed from outside the pipeline.
+Waits for every stage to finish, in order, and logs the statistics
+---------------------------------------------------------------------------*/
+void pipeline_finish (Pipeline *self)
+  {
+  if (!self->started) return;
+  int i;
+  for (i = 0; i < self->nstages; i++)
+    {
+    PipelineStage *stage = &self->stages[i];
+    queue_close (stage->queue);
+    int j;
+    for (j = 0; j < stage->nthreads; j++)
+      pthread_join (stage->threads[j], NULL);
+    }
+
+  pthread_mutex_lock (&self->mutex);
+  self->finished = TRUE;
+  pthread_cond_signal (&self->finished_cond);
+  pthread_mutex_unlock (&self->mutex);
+  pthread_join (self->monitor, NULL);
+  self->started = FALSE;
+
+  double elapsed = (pipeline_now_ns () - self->start_ns) / 1e9;
+  for (i = 0; i < self->nstages; i++)
+    {
+    PipelineStage *stage = &self->stages[i];
+    double busy = stage->busy_ns / 1e9;
+    log_debug ("%s %s: %ld item(s) on %d thread(s), %.1f/s, "
+      "%.0f%% busy, queue depth mean %.1f max %d", self->name,
+      stage->name, (long)stage->items, stage->nthreads,
+      elapsed > 0 ? stage->items / elapsed : 0.0,
+      elapsed > 0 ? 100 * busy / (elapsed * stage->nthreads) : 0.0,
+      stage->depth_samples ?
+        (double)stage->depth_sum / stage->depth_samples : 0.0,
+      stage->max_depth);
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+pipeline_destroy
+---------------------------------------------------------------------------*/
+void pipeline_destroy (Pipeline *self)
+  {
+  if (!self) return;
+  pipeline_finish (self);
+  int i;
+  for (i = 0; i < self->nstages; i++)
+    {
+    PipelineStage *stage = &self->stages[i];
+    queue_destroy (stage->queue);
+    free (stage->threads);
+    free (stage->name);
+    }
+  pthread_mutex_destroy (&self->mutex);
+  pthread_cond_destroy (&self->finished_cond);
+  pthread_cond_destroy (&self->idle_cond);
+  free (self->name);
+  free (self);
+  }
+
@@ -0,0 +1,29 @@
+/*---------------------------------------------------------------------------
+dbcmd
+pipeline.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bool.h"
+#include "queue.h"
+
+struct _Pipeline;
+typedef struct _Pipeline Pipeline;
+
+// Called on one of a stage's threads for each item that reaches the
+//   stage. The function must either pass the item on to a later stage,
+//   with pipeline_push(), or free it
+typedef void (*PipelineFn) (Pipeline *pipeline, void *item, void *user);
+
+Pipeline *pipeline_create (const char *name, void *user,
+            QueueItemFreeFn free_fn);
+void      pipeline_destroy (Pipeline *self);
+int       pipeline_add_stage (Pipeline *self, const char *name,
+            PipelineFn fn, int threads, int capacity);
+void      pipeline_start (Pipeline *self);
+void      pipeline_push (Pipeline *self, int stage, void *item);
+void      pipeline_wait (Pipeline *self);
+void      pipeline_finish (Pipeline *self);
+
@@ -0,0 +1,309 @@
+/*---------------------------------------------------------------------------
+dbcmd
+planner.c
+GPL v3.0
+
+Orders a complete list of transfers so that a number of parallel
+connections finish at about the same time. Taking files in whatever
+order they are found tends to leave one connection busy with a huge
+file long after the others have finished, or has a handful of large
+files hold up thousands of small ones.
+
+Each transfer is costed as its size plus a fixed amount per request,
+since, for a small file, the round trips take longer than sending the
+data. Files smaller than PLAN_SMALL_BYTES are grouped into batches,
+which are treated as a single unit, so that each connection works
+through a run of small files at a time. The units are then taken
+largest first, and each one is given to the connection with the least
+work so far (the "longest processing time" rule), which gets within a
+third of the best possible finishing time, and usually much closer.
+
+The plan only decides the order: connections take the next unit when
+they become free, which gives the same assignment when the estimates
+are right, and adapts when they are not. The assignment is recorded
+for display.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "planner.h"
+#include "misc.h"
+
+// Files smaller than this are batched
+#define PLAN_SMALL_BYTES (1024 * 1024)
+
+// Limits on the size of a batch of small files
+#define PLAN_BATCH_FILES 32
+#define PLAN_BATCH_BYTES (4 * 1024 * 1024)
+
+// The cost of a request, in terms of the bytes that could have been
+//   sent in the time it takes -- about 50ms at 40Mb/s
+#define PLAN_REQUEST_BYTES (256 * 1024)
+
+typedef struct _PlanItem
+  {
+  void *item;
+  int64_t bytes;
+  int requests;
+  } PlanItem;
+
+struct _Plan
+  {
+  int connections;
+  List *items; // Of PlanItem
+  List *units; // Of PlanUnit, in the order they should be started
+  };
+
+
+/*---------------------------------------------------------------------------
+plan_cost
+The cost of a transfer, in bytes, counting each request as 
+PLAN_REQUEST_BYTES
+---------------------------------------------------------------------------*/
+int64_t plan_cost (int64_t bytes, int requests)
+  {
+  return bytes + (int64_t)requests * PLAN_REQUEST_BYTES;
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_unit_free
+---------------------------------------------------------------------------*/
+static void plan_unit_free (void *p)
+  {
+  PlanUnit *unit = p;
+  list_destroy (unit->items);
+  free (unit);
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_create
+---------------------------------------------------------------------------*/
+Plan *plan_create (int connections)
+  {
+  Plan *self = malloc (sizeof (Plan));
+  self->connections = connections > 0 ? connections : 1;
+  self->items = list_create (free);
+  self->units = list_create (plan_unit_free);
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_destroy
+The caller's items are not freed
+---------------------------------------------------------------------------*/
+void plan_destroy (Plan *self)
+  {
+  if (!self) return;
+  list_destroy (self->items);
+  list_destroy (self->units);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_add
+Add a transfer of the given size, which is expected to take the given
+number of requests to the server
+---------------------------------------------------------------------------*/
+void plan_add (Plan *self, void *item, int64_t bytes, int requests)
+  {
+  PlanItem *pi = malloc (sizeof (PlanItem));
+  pi->item = item;
+  pi->bytes = bytes;
+  pi->requests = requests;
+  list_append (self->items, pi);
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_compare_items
+Largest first
+---------------------------------------------------------------------------*/
+static int plan_compare_items (const void *p1, const void *p2)
+  {
+  const PlanItem *i1 = p1, *i2 = p2;
+  int64_t c1 = plan_cost (i1->bytes, i1->requests);
+  int64_t c2 = plan_cost (i2->bytes, i2->requests);
+  return c1 > c2 ? -1 : c1 < c2 ? 1 : 0;
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_compare_units
+Largest first
+---------------------------------------------------------------------------*/
+static int plan_compare_units (const void *p1, const void *p2)
+  {
+  const PlanUnit *u1 = p1, *u2 = p2;
+  int64_t c1 = plan_cost (u1->bytes, u1->requests);
+  int64_t c2 = plan_cost (u2->bytes, u2->requests);
+  return c1 > c2 ? -1 : c1 < c2 ? 1 : 0;
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_unit_create
+---------------------------------------------------------------------------*/
+static PlanUnit *plan_unit_create (void)
+  {
+  PlanUnit *unit = malloc (sizeof (PlanUnit));
+  memset (unit, 0, sizeof (PlanUnit));
+  unit->items = list_create (NULL);
+  return unit;
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_schedule
+Group the transfers into units, and put them in the order they should
+be started. Call once, after all the transfers have been added
+---------------------------------------------------------------------------*/
+void plan_schedule (Plan *self)
+  {
+  list_clear (self->units);
+  list_sort (self->items, plan_compare_items);
+
+  PlanUnit *batch = NULL;
+  int i, l = list_length (self->items);
+  for (i = 0; i < l; i++)
+    {
+    PlanItem *pi = list_get (self->items, i);
+    PlanUnit *unit;
+    if (pi->bytes >= PLAN_SMALL_BYTES)
+      {
+      unit = plan_unit_create ();
+      list_append (self->units, unit);
+      }
+    else
+      {
+      if (batch && (list_length (batch->items) == PLAN_BATCH_FILES
+            || batch->bytes + pi->bytes > PLAN_BATCH_BYTES))
+        batch = NULL;
+      if (!batch)
+        {
+        batch = plan_unit_create ();
+        list_append (self->units, batch);
+        }
+      unit = batch;
+      }
+    list_append (unit->items, pi->item);
+    unit->bytes += pi->bytes;
+    unit->requests += pi->requests;
+    }
+
+  list_sort (self->units, plan_compare_units);
+
+  // Give each unit to the connection that would be free first
+  int64_t *load = calloc (self->connections, sizeof (int64_t));
+  l = list_length (self->units);
+  for (i = 0; i < l; i++)
+    {
+    PlanUnit *unit = list_get (self->units, i);
+    int c, best = 0;
+    for (c = 1; c < self->connections; c++)
+      if (load[c] < load[best]) best = c;
+    unit->connection = best;
+    load[best] += plan_cost (unit->bytes, unit->requests);
+    }
+  free (load);
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_length
+The number of units
+---------------------------------------------------------------------------*/
+int plan_length (const Plan *self)
+  {
+  return list_length (self->units);
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_get
+Units are numbered in the order they should be started
+---------------------------------------------------------------------------*/
+const PlanUnit *plan_get (const Plan *self, int index)
+  {
+  return list_get (self->units, index);
+  }
+
+
+/*---------------------------------------------------------------------------
+plan_print
+Print the plan, connection by connection, with the bytes and requests
+each is expected to carry
+---------------------------------------------------------------------------*/
+void plan_print (const Plan *self, PlanDescribeFn describe)
+  {
+  int64_t total_bytes = 0;
+  int total_requests = 0;
+  int i, l = list_length (self->units);
+  for (i = 0; i < l; i++)
+    {
+    const PlanUnit *unit = list_get (self->units, i);
+    total_bytes += unit->bytes;
+    total_requests += unit->requests;
+    }
+
+  char *s_size;
+  misc_format_size (total_bytes, &s_size);
+  printf ("Plan: %d file(s), %s, about %d request(s), "
+    "on %d connection(s)\n", list_length (self->items), s_size,
+    total_requests, self->connections);
+  free (s_size);
+
+  int c;
+  for (c = 0; c < self->connections; c++)
+    {
+    int64_t bytes = 0;
+    int requests = 0, files = 0;
+    for (i = 0; i < l; i++)
+      {
+      const PlanUnit *unit = list_get (self->units, i);
+      if (unit->connection != c) continue;
+      bytes += unit->bytes;
+      requests += unit->requests;
+      files += list_length (unit->items);
+      }
+    if (files == 0) continue;
+
+    misc_format_size (bytes, &s_size);
+    printf ("\nConnection %d: %d file(s), %s, about %d request(s)\n",
+      c + 1, files, s_size, requests);
+    free (s_size);
+
+    for (i = 0; i < l; i++)
+      {
+      const PlanUnit *unit = list_get (self->units, i);
+      if (unit->connection != c) continue;
+      misc_format_size (unit->bytes, &s_size);
+      int n = list_length (unit->items);
+      const char *indent = "  ";
+      if (n > 1)
+        {
+        printf ("  Batch of %d files, %s, %d request(s):\n", n, s_size,
+          unit->requests);
+        indent = "    ";
+        }
+      int j;
+      for (j = 0; j < n; j++)
+        {
+        char *desc = describe (list_get (unit->items, j));
+        if (n > 1)
+          printf ("%s%s\n", indent, desc);
+        else
+          printf ("%s%s (%s, %d request(s))\n", indent, desc, s_size,
+            unit->requests);
+        free (desc);
+        }
+      free (s_size);
+      }
+    }
+  }
+
@@ -0,0 +1,38 @@
+/*---------------------------------------------------------------------------
+dbcmd
+planner.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include "bool.h"
+#include "list.h"
+
+struct _Plan;
+typedef struct _Plan Plan;
+
+// A group of transfers that is handed to one connection in one go:
+//   either a single file, or a batch of small ones
+typedef struct _PlanUnit
+  {
+  List *items;     // Of the items passed to plan_add(), not owned
+  int64_t bytes;
+  int requests;
+  int connection;  // Which connection the plan expects to carry it
+  } PlanUnit;
+
+// Returns a one-line description of an item, which the caller frees
+typedef char *(*PlanDescribeFn) (const void *item);
+
+Plan           *plan_create (int connections);
+void            plan_destroy (Plan *self);
+void            plan_add (Plan *self, void *item, int64_t bytes,
+                  int requests);
+void            plan_schedule (Plan *self);
+int             plan_length (const Plan *self);
+const PlanUnit *plan_get (const Plan *self, int index);
+void            plan_print (const Plan *self, PlanDescribeFn describe);
+int64_t         plan_cost (int64_t bytes, int requests);
+
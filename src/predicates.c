@@ -0,0 +1,241 @@
+/*---------------------------------------------------------------------------
+dbcmd
+predicates.c
+GPL v3.0
+
+The tests that find applies to each entry, as given by --name, --size,
+--mtime, --client-mtime and --type. An entry is selected only if it
+passes every one of them. Each is parsed once, when the options are
+read, so that checking an entry, which happens as the listing is
+decoded, is a few comparisons, and, for --name, a Matcher.
+
+Numbers work as they do for find(1): "+N" means more than N, "-N" less
+than N, and "N" exactly N. Times are in whole days before now, so
+--mtime=+90 selects what was last modified more than 90 days ago.
+Folders have no size or times, so a test of either never selects one.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "predicates.h"
+#include "matcher.h"
+
+typedef enum
+  {
+  PRED_NAME,
+  PRED_PATH,          // A name pattern with a '/' in it
+  PRED_SIZE,
+  PRED_MTIME,
+  PRED_CLIENT_MTIME,
+  PRED_TYPE
+  } PredKind;
+
+typedef struct _Predicate
+  {
+  PredKind kind;
+  int cmp;            // -1, 0, or 1, for "-N", "N", and "+N"
+  int64_t value;      // Bytes or days
+  DBType type;
+  Matcher *matcher;
+  } Predicate;
+
+struct _Predicates
+  {
+  Predicate *preds;
+  int npreds;
+  char *name;         // The first name pattern, or NULL
+  };
+
+
+/*---------------------------------------------------------------------------
+predicates_create
+---------------------------------------------------------------------------*/
+Predicates *predicates_create (void)
+  {
+  Predicates *self = malloc (sizeof (Predicates));
+  memset (self, 0, sizeof (Predicates));
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+predicates_destroy
+---------------------------------------------------------------------------*/
+void predicates_destroy (Predicates *self)
+  {
+  if (!self) return;
+  int i;
+  for (i = 0; i < self->npreds; i++)
+    if (self->preds[i].matcher) matcher_destroy (self->preds[i].matcher);
+  free (self->preds);
+  free (self->name);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+predicates_parse_number
+Parse "[+|-]N", followed by one of the suffixes in units, if units is
+not NULL, which multiply N by 1024, 1024^2, and so on
+---------------------------------------------------------------------------*/
+static BOOL predicates_parse_number (const char *s, const char *units,
+    int *cmp, int64_t *value)
+  {
+  *cmp = 0;
+  if (*s == '+') { *cmp = 1; s++; }
+  else if (*s == '-') { *cmp = -1; s++; }
+  if (*s < '0' || *s > '9') return FALSE;
+  char *end;
+  *value = strtoll (s, &end, 10);
+  if (*end && units)
+    {
+    const char *u = strchr (units, *end);
+    if (!u) return FALSE;
+    int i;
+    for (i = 0; i <= u - units; i++)
+      *value *= 1024;
+    end++;
+    }
+  return *end == 0;
+  }
+
+
+/*---------------------------------------------------------------------------
+predicates_add
+Add a test, for the option name (without its "--") with the argument arg
+---------------------------------------------------------------------------*/
+BOOL predicates_add (Predicates *self, const char *name, const char *arg,
+    char **error)
+  {
+  Predicate p;
+  memset (&p, 0, sizeof (Predicate));
+
+  if (strcmp (name, "name") == 0)
+    {
+    p.kind = strchr (arg, '/') ? PRED_PATH : PRED_NAME;
+    p.matcher = matcher_create (arg);
+    if (!self->name) self->name = strdup (arg);
+    }
+  else if (strcmp (name, "size") == 0)
+    {
+    p.kind = PRED_SIZE;
+    if (!predicates_parse_number (arg, "kMGT", &p.cmp, &p.value))
+      {
+      asprintf (error, "'%s' is not a size, such as +100M", arg);
+      return FALSE;
+      }
+    }
+  else if (strcmp (name, "mtime") == 0
+      || strcmp (name, "client-mtime") == 0)
+    {
+    p.kind = strcmp (name, "mtime") == 0 ? PRED_MTIME : PRED_CLIENT_MTIME;
+    if (!predicates_parse_number (arg, NULL, &p.cmp, &p.value))
+      {
+      asprintf (error, "'%s' is not a number of days, such as +90", arg);
+      return FALSE;
+      }
+    }
+  else if (strcmp (name, "type") == 0)
+    {
+    p.kind = PRED_TYPE;
+    if (strcmp (arg, "f") == 0)
+      p.type = DBSTAT_FILE;
+    else if (strcmp (arg, "d") == 0)
+      p.type = DBSTAT_FOLDER;
+    else
+      {
+      asprintf (error, "type must be f or d");
+      return FALSE;
+      }
+    }
+  else
+    {
+    asprintf (error, "Unknown test '%s'", name);
+    return FALSE;
+    }
+
+  self->preds = realloc (self->preds,
+    (self->npreds + 1) * sizeof (Predicate));
+  self->preds[self->npreds++] = p;
+  return TRUE;
+  }
+
+
+/*---------------------------------------------------------------------------
+predicates_get_name
+The first name pattern, which might be used to narrow the listing, or
+NULL if there isn't one
+---------------------------------------------------------------------------*/
+const char *predicates_get_name (const Predicates *self)
+  {
+  return self ? self->name : NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+predicates_compare
+---------------------------------------------------------------------------*/
+static BOOL predicates_compare (const Predicate *p, int64_t v)
+  {
+  if (p->cmp > 0) return v > p->value;
+  if (p->cmp < 0) return v < p->value;
+  return v == p->value;
+  }
+
+
+/*---------------------------------------------------------------------------
+predicates_days
+Whole days between t and now
+---------------------------------------------------------------------------*/
+static int64_t predicates_days (time_t t, time_t now)
+  {
+  return (int64_t)(now - t) / 86400;
+  }
+
+
+/*---------------------------------------------------------------------------
+predicates_match
+Whether stat passes every test. self may be NULL, when there are none
+---------------------------------------------------------------------------*/
+BOOL predicates_match (const Predicates *self, const DBStat *stat,
+    time_t now)
+  {
+  if (!self) return TRUE;
+  BOOL is_file = stat->type == DBSTAT_FILE;
+  int i;
+  for (i = 0; i < self->npreds; i++)
+    {
+    const Predicate *p = &self->preds[i];
+    BOOL ok;
+    switch (p->kind)
+      {
+      case PRED_NAME:
+        ok = matcher_match (p->matcher, dropbox_stat_get_name (stat));
+        break;
+      case PRED_PATH:
+        ok = matcher_match (p->matcher, stat->path);
+        break;
+      case PRED_SIZE:
+        ok = is_file && predicates_compare (p, stat->length);
+        break;
+      case PRED_MTIME:
+        ok = is_file && predicates_compare (p,
+          predicates_days (stat->server_modified, now));
+        break;
+      case PRED_CLIENT_MTIME:
+        ok = is_file && predicates_compare (p,
+          predicates_days (stat->client_modified, now));
+        break;
+      case PRED_TYPE:
+        ok = stat->type == p->type;
+        break;
+      default:
+        ok = FALSE;
+      }
+    if (!ok) return FALSE;
+    }
+  return TRUE;
+  }
+
@@ -0,0 +1,23 @@
+/*---------------------------------------------------------------------------
+dbcmd
+predicates.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <time.h>
+#include "bool.h"
+#include "dropbox_stat.h"
+
+struct _Predicates;
+typedef struct _Predicates Predicates;
+
+Predicates *predicates_create (void);
+void        predicates_destroy (Predicates *self);
+BOOL        predicates_add (Predicates *self, const char *name,
+              const char *arg, char **error);
+const char *predicates_get_name (const Predicates *self);
+BOOL        predicates_match (const Predicates *self, const DBStat *stat,
+              time_t now);
+
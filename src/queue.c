@@ -0,0 +1,140 @@
+/*---------------------------------------------------------------------------
+dbcmd
+queue.c
+GPL v3.0
+
+A bounded, blocking FIFO queue for passing work between threads. 
+Producers block while the queue is full, and consumers while it is 
+empty. Closing the queue wakes everybody up: pushes then fail, and pops 
+return NULL once the remaining items have been taken. NULL items can't
+be queued.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "queue.h"
+
+struct _Queue
+  {
+  void **items; // Circular buffer
+  int capacity;
+  int head;
+  int length;
+  BOOL closed;
+  QueueItemFreeFn free_fn;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  };
+
+
+/*---------------------------------------------------------------------------
+queue_create
+---------------------------------------------------------------------------*/
+Queue *queue_create (int capacity, QueueItemFreeFn free_fn)
+  {
+  Queue *self = malloc (sizeof (Queue));
+  memset (self, 0, sizeof (Queue));
+  if (capacity < 1) capacity = 1;
+  self->capacity = capacity;
+  self->items = malloc (capacity * sizeof (void *));
+  self->free_fn = free_fn;
+  pthread_mutex_init (&self->mutex, NULL);
+  pthread_cond_init (&self->not_empty, NULL);
+  pthread_cond_init (&self->not_full, NULL);
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+queue_destroy
+Any items still in the queue are freed, if there is a free function
+---------------------------------------------------------------------------*/
+void queue_destroy (Queue *self)
+  {
+  if (!self) return;
+  if (self->free_fn)
+    {
+    int i;
+    for (i = 0; i < self->length; i++)
+      self->free_fn (self->items[(self->head + i) % self->capacity]);
+    }
+  pthread_mutex_destroy (&self->mutex);
+  pthread_cond_destroy (&self->not_empty);
+  pthread_cond_destroy (&self->not_full);
+  free (self->items);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+queue_push
+Returns FALSE if the queue has been closed, in which case the item 
+still belongs to the caller
+---------------------------------------------------------------------------*/
+BOOL queue_push (Queue *self, void *item)
+  {
+  pthread_mutex_lock (&self->mutex);
+  while (self->length == self->capacity && !self->closed)
+    pthread_cond_wait (&self->not_full, &self->mutex);
+  BOOL ret = !self->closed;
+  if (ret)
+    {
+    self->items[(self->head + self->length) % self->capacity] = item;
+    self->length++;
+    pthread_cond_signal (&self->not_empty);
+    }
+  pthread_mutex_unlock (&self->mutex);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+queue_pop
+Returns NULL when the queue is closed and empty
+---------------------------------------------------------------------------*/
+void *queue_pop (Queue *self)
+  {
+  void *ret = NULL;
+  pthread_mutex_lock (&self->mutex);
+  while (self->length == 0 && !self->closed)
+    pthread_cond_wait (&self->not_empty, &self->mutex);
+  if (self->length > 0)
+    {
+    ret = self->items[self->head];
+    self->head = (self->head + 1) % self->capacity;
+    self->length--;
+    pthread_cond_signal (&self->not_full);
+    }
+  pthread_mutex_unlock (&self->mutex);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+queue_close
+---------------------------------------------------------------------------*/
+void queue_close (Queue *self)
+  {
+  pthread_mutex_lock (&self->mutex);
+  self->closed = TRUE;
+  pthread_cond_broadcast (&self->not_empty);
+  pthread_cond_broadcast (&self->not_full);
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*---------------------------------------------------------------------------
+queue_length
+---------------------------------------------------------------------------*/
+int queue_length (Queue *self)
+  {
+  pthread_mutex_lock (&self->mutex);
+  int ret = self->length;
+  pthread_mutex_unlock (&self->mutex);
+  return ret;
+  }
+
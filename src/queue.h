@@ -0,0 +1,22 @@
+/*---------------------------------------------------------------------------
+dbcmd
+queue.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bool.h"
+
+struct _Queue;
+typedef struct _Queue Queue;
+
+typedef void (*QueueItemFreeFn) (void *);
+
+Queue *queue_create (int capacity, QueueItemFreeFn free_fn);
+void   queue_destroy (Queue *self);
+BOOL   queue_push (Queue *self, void *item);
+void  *queue_pop (Queue *self);
+void   queue_close (Queue *self);
+int    queue_length (Queue *self);
+
@@ -0,0 +1,363 @@
+/*---------------------------------------------------------------------------
+dbcmd
+ranking.c
+GPL v3.0
+
+Puts listings in order, by name, size, or modification time, for
+list --sort and --top.
+
+Each entry gets a 64-bit key, arranged so that the entry that should
+come first has the smallest key, and only entries with the same key are
+compared by path. A full sort is a radix sort of 16-byte records of key
+and index in the store, so it doesn't go out to the DBStat records 
+themselves, which are scattered over the store's chunks, except to 
+settle ties. For names, the key is the first eight bytes of the path
+after the part that all the entries share; entries that tie are sorted
+again by the next eight bytes, and so on.
+
+To find the first N entries, a heap of N entries is kept while the
+listing arrives, with the one that would come last at the top, so an
+entry that doesn't belong in the top N is turned away with one
+comparison, and nothing is kept of it. The heap holds its own copies of
+the entries, so memory use depends on N, not on the size of the
+listing.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ranking.h"
+
+// Fewer entries than this are sorted with qsort(), rather than by radix
+#define RANK_RADIX_MIN 64
+
+// An entry in a full sort
+typedef struct _RankKey
+  {
+  uint64_t key;     // Smallest first
+  uint32_t index;   // In the store, which gives the path, for ties
+  } RankKey;
+
+// An entry in a RankTop
+typedef struct _RankEntry
+  {
+  uint64_t key;
+  const char *path;
+  DBStat *stat;     // Our own copy
+  } RankEntry;
+
+struct _RankTop
+  {
+  RankBy by;
+  int n;
+  int length;
+  RankEntry *heap; // heap[0] is the entry that would come last
+  };
+
+
+/*---------------------------------------------------------------------------
+ranking_parse
+Parse the argument of --sort. Returns FALSE if it isn't recognized
+---------------------------------------------------------------------------*/
+BOOL ranking_parse (const char *s, RankBy *by)
+  {
+  if (strcmp (s, "name") == 0)
+    *by = RANK_NAME;
+  else if (strcmp (s, "size") == 0)
+    *by = RANK_SIZE;
+  else if (strcmp (s, "mtime") == 0)
+    *by = RANK_MTIME;
+  else
+    return FALSE;
+  return TRUE;
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_key
+skip is the length of the start of the path that every entry shares
+---------------------------------------------------------------------------*/
+static uint64_t ranking_key (RankBy by, const DBStat *stat, size_t skip)
+  {
+  int64_t v;
+  switch (by)
+    {
+    case RANK_NAME:
+      {
+      const unsigned char *p = (const unsigned char *)
+        dropbox_stat_get_path (stat) + skip;
+      uint64_t key = 0;
+      int i;
+      for (i = 0; i < 8; i++)
+        {
+        key = (key << 8) | *p;
+        if (*p) p++;
+        }
+      return key;
+      }
+    case RANK_SIZE:
+      v = dropbox_stat_get_length (stat);
+      break;
+    case RANK_MTIME:
+      v = dropbox_stat_get_server_modified (stat);
+      break;
+    default:
+      return 0;
+    }
+  // Biggest first; folders have no size or time
+  return UINT64_MAX - (uint64_t)(v > 0 ? v : 0);
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_compare
+---------------------------------------------------------------------------*/
+static int ranking_compare (const void *p1, const void *p2)
+  {
+  const RankEntry *e1 = p1, *e2 = p2;
+  if (e1->key != e2->key) return e1->key < e2->key ? -1 : 1;
+  return strcmp (e1->path, e2->path);
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_compare_keys
+For a full sort, of RankKey records, which give the path by the index
+of the entry in the store
+---------------------------------------------------------------------------*/
+static int ranking_compare_keys (const void *p1, const void *p2, void *arg)
+  {
+  const RankKey *k1 = p1, *k2 = p2;
+  if (k1->key != k2->key) return k1->key < k2->key ? -1 : 1;
+  const DBStatStore *store = arg;
+  return strcmp (dropbox_stat_get_path (dropbox_stat_store_get 
+      (store, k1->index)), 
+    dropbox_stat_get_path (dropbox_stat_store_get (store, k2->index)));
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_radix
+Sort n records by key alone, a byte at a time, from the lowest. A byte
+that is the same in every key is skipped, as the top bytes of sizes 
+and times usually are. tmp has room for n records
+---------------------------------------------------------------------------*/
+static void ranking_radix (RankKey *keys, RankKey *tmp, uint32_t n)
+  {
+  RankKey *src = keys, *dst = tmp;
+  int shift;
+  for (shift = 0; shift < 64; shift += 8)
+    {
+    uint32_t count[256], i, total = 0;
+    memset (count, 0, sizeof (count));
+    for (i = 0; i < n; i++)
+      count[(src[i].key >> shift) & 0xff]++;
+    if (count[(src[0].key >> shift) & 0xff] == n) continue;
+    for (i = 0; i < 256; i++)
+      {
+      uint32_t c = count[i];
+      count[i] = total;
+      total += c;
+      }
+    for (i = 0; i < n; i++)
+      dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+    RankKey *t = src;
+    src = dst;
+    dst = t;
+    }
+  if (src != keys) memcpy (keys, src, n * sizeof (RankKey));
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_sort_range
+Sort n records, whose keys have been worked out from offset bytes into
+the path. After sorting by key, each run of records with the same key
+is sorted by path -- for names, by the key from the next eight bytes, 
+unless the names have ended
+---------------------------------------------------------------------------*/
+static void ranking_sort_range (const DBStatStore *store, RankBy by,
+    RankKey *keys, RankKey *tmp, uint32_t n, size_t offset)
+  {
+  if (n < RANK_RADIX_MIN)
+    {
+    qsort_r (keys, n, sizeof (RankKey), ranking_compare_keys, 
+      (void *)store);
+    return;
+    }
+  ranking_radix (keys, tmp, n);
+  uint32_t i = 0, j, k;
+  for (i = 0; i < n; i = j)
+    {
+    for (j = i + 1; j < n && keys[j].key == keys[i].key; j++)
+      ;
+    if (j - i == 1) continue;
+    if (by != RANK_NAME)
+      qsort_r (keys + i, j - i, sizeof (RankKey), ranking_compare_keys, 
+        (void *)store);
+    else if (keys[i].key & 0xff)
+      {
+      for (k = i; k < j; k++)
+        keys[k].key = ranking_key (by, dropbox_stat_store_get 
+          (store, keys[k].index), offset + 8);
+      ranking_sort_range (store, by, keys + i, tmp, j - i, offset + 8);
+      }
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_sort_store
+The indices of the entries in the store, in order. Caller frees the
+result, which has one element for each entry
+---------------------------------------------------------------------------*/
+uint32_t *ranking_sort_store (const DBStatStore *store, RankBy by)
+  {
+  uint32_t i, l = dropbox_stat_store_length (store);
+  uint32_t *ret = malloc ((l + 1) * sizeof (uint32_t));
+  if (by == RANK_NONE)
+    {
+    for (i = 0; i < l; i++) ret[i] = i;
+    return ret;
+    }
+
+  // The entries of a recursive listing all start with the same folder,
+  //   which would leave nothing of the names in their keys
+  size_t skip = 0;
+  if (by == RANK_NAME && l > 0)
+    {
+    const char *first = dropbox_stat_get_path (dropbox_stat_store_get 
+      (store, 0));
+    skip = strlen (first);
+    for (i = 1; i < l && skip > 0; i++)
+      {
+      const char *path = dropbox_stat_get_path (dropbox_stat_store_get 
+        (store, i));
+      size_t j = 0;
+      while (j < skip && path[j] == first[j]) j++;
+      skip = j;
+      }
+    }
+
+  RankKey *keys = malloc ((l + 1) * sizeof (RankKey));
+  for (i = 0; i < l; i++)
+    {
+    keys[i].key = ranking_key (by, dropbox_stat_store_get (store, i), skip);
+    keys[i].index = i;
+    }
+  RankKey *tmp = malloc ((l + 1) * sizeof (RankKey));
+  ranking_sort_range (store, by, keys, tmp, l, skip);
+  for (i = 0; i < l; i++) ret[i] = keys[i].index;
+  free (tmp);
+  free (keys);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_top_create
+Keeps the first n entries, by the order given, of those offered
+---------------------------------------------------------------------------*/
+RankTop *ranking_top_create (RankBy by, int n)
+  {
+  RankTop *self = malloc (sizeof (RankTop));
+  self->by = by;
+  self->n = n > 0 ? n : 0;
+  self->length = 0;
+  self->heap = malloc ((self->n + 1) * sizeof (RankEntry));
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_top_sift_down
+Restore the heap, after the entry at i has been replaced with one that
+might come earlier than its children
+---------------------------------------------------------------------------*/
+static void ranking_top_sift_down (RankTop *self, int i)
+  {
+  RankEntry *heap = self->heap;
+  while (TRUE)
+    {
+    int last = i, l = 2 * i + 1, r = l + 1;
+    if (l < self->length && ranking_compare (&heap[l], &heap[last]) > 0)
+      last = l;
+    if (r < self->length && ranking_compare (&heap[r], &heap[last]) > 0)
+      last = r;
+    if (last == i) break;
+    RankEntry t = heap[i];
+    heap[i] = heap[last];
+    heap[last] = t;
+    i = last;
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_top_offer
+Keep a copy of stat, if it is among the first n so far
+---------------------------------------------------------------------------*/
+void ranking_top_offer (RankTop *self, const DBStat *stat)
+  {
+  if (self->n == 0) return;
+  RankEntry e;
+  e.key = ranking_key (self->by, stat, 0);
+  e.path = dropbox_stat_get_path (stat);
+  if (self->length == self->n
+       && ranking_compare (&e, &self->heap[0]) >= 0)
+    return;
+
+  e.stat = dropbox_stat_clone (stat);
+  e.path = dropbox_stat_get_path (e.stat);
+  if (self->length == self->n)
+    {
+    dropbox_stat_destroy (self->heap[0].stat);
+    self->heap[0] = e;
+    ranking_top_sift_down (self, 0);
+    return;
+    }
+
+  RankEntry *heap = self->heap;
+  int i = self->length++;
+  heap[i] = e;
+  while (i > 0 && ranking_compare (&heap[i], &heap[(i - 1) / 2]) > 0)
+    {
+    RankEntry t = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = t;
+    i = (i - 1) / 2;
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_top_get
+The entries kept, in order, in a list that doesn't own them; they stay
+valid until the RankTop is destroyed. Call this once, when everything
+has been offered
+---------------------------------------------------------------------------*/
+List *ranking_top_get (RankTop *self)
+  {
+  qsort (self->heap, self->length, sizeof (RankEntry), ranking_compare);
+  List *ret = list_create (NULL);
+  int i;
+  for (i = 0; i < self->length; i++)
+    list_append (ret, self->heap[i].stat);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+ranking_top_destroy
+---------------------------------------------------------------------------*/
+void ranking_top_destroy (RankTop *self)
+  {
+  if (!self) return;
+  int i;
+  for (i = 0; i < self->length; i++)
+    dropbox_stat_destroy (self->heap[i].stat);
+  free (self->heap);
+  free (self);
+  }
+
@@ -0,0 +1,32 @@
+/*---------------------------------------------------------------------------
+dbcmd
+ranking.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include "bool.h"
+#include "list.h"
+#include "dropbox_stat.h"
+
+// What to put entries in order by
+typedef enum
+  {
+  RANK_NONE,  // The order they were listed in
+  RANK_NAME,  // Path, A-Z
+  RANK_SIZE,  // Largest first
+  RANK_MTIME  // Most recently modified on the server first
+  } RankBy;
+
+struct _RankTop;
+typedef struct _RankTop RankTop;
+
+BOOL      ranking_parse (const char *s, RankBy *by);
+uint32_t *ranking_sort_store (const DBStatStore *store, RankBy by);
+RankTop  *ranking_top_create (RankBy by, int n);
+void      ranking_top_offer (RankTop *self, const DBStat *stat);
+List     *ranking_top_get (RankTop *self);
+void      ranking_top_destroy (RankTop *self);
+
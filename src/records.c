@@ -0,0 +1,100 @@
+/*---------------------------------------------------------------------------
+dbcmd
+records.c
+GPL v3.0
+
+Entries written one to a line, as find --long writes them, so that get
+and delete can read them from standard input and act on them without
+listing the server again. Each line has six fields, separated by tabs:
+
+  file  size  server_modified  client_modified  content_hash  path
+  fldr  -     -                -                -             path
+
+with times in the server's form, 2017-03-01T14:23:05Z. The path comes
+last, so it may contain anything but a newline. A line that is not in
+this form is taken to be a path, with nothing known about it.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "records.h"
+#include "dropbox.h"
+
+#define RECORDS_FIELDS 6
+
+
+/*---------------------------------------------------------------------------
+records_write
+---------------------------------------------------------------------------*/
+void records_write (FILE *f, const DBStat *stat)
+  {
+  if (stat->type != DBSTAT_FILE)
+    {
+    fprintf (f, "fldr\t-\t-\t-\t-\t%s\n", stat->path);
+    return;
+    }
+
+  char smod[21], cmod[21], hash[DBHASH_LENGTH];
+  dropbox_format_timestamp (stat->server_modified, smod);
+  dropbox_format_timestamp (stat->client_modified, cmod);
+  if (stat->flags & DBSTAT_FLAG_HAS_HASH)
+    dropbox_hash_to_hex (stat->hash, hash);
+  else
+    strcpy (hash, "-");
+  fprintf (f, "file\t%ld\t%s\t%s\t%s\t%s\n", stat->length, smod, cmod,
+    hash, stat->path);
+  }
+
+
+/*---------------------------------------------------------------------------
+records_parse
+Set up stat, with dropbox_stat_init(), from a line, which is changed,
+and which stat refers to. Returns TRUE if the line had the attributes of
+the entry, and FALSE if it was only a path, in which case stat's type
+is DBSTAT_NONE
+---------------------------------------------------------------------------*/
+BOOL records_parse (char *line, DBStat *stat)
+  {
+  size_t len = strlen (line);
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    line[--len] = 0;
+
+  char *fields[RECORDS_FIELDS];
+  int n = 0;
+  char *p = line;
+  BOOL is_file = strncmp (line, "file\t", 5) == 0;
+  if (is_file || strncmp (line, "fldr\t", 5) == 0)
+    {
+    for (n = 0; n < RECORDS_FIELDS - 1; n++)
+      {
+      fields[n] = p;
+      p = strchr (p, '\t');
+      if (!p) break;
+      p++;
+      }
+    }
+  if (n < RECORDS_FIELDS - 1)
+    {
+    dropbox_stat_init (stat, line, NULL, DBSTAT_NONE);
+    return FALSE;
+    }
+  fields[n] = p;
+  for (n = 0; n < RECORDS_FIELDS - 1; n++)
+    fields[n + 1][-1] = 0;
+
+  dropbox_stat_init (stat, fields[5], NULL,
+    is_file ? DBSTAT_FILE : DBSTAT_FOLDER);
+  if (is_file)
+    {
+    stat->length = strtoll (fields[1], NULL, 10);
+    stat->server_modified = dropbox_parse_timestamp (fields[2]);
+    stat->client_modified = dropbox_parse_timestamp (fields[3]);
+    unsigned char hash[DBHASH_RAW_LENGTH];
+    if (dropbox_hash_from_hex (fields[4], hash))
+      dropbox_stat_set_hash_raw (stat, hash);
+    }
+  return TRUE;
+  }
+
@@ -0,0 +1,15 @@
+/*---------------------------------------------------------------------------
+dbcmd
+records.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdio.h>
+#include "bool.h"
+#include "dropbox_stat.h"
+
+void records_write (FILE *f, const DBStat *stat);
+BOOL records_parse (char *line, DBStat *stat);
+
@@ -0,0 +1,317 @@
+/*---------------------------------------------------------------------------
+dbcmd
+rules.c
+GPL v3.0
+
+Include and exclude rules, as given by --include, --exclude and
+--exclude-from, which work as rsync's do. The rules are checked in
+order against each file or directory, by its path relative to the top
+of the transfer, and the first one that matches decides whether it is
+included; something that no rule matches is included. A directory that
+is excluded is not looked into at all, so nothing in it can be included
+again.
+
+A pattern is split at its '/' characters, and each part is compiled
+once, as a Matcher, to be matched against one component of a path, so
+'*' and '?' never match a '/'. A pattern with no '/' is matched against
+the last component -- the name -- only. One that starts with '/' is
+anchored to the top of the transfer; otherwise it may match the last
+components of a path, however deep. A trailing '/' makes a rule apply
+only to directories. A component "**" matches any number of components,
+except at the end of a pattern, where it matches at least one, so that
+it matches everything in a directory, but not the directory itself; a
+last component of "***" matches the directory and everything in it.
+Unlike rsync, "**" inside a component, as in "foo**", is the same as
+'*'.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "rules.h"
+#include "matcher.h"
+
+// Paths with more components than this are split into heap memory
+#define RULES_MAX_STACK_COMPS 64
+
+typedef struct _Rule
+  {
+  BOOL include;
+  BOOL dir_only;   // Pattern ended in '/'
+  BOOL anchored;   // Pattern started with '/'
+  BOOL any_depth;  // Has a "**" component
+  BOOL tail_all;   // Ended in "/***"
+  int ncomps;
+  Matcher **comps; // NULL for a "**" component
+  } Rule;
+
+struct _Rules
+  {
+  Rule *rules;
+  int nrules;
+  };
+
+
+/*---------------------------------------------------------------------------
+rules_create
+---------------------------------------------------------------------------*/
+Rules *rules_create (void)
+  {
+  Rules *self = malloc (sizeof (Rules));
+  memset (self, 0, sizeof (Rules));
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_destroy
+---------------------------------------------------------------------------*/
+void rules_destroy (Rules *self)
+  {
+  if (!self) return;
+  int i, j;
+  for (i = 0; i < self->nrules; i++)
+    {
+    Rule *rule = &self->rules[i];
+    for (j = 0; j < rule->ncomps; j++)
+      matcher_destroy (rule->comps[j]);
+    free (rule->comps);
+    }
+  free (self->rules);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_compile_comp
+Compile one component of a pattern, of len characters, or return NULL
+if it is "**"
+---------------------------------------------------------------------------*/
+static Matcher *rules_compile_comp (const char *s, size_t len)
+  {
+  if (len == 2 && s[0] == '*' && s[1] == '*') return NULL;
+  // Runs of '*' are the same as one, to a Matcher
+  char *comp = strndup (s, len);
+  Matcher *ret = matcher_create (comp);
+  free (comp);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_add
+Add a rule to the end of the list
+---------------------------------------------------------------------------*/
+void rules_add (Rules *self, const char *pattern, BOOL include)
+  {
+  self->rules = realloc (self->rules, (self->nrules + 1) * sizeof (Rule));
+  Rule *rule = &self->rules[self->nrules++];
+  memset (rule, 0, sizeof (Rule));
+  rule->include = include;
+
+  size_t len = strlen (pattern);
+  while (len > 1 && pattern[len - 1] == '/')
+    {
+    rule->dir_only = TRUE;
+    len--;
+    }
+  while (len > 0 && pattern[0] == '/')
+    {
+    rule->anchored = TRUE;
+    pattern++;
+    len--;
+    }
+  if (len >= 3 && strncmp (pattern + len - 3, "***", 3) == 0
+       && (len == 3 || pattern[len - 4] == '/'))
+    {
+    rule->tail_all = TRUE;
+    len = len > 3 ? len - 4 : 0;
+    }
+
+  rule->comps = malloc ((len + 1) * sizeof (Matcher *));
+  const char *p = pattern, *end = pattern + len;
+  while (p < end)
+    {
+    const char *slash = memchr (p, '/', end - p);
+    if (!slash) slash = end;
+    if (slash > p)
+      {
+      Matcher *m = rules_compile_comp (p, slash - p);
+      if (!m) rule->any_depth = TRUE;
+      rule->comps[rule->ncomps++] = m;
+      }
+    p = slash + 1;
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_add_file
+Add the rules in a file, as --exclude-from does, or in standard input,
+if filename is "-". Each line is a pattern to exclude, unless it starts
+with "+ ", making it a pattern to include, or "- ". Blank lines, and
+lines that start with '#' or ';', are ignored
+---------------------------------------------------------------------------*/
+BOOL rules_add_file (Rules *self, const char *filename, char **error)
+  {
+  BOOL is_stdin = strcmp (filename, "-") == 0;
+  FILE *f = is_stdin ? stdin : fopen (filename, "r");
+  if (!f)
+    {
+    asprintf (error, "Can't open '%s': %s", filename, strerror (errno));
+    return FALSE;
+    }
+
+  char *line = NULL;
+  size_t n = 0;
+  ssize_t len;
+  while ((len = getline (&line, &n, f)) >= 0)
+    {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = 0;
+    if (len == 0 || line[0] == '#' || line[0] == ';') continue;
+    if (strncmp (line, "+ ", 2) == 0)
+      rules_add (self, line + 2, TRUE);
+    else if (strncmp (line, "- ", 2) == 0)
+      rules_add (self, line + 2, FALSE);
+    else
+      rules_add (self, line, FALSE);
+    }
+  free (line);
+
+  BOOL ret = !ferror (f);
+  if (!ret)
+    asprintf (error, "Can't read '%s': %s", filename, strerror (errno));
+  if (!is_stdin) fclose (f);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_match_from
+Whether the components of the rule from r match the components of the
+path from j to n
+---------------------------------------------------------------------------*/
+static BOOL rules_match_from (const Rule *rule, int r, char **comps,
+    int j, int n)
+  {
+  for (; r < rule->ncomps; r++, j++)
+    {
+    if (rule->comps[r] == NULL)
+      {
+      // At the end, "**" must match something
+      int k = (r == rule->ncomps - 1 && !rule->tail_all) ? j + 1 : j;
+      for (; k <= n; k++)
+        if (rules_match_from (rule, r + 1, comps, k, n)) return TRUE;
+      return FALSE;
+      }
+    if (j >= n || !matcher_match (rule->comps[r], comps[j])) return FALSE;
+    }
+  return j == n || rule->tail_all;
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_match
+Whether the rule matches the path whose components are comps[0..n)
+---------------------------------------------------------------------------*/
+static BOOL rules_match (const Rule *rule, char **comps, int n,
+    BOOL is_dir)
+  {
+  if (rule->dir_only && !is_dir) return FALSE;
+  if (rule->anchored)
+    return rules_match_from (rule, 0, comps, 0, n);
+  // Without "**", the rule can only match the last ncomps components
+  if (!rule->any_depth && !rule->tail_all)
+    return n >= rule->ncomps
+      && rules_match_from (rule, 0, comps, n - rule->ncomps, n);
+  int j;
+  for (j = 0; j < n; j++)
+    if (rules_match_from (rule, 0, comps, j, n)) return TRUE;
+  return FALSE;
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_check
+Whether the path comps[0..n) is excluded by the first rule that matches
+---------------------------------------------------------------------------*/
+static BOOL rules_check (const Rules *self, char **comps, int n,
+    BOOL is_dir)
+  {
+  int i;
+  for (i = 0; i < self->nrules; i++)
+    if (rules_match (&self->rules[i], comps, n, is_dir))
+      return !self->rules[i].include;
+  return FALSE;
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_check_path
+Split path into components, in buff, and check either the whole of it,
+or, if tree is TRUE, each directory above it, and then the path
+---------------------------------------------------------------------------*/
+static BOOL rules_check_path (const Rules *self, const char *path,
+    BOOL is_dir, BOOL tree)
+  {
+  if (!self || self->nrules == 0) return FALSE;
+
+  char *buff = strdup (path);
+  char *stack_comps [RULES_MAX_STACK_COMPS];
+  char **comps = stack_comps;
+  int n = 0, max = RULES_MAX_STACK_COMPS;
+  char *p, *save = NULL;
+  for (p = strtok_r (buff, "/", &save); p; p = strtok_r (NULL, "/", &save))
+    {
+    if (n == max)
+      {
+      max *= 2;
+      if (comps == stack_comps)
+        {
+        comps = malloc (max * sizeof (char *));
+        memcpy (comps, stack_comps, sizeof (stack_comps));
+        }
+      else
+        comps = realloc (comps, max * sizeof (char *));
+      }
+    comps[n++] = p;
+    }
+
+  BOOL ret = FALSE;
+  int k;
+  for (k = tree ? 1 : n; k <= n && !ret; k++)
+    ret = rules_check (self, comps, k, k < n || is_dir);
+
+  if (comps != stack_comps) free (comps);
+  free (buff);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_excluded
+Whether the rules exclude path, which is relative to the top of the
+transfer. The directories above it are taken to have been checked
+already, as they are when walking a tree. self may be NULL, when there
+are no rules
+---------------------------------------------------------------------------*/
+BOOL rules_excluded (const Rules *self, const char *path, BOOL is_dir)
+  {
+  return rules_check_path (self, path, is_dir, FALSE);
+  }
+
+
+/*---------------------------------------------------------------------------
+rules_excluded_tree
+As rules_excluded(), but path is also excluded if any directory above it
+is, for a listing that arrives all at once, rather than as a walk
+---------------------------------------------------------------------------*/
+BOOL rules_excluded_tree (const Rules *self, const char *path,
+    BOOL is_dir)
+  {
+  return rules_check_path (self, path, is_dir, TRUE);
+  }
+
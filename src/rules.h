@@ -0,0 +1,21 @@
+/*---------------------------------------------------------------------------
+dbcmd
+rules.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bool.h"
+
+struct _Rules;
+typedef struct _Rules Rules;
+
+Rules *rules_create (void);
+void   rules_destroy (Rules *self);
+void   rules_add (Rules *self, const char *pattern, BOOL include);
+BOOL   rules_add_file (Rules *self, const char *filename, char **error);
+BOOL   rules_excluded (const Rules *self, const char *path, BOOL is_dir);
+BOOL   rules_excluded_tree (const Rules *self, const char *path,
+         BOOL is_dir);
+
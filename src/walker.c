@@ -0,0 +1,418 @@
+/*---------------------------------------------------------------------------
+dbcmd
+walker.c
+GPL v3.0
+
+Walks a local directory tree on a pool of threads, delivering the 
+entries as a stream, through a bounded queue, to a consumer that 
+calls walker_next(). Entries come in no particular order.
+
+Directories are read through file descriptors -- each one is opened by
+its name, relative to a descriptor for the directory it is in, and its
+entries are examined relative to its own descriptor -- so the kernel 
+never has to resolve a path of more than one component, which matters
+on network filesystems, where each component can be a round trip. The
+relative paths that entries are reported by are built as labels only. 
+A directory that has subdirectories keeps a descriptor, shared by them,
+until they have all been opened. Only a quarter of the process's limit
+on open files may be held like this; past that, subdirectories are 
+opened by their paths from the base instead.
+The type reported by readdir() is trusted when there is one, so there
+is no stat() call for a regular file or directory unless the caller 
+wants sizes and times. Symlinks, and filesystems that don't report
+types, still need a stat.
+
+Symlinks to directories are followed, as stat() would follow them, but
+a directory that is its own ancestor (by device and inode) is not 
+expanded, so a symlink loop can't make the walk run forever.
+
+Entries that the include and exclude rules leave out are dropped as 
+they are read; an excluded directory is never opened, so nothing below
+it costs anything.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "walker.h"
+#include "workpool.h"
+#include "queue.h"
+#include "log.h"
+#include "rules.h"
+
+// Entries waiting for the consumer. When the queue is full, the 
+//  scanning threads wait, so memory use is bounded however large
+//  the tree is
+#define WALKER_QUEUE_SIZE 4096
+
+struct _Walker
+  {
+  int root_fd;
+  BOOL recursive;
+  BOOL need_stat;
+  const Rules *rules; // Or NULL
+  Queue *out;
+  WorkPool *pool;
+  pthread_t closer;
+  int held_fds;     // Held by WalkAncestors...
+  int max_held_fds; // ...of which there may be this many
+  };
+
+// The chain of directories above the one being scanned. Nodes are 
+//   shared by all the subdirectories of a directory, which may be
+//   scanned on different threads, so they are reference-counted
+typedef struct _WalkAncestor
+  {
+  dev_t dev;
+  ino_t ino;
+  int fd;           // To open subdirectories from, or -1
+  BOOL tried_fd;    // Whether fd has been asked for
+  struct _WalkAncestor *parent;
+  int refs;
+  } WalkAncestor;
+
+typedef struct _WalkDir
+  {
+  Walker *walker;
+  char *relative;
+  WalkAncestor *parent; // The directory this one is in, or NULL
+  } WalkDir;
+
+
+/*---------------------------------------------------------------------------
+walker_entry_free
+---------------------------------------------------------------------------*/
+void walker_entry_free (WalkEntry *entry)
+  {
+  if (!entry) return;
+  free (entry->relative);
+  free (entry);
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_join
+Returns dir/name, or just name if dir is empty
+---------------------------------------------------------------------------*/
+static char *walker_join (const char *dir, const char *name)
+  {
+  size_t dl = strlen (dir);
+  size_t nl = strlen (name);
+  char *ret = malloc (dl + nl + 2);
+  if (dl == 0)
+    memcpy (ret, name, nl + 1);
+  else
+    {
+    memcpy (ret, dir, dl);
+    ret[dl] = '/';
+    memcpy (ret + dl + 1, name, nl + 1);
+    }
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_emit
+Takes ownership of relative
+---------------------------------------------------------------------------*/
+static void walker_emit (Walker *self, WalkType type, char *relative, 
+    const struct stat *sb, int error)
+  {
+  WalkEntry *e = malloc (sizeof (WalkEntry));
+  e->type = type;
+  e->relative = relative;
+  e->have_stat = (sb != NULL);
+  e->size = sb ? sb->st_size : 0;
+  e->mtime = sb ? sb->st_mtime : 0;
+  e->error = error;
+  if (!queue_push (self->out, e))
+    walker_entry_free (e);
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_ancestor_hold_fd
+Keep a descriptor for the directory a, which is open as fd, for its
+subdirectories to be opened from, if not too many are held already. 
+Only the thread that is scanning a calls this, the first time it finds
+a subdirectory
+---------------------------------------------------------------------------*/
+static void walker_ancestor_hold_fd (Walker *self, WalkAncestor *a, int fd)
+  {
+  if (a->tried_fd) return;
+  a->tried_fd = TRUE;
+  if (__atomic_add_fetch (&self->held_fds, 1, __ATOMIC_RELAXED) 
+        <= self->max_held_fds)
+    a->fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+  if (a->fd < 0)
+    __atomic_sub_fetch (&self->held_fds, 1, __ATOMIC_RELAXED);
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_ancestor_release
+---------------------------------------------------------------------------*/
+static void walker_ancestor_release (Walker *self, WalkAncestor *a)
+  {
+  while (a && __atomic_sub_fetch (&a->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+    WalkAncestor *parent = a->parent;
+    if (a->fd >= 0)
+      {
+      close (a->fd);
+      __atomic_sub_fetch (&self->held_fds, 1, __ATOMIC_RELAXED);
+      }
+    free (a);
+    a = parent;
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_is_ancestor
+---------------------------------------------------------------------------*/
+static BOOL walker_is_ancestor (const WalkAncestor *a, const struct stat *sb)
+  {
+  for (; a != NULL; a = a->parent)
+    if (a->dev == sb->st_dev && a->ino == sb->st_ino) return TRUE;
+  return FALSE;
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_excluded
+If the rules exclude relative, free it, and return TRUE
+---------------------------------------------------------------------------*/
+static BOOL walker_excluded (const Walker *self, char *relative, 
+    BOOL is_dir)
+  {
+  if (!rules_excluded (self->rules, relative, is_dir)) return FALSE;
+  log_debug ("Excluding %s", relative);
+  free (relative);
+  return TRUE;
+  }
+
+
+static void walker_scan_dir (void *arg);
+
+/*---------------------------------------------------------------------------
+walker_found_dir
+Takes ownership of relative. parent_fd is the open descriptor of the
+directory that it was found in, parent, if there is one
+---------------------------------------------------------------------------*/
+static void walker_found_dir (Walker *self, char *relative, 
+    WalkAncestor *parent, int parent_fd)
+  {
+  if (self->recursive)
+    {
+    if (parent) walker_ancestor_hold_fd (self, parent, parent_fd);
+    WalkDir *d = malloc (sizeof (WalkDir));
+    d->walker = self;
+    d->relative = relative;
+    d->parent = parent;
+    if (parent) __atomic_add_fetch (&parent->refs, 1, __ATOMIC_RELAXED);
+    workpool_submit (self->pool, walker_scan_dir, d);
+    }
+  else
+    walker_emit (self, WALK_DIR_SKIPPED, relative, NULL, 0);
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_scan_dir
+A task on the pool: read one directory, emitting its files, and 
+submitting its subdirectories as further tasks
+---------------------------------------------------------------------------*/
+static void walker_scan_dir (void *arg)
+  {
+  WalkDir *d = arg;
+  Walker *self = d->walker;
+  char *relative = d->relative;
+  WalkAncestor *parent = d->parent;
+  free (d);
+
+  // A subdirectory is opened by its name, from the directory it's in
+  int fd;
+  const char *name = strrchr (relative, '/');
+  if (!relative[0])
+    fd = dup (self->root_fd);
+  else if (parent && parent->fd >= 0)
+    fd = openat (parent->fd, name ? name + 1 : relative, 
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  else
+    fd = openat (self->root_fd, relative, 
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct stat dsb;
+  if (fd < 0 || fstat (fd, &dsb) != 0)
+    {
+    walker_emit (self, WALK_OPEN_FAILED, relative, NULL, errno);
+    if (fd >= 0) close (fd);
+    walker_ancestor_release (self, parent);
+    return;
+    }
+  if (walker_is_ancestor (parent, &dsb))
+    {
+    walker_emit (self, WALK_OPEN_FAILED, relative, NULL, ELOOP);
+    close (fd);
+    walker_ancestor_release (self, parent);
+    return;
+    }
+  DIR *dir = fdopendir (fd);
+  if (!dir)
+    {
+    walker_emit (self, WALK_OPEN_FAILED, relative, NULL, errno);
+    close (fd);
+    walker_ancestor_release (self, parent);
+    return;
+    }
+
+  // Takes over our reference to parent
+  WalkAncestor *me = malloc (sizeof (WalkAncestor));
+  me->dev = dsb.st_dev;
+  me->ino = dsb.st_ino;
+  me->fd = -1;
+  me->tried_fd = FALSE;
+  me->parent = parent;
+  me->refs = 1;
+
+  struct dirent *de;
+  while ((de = readdir (dir)) != NULL)
+    {
+    const char *name = de->d_name;
+    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+      continue;
+
+    char *child = walker_join (relative, name);
+    unsigned char type = de->d_type;
+    if (type == DT_DIR)
+      {
+      if (!walker_excluded (self, child, TRUE))
+        walker_found_dir (self, child, me, fd);
+      }
+    else if (type == DT_REG && !self->need_stat)
+      {
+      if (!walker_excluded (self, child, FALSE))
+        walker_emit (self, WALK_FILE, child, NULL, 0);
+      }
+    else if (type == DT_REG || type == DT_LNK || type == DT_UNKNOWN)
+      {
+      // Follows symlinks, as stat() would
+      struct stat sb;
+      if (fstatat (fd, name, &sb, 0) != 0)
+        walker_emit (self, WALK_STAT_FAILED, child, NULL, errno);
+      else if (walker_excluded (self, child, S_ISDIR (sb.st_mode)))
+        continue;
+      else if (S_ISREG (sb.st_mode))
+        walker_emit (self, WALK_FILE, child, &sb, 0);
+      else if (S_ISDIR (sb.st_mode))
+        walker_found_dir (self, child, me, fd);
+      else
+        walker_emit (self, WALK_OTHER, child, NULL, 0);
+      }
+    else if (!walker_excluded (self, child, FALSE))
+      walker_emit (self, WALK_OTHER, child, NULL, 0);
+    }
+  closedir (dir);
+  free (relative);
+  walker_ancestor_release (self, me);
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_closer
+Closes the output queue once every directory has been scanned, so the
+consumer sees the end of the stream
+---------------------------------------------------------------------------*/
+static void *walker_closer (void *arg)
+  {
+  Walker *self = arg;
+  workpool_wait (self->pool);
+  queue_close (self->out);
+  return NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_start
+Starts walking base/relative, which may be a file or a directory. 
+If relative is "" or ".", the walk starts at base itself, and entries
+are relative to it. Everything below relative is checked against rules,
+if it is not NULL, by its path relative to base; it must outlive the
+walker. The walk runs in the background; the caller should call 
+walker_next() until it returns NULL, then walker_destroy()
+---------------------------------------------------------------------------*/
+Walker *walker_start (const char *base, const char *relative, 
+    BOOL recursive, BOOL need_stat, const Rules *rules, int threads)
+  {
+  Walker *self = malloc (sizeof (Walker));
+  memset (self, 0, sizeof (Walker));
+  self->recursive = recursive;
+  self->need_stat = need_stat;
+  self->rules = rules;
+  self->out = queue_create (WALKER_QUEUE_SIZE, 
+    (QueueItemFreeFn)walker_entry_free);
+  self->pool = workpool_create (threads);
+  struct rlimit rl;
+  self->max_held_fds = getrlimit (RLIMIT_NOFILE, &rl) == 0 
+    && rl.rlim_cur != RLIM_INFINITY ? (int)(rl.rlim_cur / 4) : 256;
+  if (strcmp (relative, ".") == 0) relative = "";
+
+  log_debug ("Walking %s/%s with %d thread(s)", base, relative, threads);
+
+  // The first entry is examined here; it is the only one whose type 
+  //   we don't get from readdir()
+  self->root_fd = open (base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct stat sb;
+  if (self->root_fd < 0)
+    walker_emit (self, WALK_STAT_FAILED, strdup (relative), NULL, errno);
+  else if (relative[0] == 0)
+    walker_found_dir (self, strdup (""), NULL, -1);
+  else if (fstatat (self->root_fd, relative, &sb, 0) != 0)
+    walker_emit (self, WALK_STAT_FAILED, strdup (relative), NULL, errno);
+  else if (S_ISREG (sb.st_mode))
+    walker_emit (self, WALK_FILE, strdup (relative), &sb, 0);
+  else if (S_ISDIR (sb.st_mode))
+    walker_found_dir (self, strdup (relative), NULL, -1);
+  else
+    walker_emit (self, WALK_OTHER, strdup (relative), NULL, 0);
+
+  pthread_create (&self->closer, NULL, walker_closer, self);
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_next
+Returns the next entry, which the caller must free with 
+walker_entry_free(), or NULL when the walk is finished
+---------------------------------------------------------------------------*/
+WalkEntry *walker_next (Walker *self)
+  {
+  return queue_pop (self->out);
+  }
+
+
+/*---------------------------------------------------------------------------
+walker_destroy
+If the consumer stops early, the remaining entries are discarded
+---------------------------------------------------------------------------*/
+void walker_destroy (Walker *self)
+  {
+  if (!self) return;
+  queue_close (self->out); // Releases any scanner blocked on a full queue
+  pthread_join (self->closer, NULL);
+  workpool_destroy (self->pool);
+  queue_destroy (self->out);
+  if (self->root_fd >= 0) close (self->root_fd);
+  free (self);
+  }
+
@@ -0,0 +1,42 @@
+/*---------------------------------------------------------------------------
+dbcmd
+walker.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include "bool.h"
+#include "rules.h"
+
+struct _Walker;
+typedef struct _Walker Walker;
+
+typedef enum 
+  {
+  WALK_FILE,        // A regular file (or a symlink to one)
+  WALK_DIR_SKIPPED, // A directory, not expanded as we are not recursive
+  WALK_OTHER,       // Not a regular file or a directory 
+  WALK_STAT_FAILED, // Couldn't find out what it is
+  WALK_OPEN_FAILED  // A directory that couldn't be read
+  } WalkType;
+
+typedef struct _WalkEntry
+  {
+  WalkType type;
+  char *relative;   // Relative to the base passed to walker_start()
+  BOOL have_stat;   // If FALSE, size and mtime are not set
+  int64_t size;
+  time_t mtime;
+  int error;        // errno, for the _FAILED types
+  } WalkEntry;
+
+Walker    *walker_start (const char *base, const char *relative, 
+             BOOL recursive, BOOL need_stat, const Rules *rules, 
+             int threads);
+WalkEntry *walker_next (Walker *self);
+void       walker_entry_free (WalkEntry *entry);
+void       walker_destroy (Walker *self);
+
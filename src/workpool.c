@@ -0,0 +1,286 @@
+/*---------------------------------------------------------------------------
+dbcmd
+workpool.c
+GPL v3.0
+
+A fixed-size pool of worker threads, with work stealing. Each worker 
+has its own double-ended queue of tasks. Tasks submitted by a worker 
+(such as subdirectories found while scanning a directory) go on that 
+worker's own queue, and it takes the most recent first, which keeps
+its working set small. A worker that runs out of tasks steals the 
+oldest task from another worker's queue, which tends to be the largest
+piece of work. Tasks submitted from outside the pool are spread 
+round-robin.
+
+The deques are simple mutex-protected ring buffers; tasks here are
+coarse (a directory scan, a file upload), so lock-free deques would not
+buy anything measurable.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "workpool.h"
+#include "bool.h"
+
+#define WORKPOOL_DEQUE_INITIAL 64
+
+typedef struct _WorkTask
+  {
+  WorkFn fn;
+  void *arg;
+  } WorkTask;
+
+typedef struct _WorkDeque
+  {
+  WorkTask *tasks; // Ring buffer; the owner works at the tail
+  int capacity;
+  int head;
+  int length;
+  pthread_mutex_t mutex;
+  } WorkDeque;
+
+struct _WorkPool
+  {
+  int nthreads;
+  pthread_t *threads;
+  WorkDeque *deques;
+  pthread_mutex_t mutex;   // Protects the fields below
+  pthread_cond_t work;     // Signalled when a task is queued
+  pthread_cond_t idle;     // Signalled when pending drops to zero
+  int queued;              // Tasks in the deques
+  int pending;             // Tasks submitted but not finished
+  int next;                // For round-robin submission
+  BOOL stopping;
+  };
+
+typedef struct _WorkerArg
+  {
+  WorkPool *pool;
+  int index;
+  } WorkerArg;
+
+// The pool and deque index of the current thread, if it is a worker
+static __thread WorkPool *workpool_current = NULL;
+static __thread int workpool_index = -1;
+
+
+/*---------------------------------------------------------------------------
+workpool_deque_push
+Adds at the tail
+---------------------------------------------------------------------------*/
+static void workpool_deque_push (WorkDeque *d, WorkFn fn, void *arg)
+  {
+  pthread_mutex_lock (&d->mutex);
+  if (d->length == d->capacity)
+    {
+    int capacity = d->capacity * 2;
+    WorkTask *tasks = malloc (capacity * sizeof (WorkTask));
+    int i;
+    for (i = 0; i < d->length; i++)
+      tasks[i] = d->tasks[(d->head + i) % d->capacity];
+    free (d->tasks);
+    d->tasks = tasks;
+    d->capacity = capacity;
+    d->head = 0;
+    }
+  WorkTask *t = &d->tasks[(d->head + d->length) % d->capacity];
+  t->fn = fn;
+  t->arg = arg;
+  d->length++;
+  pthread_mutex_unlock (&d->mutex);
+  }
+
+
+/*---------------------------------------------------------------------------
+workpool_deque_take
+Takes from the tail (the owner) or the head (a thief). Returns FALSE if
+the deque is empty
+---------------------------------------------------------------------------*/
+static BOOL workpool_deque_take (WorkDeque *d, BOOL from_tail, 
+    WorkTask *task)
+  {
+  BOOL ret = FALSE;
+  pthread_mutex_lock (&d->mutex);
+  if (d->length > 0)
+    {
+    if (from_tail)
+      *task = d->tasks[(d->head + d->length - 1) % d->capacity];
+    else
+      {
+      *task = d->tasks[d->head];
+      d->head = (d->head + 1) % d->capacity;
+      }
+    d->length--;
+    ret = TRUE;
+    }
+  pthread_mutex_unlock (&d->mutex);
+  return ret;
+  }
+
+
+/*---------------------------------------------------------------------------
+workpool_find_task
+Our own newest task, or failing that, another worker's oldest
+---------------------------------------------------------------------------*/
+static BOOL workpool_find_task (WorkPool *self, int index, WorkTask *task)
+  {
+  if (workpool_deque_take (&self->deques[index], TRUE, task)) return TRUE;
+  int i;
+  for (i = 1; i < self->nthreads; i++)
+    {
+    int victim = (index + i) % self->nthreads;
+    if (workpool_deque_take (&self->deques[victim], FALSE, task)) 
+      return TRUE;
+    }
+  return FALSE;
+  }
+
+
+/*---------------------------------------------------------------------------
+workpool_worker
+---------------------------------------------------------------------------*/
+static void *workpool_worker (void *p)
+  {
+  WorkerArg *wa = p;
+  WorkPool *self = wa->pool;
+  int index = wa->index;
+  free (wa);
+  workpool_current = self;
+  workpool_index = index;
+
+  while (TRUE)
+    {
+    WorkTask task;
+    if (workpool_find_task (self, index, &task))
+      {
+      pthread_mutex_lock (&self->mutex);
+      self->queued--;
+      pthread_mutex_unlock (&self->mutex);
+
+      task.fn (task.arg);
+
+      pthread_mutex_lock (&self->mutex);
+      self->pending--;
+      if (self->pending == 0)
+        pthread_cond_broadcast (&self->idle);
+      pthread_mutex_unlock (&self->mutex);
+      continue;
+      }
+
+    pthread_mutex_lock (&self->mutex);
+    // queued can briefly go negative, if a task is taken between being
+    //   pushed and being counted
+    while (self->queued <= 0 && !self->stopping)
+      pthread_cond_wait (&self->work, &self->mutex);
+    BOOL stop = self->stopping && self->queued <= 0;
+    pthread_mutex_unlock (&self->mutex);
+    if (stop) break;
+    }
+  return NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+workpool_create
+---------------------------------------------------------------------------*/
+WorkPool *workpool_create (int threads)
+  {
+  if (threads < 1) threads = 1;
+  WorkPool *self = malloc (sizeof (WorkPool));
+  memset (self, 0, sizeof (WorkPool));
+  self->nthreads = threads;
+  pthread_mutex_init (&self->mutex, NULL);
+  pthread_cond_init (&self->work, NULL);
+  pthread_cond_init (&self->idle, NULL);
+  self->deques = calloc (threads, sizeof (WorkDeque));
+  int i;
+  for (i = 0; i < threads; i++)
+    {
+    self->deques[i].capacity = WORKPOOL_DEQUE_INITIAL;
+    self->deques[i].tasks = malloc (WORKPOOL_DEQUE_INITIAL 
+      * sizeof (WorkTask));
+    pthread_mutex_init (&self->deques[i].mutex, NULL);
+    }
+  self->threads = malloc (threads * sizeof (pthread_t));
+  for (i = 0; i < threads; i++)
+    {
+    WorkerArg *wa = malloc (sizeof (WorkerArg));
+    wa->pool = self;
+    wa->index = i;
+    pthread_create (&self->threads[i], NULL, workpool_worker, wa);
+    }
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+workpool_submit
+Can be called from any thread, including the pool's own workers
+---------------------------------------------------------------------------*/
+void workpool_submit (WorkPool *self, WorkFn fn, void *arg)
+  {
+  int index;
+  pthread_mutex_lock (&self->mutex);
+  self->pending++;
+  if (workpool_current == self)
+    index = workpool_index;
+  else
+    index = self->next++ % self->nthreads;
+  pthread_mutex_unlock (&self->mutex);
+
+  // The task must be visible in a deque before it is counted as
+  //   queued, or a woken worker might not find it
+  workpool_deque_push (&self->deques[index], fn, arg);
+
+  pthread_mutex_lock (&self->mutex);
+  self->queued++;
+  pthread_cond_signal (&self->work);
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*---------------------------------------------------------------------------
+workpool_wait
+Blocks until every task submitted so far, and every task that those
+tasks submit, has finished. Must not be called by a worker
+---------------------------------------------------------------------------*/
+void workpool_wait (WorkPool *self)
+  {
+  pthread_mutex_lock (&self->mutex);
+  while (self->pending > 0)
+    pthread_cond_wait (&self->idle, &self->mutex);
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+
+/*---------------------------------------------------------------------------
+workpool_destroy
+Waits for outstanding tasks, then stops the workers
+---------------------------------------------------------------------------*/
+void workpool_destroy (WorkPool *self)
+  {
+  if (!self) return;
+  workpool_wait (self);
+  pthread_mutex_lock (&self->mutex);
+  self->stopping = TRUE;
+  pthread_cond_broadcast (&self->work);
+  pthread_mutex_unlock (&self->mutex);
+  int i;
+  for (i = 0; i < self->nthreads; i++)
+    pthread_join (self->threads[i], NULL);
+  for (i = 0; i < self->nthreads; i++)
+    {
+    pthread_mutex_destroy (&self->deques[i].mutex);
+    free (self->deques[i].tasks);
+    }
+  free (self->deques);
+  free (self->threads);
+  pthread_mutex_destroy (&self->mutex);
+  pthread_cond_destroy (&self->work);
+  pthread_cond_destroy (&self->idle);
+  free (self);
+  }
+
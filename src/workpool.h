@@ -0,0 +1,18 @@
+/*---------------------------------------------------------------------------
+dbcmd
+workpool.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+struct _WorkPool;
+typedef struct _WorkPool WorkPool;
+
+typedef void (*WorkFn) (void *arg);
+
+WorkPool *workpool_create (int threads);
+void      workpool_destroy (WorkPool *self);
+void      workpool_submit (WorkPool *self, WorkFn fn, void *arg);
+void      workpool_wait (WorkPool *self);
+
@@ -0,0 +1,417 @@
+/*---------------------------------------------------------------------------
+dbcmd
+zipstream.c
+GPL v3.0
+
+Unpacks a zip archive as it arrives, without storing the archive. A zip
+file is normally read from the end, where its directory is, but each
+entry is also preceded by a local header with its name, so the entries
+can be taken in order from the front. An archive that is written as it
+is sent, as the server's are, can't give the sizes in the local header;
+instead, each entry is followed by a data descriptor. The end of a
+deflated entry is found from the deflate stream itself; an entry that
+is stored uncompressed, with no size in its header, can't be read this
+way, and is reported as an error. The directory at the end is ignored.
+
+Data is passed on to the caller's sink for each entry as it is
+inflated, and its CRC checked at the end. Bytes that arrive before they
+can be used -- part of a header, for example -- are kept until more
+arrive.
+---------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include "zipstream.h"
+
+#define ZIP_LOCAL_SIG      0x04034b50
+#define ZIP_DESCRIPTOR_SIG 0x08074b50
+#define ZIP_CENTRAL_SIG    0x02014b50
+#define ZIP_END_SIG        0x06054b50
+#define ZIP_END64_SIG      0x06064b50
+
+#define ZIP_LOCAL_SIZE 30
+#define ZIP_FLAG_ENCRYPTED  0x0001
+#define ZIP_FLAG_DESCRIPTOR 0x0008
+#define ZIP_EXTRA_ZIP64     0x0001
+
+#define ZIP_METHOD_STORED   0
+#define ZIP_METHOD_DEFLATED 8
+
+#define ZIP_OUT_SIZE (64 * 1024)
+
+typedef enum {ZIP_HEADER, ZIP_DATA, ZIP_DESCRIPTOR, ZIP_DONE} ZipState;
+
+struct _ZipStream
+  {
+  ZipBeginFn begin;
+  ZipDataFn data;
+  ZipEndFn end;
+  void *user;
+  ZipState state;
+  // Input that has arrived but not been used
+  unsigned char *buff;
+  size_t length;
+  size_t capacity;
+  z_stream z;
+  BOOL z_ready;
+  unsigned char *out;
+  // The current entry
+  char *name;
+  void *sink;
+  BOOL sink_failed;
+  int flags;
+  int method;
+  BOOL zip64;
+  uint32_t expected_crc;
+  uint64_t expected_size;
+  uint64_t remaining; // Of a stored entry
+  uint32_t crc;
+  uint64_t size;
+  };
+
+
+/*---------------------------------------------------------------------------
+zipstream_le16
+---------------------------------------------------------------------------*/
+static uint32_t zipstream_le16 (const unsigned char *p)
+  {
+  return p[0] | (p[1] << 8);
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_le32
+---------------------------------------------------------------------------*/
+static uint32_t zipstream_le32 (const unsigned char *p)
+  {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_le64
+---------------------------------------------------------------------------*/
+static uint64_t zipstream_le64 (const unsigned char *p)
+  {
+  return zipstream_le32 (p) | ((uint64_t)zipstream_le32 (p + 4) << 32);
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_create
+---------------------------------------------------------------------------*/
+ZipStream *zipstream_create (ZipBeginFn begin, ZipDataFn data,
+    ZipEndFn end, void *user)
+  {
+  ZipStream *self = malloc (sizeof (ZipStream));
+  memset (self, 0, sizeof (ZipStream));
+  self->begin = begin;
+  self->data = data;
+  self->end = end;
+  self->user = user;
+  self->state = ZIP_HEADER;
+  self->out = malloc (ZIP_OUT_SIZE);
+  return self;
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_end_entry
+Tell the sink, if there is one, that the entry is finished -- or, if
+error is not NULL, that it failed
+---------------------------------------------------------------------------*/
+static void zipstream_end_entry (ZipStream *self, const char *error)
+  {
+  if (self->sink)
+    {
+    if (!error && self->sink_failed)
+      error = "data could not be stored";
+    self->end (self->sink, error, self->user);
+    }
+  self->sink = NULL;
+  free (self->name);
+  self->name = NULL;
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_destroy
+An entry that is still in progress is ended with an error
+---------------------------------------------------------------------------*/
+void zipstream_destroy (ZipStream *self)
+  {
+  if (!self) return;
+  zipstream_end_entry (self, "archive ended early");
+  if (self->z_ready) inflateEnd (&self->z);
+  free (self->out);
+  free (self->buff);
+  free (self);
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_emit
+Pass some of an entry's data to its sink
+---------------------------------------------------------------------------*/
+static void zipstream_emit (ZipStream *self, const unsigned char *data,
+    size_t length)
+  {
+  self->crc = crc32 (self->crc, data, length);
+  self->size += length;
+  if (self->sink && !self->sink_failed)
+    {
+    if (!self->data (self->sink, data, length))
+      self->sink_failed = TRUE;
+    }
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_check_entry
+Called at the end of an entry's data, when the expected CRC and size
+are known
+---------------------------------------------------------------------------*/
+static void zipstream_check_entry (ZipStream *self)
+  {
+  if (self->crc != self->expected_crc)
+    zipstream_end_entry (self, "CRC does not match");
+  else if (self->size != self->expected_size)
+    zipstream_end_entry (self, "size does not match");
+  else
+    zipstream_end_entry (self, NULL);
+  self->state = ZIP_HEADER;
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_header
+Parse a local header, if all of it has arrived. Returns the number of
+bytes used, or 0 if more are needed, or -1 on error
+---------------------------------------------------------------------------*/
+static long zipstream_header (ZipStream *self, char **error)
+  {
+  const unsigned char *p = self->buff;
+  if (self->length < 4) return 0;
+  uint32_t sig = zipstream_le32 (p);
+  if (sig == ZIP_CENTRAL_SIG || sig == ZIP_END_SIG || sig == ZIP_END64_SIG)
+    {
+    // The rest is the directory, which we don't need
+    self->state = ZIP_DONE;
+    return self->length;
+    }
+  if (sig != ZIP_LOCAL_SIG)
+    {
+    asprintf (error, "Bad zip header signature %08x", sig);
+    return -1;
+    }
+  if (self->length < ZIP_LOCAL_SIZE) return 0;
+  size_t name_len = zipstream_le16 (p + 26);
+  size_t extra_len = zipstream_le16 (p + 28);
+  size_t total = ZIP_LOCAL_SIZE + name_len + extra_len;
+  if (self->length < total) return 0;
+
+  self->flags = zipstream_le16 (p + 6);
+  self->method = zipstream_le16 (p + 8);
+  self->expected_crc = zipstream_le32 (p + 14);
+  uint64_t csize = zipstream_le32 (p + 18);
+  self->expected_size = zipstream_le32 (p + 22);
+  self->name = strndup ((const char *)p + ZIP_LOCAL_SIZE, name_len);
+
+  // A zip64 extra field has the sizes that don't fit in the header,
+  //   and means that the data descriptor has 64-bit sizes
+  self->zip64 = FALSE;
+  const unsigned char *extra = p + ZIP_LOCAL_SIZE + name_len;
+  size_t off = 0;
+  while (off + 4 <= extra_len)
+    {
+    size_t id = zipstream_le16 (extra + off);
+    size_t len = zipstream_le16 (extra + off + 2);
+    if (id == ZIP_EXTRA_ZIP64)
+      {
+      self->zip64 = TRUE;
+      if (len >= 16 && off + 4 + 16 <= extra_len)
+        {
+        self->expected_size = zipstream_le64 (extra + off + 4);
+        csize = zipstream_le64 (extra + off + 12);
+        }
+      }
+    off += 4 + len;
+    }
+
+  if (self->flags & ZIP_FLAG_ENCRYPTED)
+    {
+    asprintf (error, "Zip entry %s is encrypted", self->name);
+    return -1;
+    }
+  if (self->method == ZIP_METHOD_STORED
+       && (self->flags & ZIP_FLAG_DESCRIPTOR))
+    {
+    asprintf (error, "Zip entry %s is stored with no size", self->name);
+    return -1;
+    }
+  if (self->method != ZIP_METHOD_STORED
+       && self->method != ZIP_METHOD_DEFLATED)
+    {
+    asprintf (error, "Zip entry %s uses unsupported method %d",
+      self->name, self->method);
+    return -1;
+    }
+
+  self->remaining = csize;
+  self->crc = crc32 (0, NULL, 0);
+  self->size = 0;
+  self->sink_failed = FALSE;
+  self->sink = self->begin (self->name, self->user);
+  if (self->method == ZIP_METHOD_DEFLATED)
+    {
+    if (self->z_ready)
+      inflateReset (&self->z);
+    else
+      {
+      memset (&self->z, 0, sizeof (z_stream));
+      inflateInit2 (&self->z, -MAX_WBITS);
+      self->z_ready = TRUE;
+      }
+    }
+  self->state = ZIP_DATA;
+  return total;
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_inflate
+Inflate as much of the buffered input as possible. Returns the number of
+bytes used, or -1 on error
+---------------------------------------------------------------------------*/
+static long zipstream_inflate (ZipStream *self, char **error)
+  {
+  z_stream *z = &self->z;
+  z->next_in = self->buff;
+  z->avail_in = self->length;
+  int ret;
+  do
+    {
+    z->next_out = self->out;
+    z->avail_out = ZIP_OUT_SIZE;
+    ret = inflate (z, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      {
+      asprintf (error, "Can't inflate zip entry %s: %s", self->name,
+        z->msg ? z->msg : "corrupt data");
+      return -1;
+      }
+    zipstream_emit (self, self->out, ZIP_OUT_SIZE - z->avail_out);
+    } while (ret == Z_OK && (z->avail_in > 0 || z->avail_out == 0));
+
+  if (ret == Z_STREAM_END)
+    {
+    if (self->flags & ZIP_FLAG_DESCRIPTOR)
+      self->state = ZIP_DESCRIPTOR;
+    else
+      zipstream_check_entry (self);
+    }
+  return self->length - z->avail_in;
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_descriptor
+Parse the data descriptor that follows an entry whose sizes weren't
+known in advance. The signature is optional. Returns the number of
+bytes used, or 0 if more are needed
+---------------------------------------------------------------------------*/
+static long zipstream_descriptor (ZipStream *self)
+  {
+  if (self->length < 4) return 0;
+  size_t off = zipstream_le32 (self->buff) == ZIP_DESCRIPTOR_SIG ? 4 : 0;
+  size_t total = off + 4 + (self->zip64 ? 16 : 8);
+  if (self->length < total) return 0;
+  self->expected_crc = zipstream_le32 (self->buff + off);
+  if (self->zip64)
+    self->expected_size = zipstream_le64 (self->buff + off + 12);
+  else
+    self->expected_size = zipstream_le32 (self->buff + off + 8);
+  zipstream_check_entry (self);
+  return total;
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_feed
+Pass the next part of the archive. Returns FALSE if the archive can't
+be read any further, in which case *error is set
+---------------------------------------------------------------------------*/
+BOOL zipstream_feed (ZipStream *self, const void *data, size_t length,
+    char **error)
+  {
+  if (self->state == ZIP_DONE) return TRUE;
+  if (self->length + length > self->capacity)
+    {
+    self->capacity = (self->length + length) * 2;
+    self->buff = realloc (self->buff, self->capacity);
+    }
+  memcpy (self->buff + self->length, data, length);
+  self->length += length;
+
+  long used;
+  ZipState before;
+  do
+    {
+    before = self->state;
+    switch (self->state)
+      {
+      case ZIP_HEADER:
+        used = zipstream_header (self, error);
+        break;
+      case ZIP_DATA:
+        if (self->method == ZIP_METHOD_DEFLATED)
+          used = zipstream_inflate (self, error);
+        else
+          {
+          used = self->length < self->remaining ?
+            self->length : self->remaining;
+          zipstream_emit (self, self->buff, used);
+          self->remaining -= used;
+          if (self->remaining == 0)
+            zipstream_check_entry (self);
+          }
+        break;
+      case ZIP_DESCRIPTOR:
+        used = zipstream_descriptor (self);
+        break;
+      default:
+        used = self->length;
+      }
+    if (used < 0)
+      {
+      zipstream_end_entry (self, *error);
+      self->state = ZIP_DONE;
+      return FALSE;
+      }
+    memmove (self->buff, self->buff + used, self->length - used);
+    self->length -= used;
+    // An entry with no data is finished without using any bytes
+    } while ((used > 0 || self->state != before) 
+        && self->state != ZIP_DONE);
+
+  return TRUE;
+  }
+
+
+/*---------------------------------------------------------------------------
+zipstream_finish
+Call when there is no more of the archive. Returns FALSE if it ended
+before its directory
+---------------------------------------------------------------------------*/
+BOOL zipstream_finish (ZipStream *self, char **error)
+  {
+  if (self->state == ZIP_DONE) return TRUE;
+  asprintf (error, "Zip archive is incomplete");
+  zipstream_end_entry (self, *error);
+  return FALSE;
+  }
+
@@ -0,0 +1,31 @@
+/*---------------------------------------------------------------------------
+dbcmd
+zipstream.h
+GPL v3.0
+---------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stddef.h>
+#include "bool.h"
+
+struct _ZipStream;
+typedef struct _ZipStream ZipStream;
+
+// Called at the start of each entry in the archive. Returns a sink for
+//   the entry's data, or NULL if the data is not wanted
+typedef void *(*ZipBeginFn) (const char *name, void *user);
+// Called with each piece of an entry's data. Returns FALSE if the data
+//   can't be stored, after which no more is sent for the entry
+typedef BOOL (*ZipDataFn) (void *sink, const void *data, size_t length);
+// Called at the end of each entry that has a sink. error is NULL if all
+//   the data was delivered, and it checked out
+typedef void (*ZipEndFn) (void *sink, const char *error, void *user);
+
+ZipStream *zipstream_create (ZipBeginFn begin, ZipDataFn data,
+             ZipEndFn end, void *user);
+void       zipstream_destroy (ZipStream *self);
+BOOL       zipstream_feed (ZipStream *self, const void *data,
+             size_t length, char **error);
+BOOL       zipstream_finish (ZipStream *self, char **error);
+